@@ -1,3 +1,4 @@
+#include <chrono>
 #include <openssl/rsa.h>
 #include <string>
 #include <vector>
@@ -35,14 +36,39 @@ int main(int argc, char **argv) {
   // Connect to the server and perform the appropriate operation
   int sd = connect_to_server(args.server, args.port);
   ContextManager sdc([&]() { close(sd); });
+  if ((args.session || args.batchfile != "") && !client_session(sd, args.keyed ? pubkey : nullptr)) {
+    return -1;
+  }
+  if (args.batchfile != "") {
+    client_batch(sd, pubkey, args.batchfile, args.repeat);
+    return 0;
+  }
 
-  // Figure out which command was requested, and run it
+  // Figure out which command was requested, and run it as many times as
+  // requested.  Outside of a session, each run needs a new connection.
   vector<string> cmds = {REQ_REG, REQ_BYE, REQ_SET, REQ_GET, REQ_ALL, REQ_SAV};
   decltype(client_reg) *funcs[] = {client_reg, client_bye, client_set,
                                    client_get, client_all, client_sav};
-  for (size_t i = 0; i < cmds.size(); ++i) {
-    if (args.command == cmds[i]) {
-      funcs[i](sd, pubkey, args.username, args.userpass, args.arg1, args.arg2);
+  auto start = chrono::steady_clock::now();
+  for (int run = 0; run < args.repeat; ++run) {
+    if (run > 0 && !args.session) {
+      close(sd);
+      sd = connect_to_server(args.server, args.port);
     }
+    for (size_t i = 0; i < cmds.size(); ++i) {
+      if (args.command == cmds[i]) {
+        funcs[i](sd, pubkey, args.username, args.userpass, args.arg1,
+                 args.arg2);
+      }
+    }
+  }
+  if (args.repeat > 1) {
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start)
+                      .count();
+    cout << args.repeat << " ops in " << secs << " s ("
+         << (args.keyed     ? "keyed session"
+             : args.session ? "session"
+                            : "one connection per op")
+         << "): " << args.repeat / secs << " ops/sec\n";
   }
 }
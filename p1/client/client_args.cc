@@ -14,7 +14,7 @@ using namespace std;
 /// @param args The struct into which the parsed args should go
 void parse_args(int argc, char **argv, client_arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "k:u:w:s:p:C:1:2:h")) != -1) {
+  while ((opt = getopt(argc, argv, "k:u:w:s:p:C:1:2:n:SKB:h")) != -1) {
     switch (opt) {
     case 'p': // port of server
       args.port = atoi(optarg);
@@ -43,6 +43,19 @@ void parse_args(int argc, char **argv, client_arg_t &args) {
       args.usage |= args.arg2 != "";
       args.arg2 = string(optarg);
       break;
+    case 'n': // repeat count
+      args.repeat = atoi(optarg);
+      args.usage |= args.repeat < 1;
+      break;
+    case 'S': // session
+      args.session = true;
+      break;
+    case 'K': // keyed session
+      args.session = args.keyed = true;
+      break;
+    case 'B': // batch file
+      args.batchfile = string(optarg);
+      break;
     case 'h': // help message
       args.usage = true;
       break;
@@ -51,6 +64,11 @@ void parse_args(int argc, char **argv, client_arg_t &args) {
       return;
     }
   }
+  // A batch file takes the place of a command
+  if (args.batchfile != "") {
+    args.usage |= args.command != "" || args.arg1 != "" || args.arg2 != "";
+    return;
+  }
   // Validate command formats
   string arg0[] = {"BYE", "SAV", "REG"};
   string arg1[] = {"SET", "GET", "ALL"};
@@ -94,5 +112,12 @@ void usage(char *progname) {
        << " Other Options:\n"
        << "  -1          Provide first argument to a command\n"
        << "  -2          Provide second argument to a command\n"
+       << "  -n [int]    Run the command this many times, and report ops/sec\n"
+       << "  -S          Run the command(s) in one session, on one connection\n"
+       << "  -K          Like -S, but with a session key, so that only the first\n"
+       << "              request uses the server's public key\n"
+       << "  -B [file]   Pipeline the requests in a file, one per line as\n"
+       << "              <command> <user> <password> [<argument>], in a session\n"
+       << "              (with -n, the whole file is sent that many times)\n"
        << "  -h          Print help (this message)\n";
 }
@@ -28,6 +28,21 @@ struct client_arg_t {
   /// The second argument to the command (if any)
   std::string arg2 = "";
 
+  /// The number of times to run the command (if more than once, the rate is
+  /// reported)
+  int repeat = 1;
+
+  /// Run the commands in a session, on one connection, instead of one
+  /// connection per command?
+  bool session = false;
+
+  /// Establish a key for the session, so that only its first request is
+  /// encrypted with the server's public key?
+  bool keyed = false;
+
+  /// A file of requests to pipeline in a session, instead of running a command
+  std::string batchfile = "";
+
   /// Display a usage message?
   bool usage = false;
 };
@@ -1,10 +1,19 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
+#include <sstream>
 #include <string>
 #include <fstream>
+#include <sys/socket.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "../common/contextmanager.h"
 #include "../common/crypto.h"
@@ -48,18 +57,45 @@ void client_key(int sd, const string &keyfile) {
 }
 
 
-/// client_request() helps to generate r_block and a_block and encrypts them.
-/// send blocks to server on a socket descriptor
-/// get a response and decrypt it and return to client
+/// The socket on which a session has been started, if any, and the ID to give
+/// the next request that is made in it
+static int session_sd = -1;
+static int next_id = 0;
+
+/// The key of a keyed session, or empty if requests are made with an r_block
+static vec session_key;
+
+/// make_request() generates the r_block and a_block of a request, and
+/// encrypts them.  In a keyed session, it instead encrypts the command and
+/// message with the session key and a fresh IV.
 ///
-/// @param sd      The socket descriptor for communicating with the server
 /// @param pubkey  The public key of the server
 /// @param cmd     The command to request
 /// @param msg     The message to send
-vec client_request(int sd, RSA *pubkey, const vec &cmd, const vec &msg) {
+/// @param a_key   Set to the aes key that the response will be encrypted with
+///
+/// @returns the r_block followed by the a_block, or an empty vec on error
+static vec make_request(RSA *pubkey, const vec &cmd, const vec &msg,
+                        vec &a_key) {
+  if (!session_key.empty()) {
+    a_key = session_key;
+    if (!RAND_bytes(a_key.data() + AES_KEYSIZE, AES_IVSIZE)) {
+      cerr << "Error in RAND_bytes()\n";
+      return vec_from_string("");
+    }
+    vec plain = cmd;
+    vec_append(plain, msg);
+    EVP_CIPHER_CTX *ctx = create_aes_context(a_key, true);
+    vec body = aes_crypt_msg(ctx, plain);
+    reclaim_aes_context(ctx);
+    vec blocks = vec(a_key.begin() + AES_KEYSIZE, a_key.end());
+    vec_append(blocks, body.size());
+    vec_append(blocks, body);
+    return blocks;
+  }
 
   //generate aes_key and aes_context to encrypt
-  vec a_key = create_aes_key();
+  a_key = create_aes_key();
   EVP_CIPHER_CTX *ctx = create_aes_context(a_key, true);
 
   //implement default r_block and a_block
@@ -68,11 +104,9 @@ vec client_request(int sd, RSA *pubkey, const vec &cmd, const vec &msg) {
   unsigned char request[256];
 
   //append encrypted msg to a_block
-  //switch context to decrypting
   vec_append(a_block, aes_crypt_msg(ctx, msg));
-  reset_aes_context(ctx, a_key, false);
+  reclaim_aes_context(ctx);
 
-  //generate aes_key 
   //append cmd, a_key, a_block_size to r_block
   vec_append(r_block, cmd);
   vec_append(r_block, a_key);
@@ -86,20 +120,143 @@ vec client_request(int sd, RSA *pubkey, const vec &cmd, const vec &msg) {
     return vec_from_string("");
   }
 
-  //send r_block and a_block to server
-  if(!send_reliably(sd, vec(request, request + len))){
-    cerr << "request r_block is not sent\n";
+  //the r_block and a_block go out with one send, so that in a session the
+  //a_block doesn't wait for the r_block to be acknowledged
+  vec blocks = vec(request, request + len);
+  vec_append(blocks, a_block);
+  return blocks;
+}
+
+/// decrypt_response() decrypts the response to a request
+///
+/// @param a_key    The aes key of the request
+/// @param response The encrypted response
+///
+/// @returns the response
+static vec decrypt_response(const vec &a_key, const vec &response) {
+  EVP_CIPHER_CTX *ctx = create_aes_context(a_key, false);
+  vec res = aes_crypt_msg(ctx, response);
+  reclaim_aes_context(ctx);
+  return res;
+}
+
+/// client_session() starts a session on a socket.  From then on, the socket
+/// stays open after each request that is made on it, and each response is
+/// framed by its request's ID and its length.
+///
+/// @param sd     An open socket
+/// @param pubkey The public key of the server, to start a keyed session in
+///               which only the first request is encrypted with it, or null
+///
+/// @returns true if the server started the session
+bool client_session(int sd, RSA *pubkey) {
+  vec req = vec_from_string(REQ_SES);
+  vec a_key;
+  if (pubkey == nullptr) {
+    pad0(req, LEN_RKBLOCK);
+  } else {
+    req = make_request(pubkey, req, vec_from_string(""), a_key);
   }
-  if(!send_reliably(sd, a_block)){
-    cerr << "request a_block is not sent\n";
+
+  //either way, the response is short enough that, encrypted, it fits in one
+  //AES block, which is the size of an IV
+  vec res(pubkey == nullptr ? RES_OK.length() : AES_IVSIZE);
+  if (!send_reliably(sd, req) ||
+      reliable_get_to_eof_or_n(sd, res.begin(), res.size()) !=
+          (int)res.size() ||
+      (pubkey != nullptr && (res = decrypt_response(a_key, res)).empty()) ||
+      res != vec_from_string(RES_OK)) {
+    cerr << "session is not started\n";
+    return false;
   }
+  session_sd = sd;
+  session_key = a_key;
+  return true;
+}
 
-  //get response from server and decrypt it
-  vec response = aes_crypt_msg(ctx, reliable_get_to_eof(sd));
+/// get_session_response() reads the next response of a session
+///
+/// @param sd The socket of the session
+/// @param id Set to the ID of the request that the response is for
+///
+/// @returns the (encrypted) response, or an empty vec on error
+static vec get_session_response(int sd, int &id) {
+  vec id_bytes(sizeof(id));
+  if (reliable_get_to_eof_or_n(sd, id_bytes.begin(), id_bytes.size()) !=
+      (int)id_bytes.size()) {
+    return vec_from_string("");
+  }
+  memcpy(&id, id_bytes.data(), sizeof(id));
+  return reliable_get_framed(sd);
+}
 
-  //clear context and return response
-  reclaim_aes_context(ctx);
-  return response;
+/// make_msg() builds the message of a request: the user's name and password,
+/// and then, for SET, the contents of a file, or for GET, the name of the user
+/// whose content is wanted
+///
+/// @param cmd  The command to request
+/// @param user The name of the user doing the request
+/// @param pass The password of the user doing the request
+/// @param arg  The file to send (SET) or the user to fetch (GET)
+///
+/// @returns the message
+static vec make_msg(const string &cmd, const string &user, const string &pass,
+                    const string &arg) {
+  vec msg = vec_from_string("");
+  vec_append(msg, user.length());
+  vec_append(msg, user);
+  vec_append(msg, pass.length());
+  vec_append(msg, pass);
+  if (cmd == REQ_SET) {
+    vec content = load_entire_file(arg);
+    vec_append(msg, content.size());
+    vec_append(msg, content);
+  } else if (cmd == REQ_GET) {
+    vec_append(msg, arg.length());
+    vec_append(msg, arg);
+  }
+  return msg;
+}
+
+/// client_request() helps to generate r_block and a_block and encrypts them.
+/// send blocks to server on a socket descriptor
+/// get a response and decrypt it and return to client
+///
+/// @param sd      The socket descriptor for communicating with the server
+/// @param pubkey  The public key of the server
+/// @param cmd     The command to request
+/// @param msg     The message to send
+vec client_request(int sd, RSA *pubkey, const vec &cmd, const vec &msg) {
+  vec a_key;
+  vec blocks = make_request(pubkey, cmd, msg, a_key);
+  if (blocks.empty()) {
+    return blocks;
+  }
+
+  //in a session, the request goes out behind its ID
+  int id = next_id;
+  if (sd == session_sd) {
+    vec framed = vec_from_string("");
+    vec_append(framed, next_id++);
+    vec_append(framed, blocks);
+    blocks.swap(framed);
+  }
+  if(!send_reliably(sd, blocks)){
+    cerr << "request is not sent\n";
+  }
+
+  //get response from server and decrypt it.  In a session, the response is
+  //framed by the request's ID and its length, instead of running to EOF.
+  if (sd != session_sd) {
+    return decrypt_response(a_key, reliable_get_to_eof(sd));
+  }
+  int got_id = -1;
+  vec response = get_session_response(sd, got_id);
+  if (got_id != id) {
+    cerr << "response is for request " << got_id << ", not " << id << "\n";
+    return vec_from_string("");
+  }
+  return decrypt_response(a_key, response);
 }
 
 /// client_reg() sends the REG command to register a new user
@@ -114,12 +271,8 @@ void client_reg(int sd, RSA *pubkey, const string &user, const string &pass,
   if(user.length() > LEN_UNAME || pass.length() > LEN_PASS){
     cerr << RES_ERR_LOGIN << endl;
   }
-  vec msg = vec_from_string("");
-  vec_append(msg, user.length());
-  vec_append(msg, user);
-  vec_append(msg, pass.length());
-  vec_append(msg, pass);
-  vec response = client_request(sd, pubkey, vec_from_string("REG"), msg);
+  vec msg = make_msg(REQ_REG, user, pass, "");
+  vec response = client_request(sd, pubkey, vec_from_string(REQ_REG), msg);
   cerr << string(response.data(), response.data() + response.size()) << endl;;
 }
 
@@ -134,12 +287,8 @@ void client_bye(int sd, RSA *pubkey, const string &user, const string &pass,
   if(user.length() > LEN_UNAME || pass.length() > LEN_PASS){
     cerr << RES_ERR_LOGIN << endl;
   }
-  vec msg = vec_from_string("");
-  vec_append(msg, user.length());
-  vec_append(msg, user);
-  vec_append(msg, pass.length());
-  vec_append(msg, pass);
-  vec response = client_request(sd, pubkey, vec_from_string("BYE"), msg);
+  vec msg = make_msg(REQ_BYE, user, pass, "");
+  vec response = client_request(sd, pubkey, vec_from_string(REQ_BYE), msg);
   cerr << string(response.data(), response.data() + response.size()) << endl;
 }
 
@@ -154,12 +303,8 @@ void client_sav(int sd, RSA *pubkey, const string &user, const string &pass,
   if(user.length() > LEN_UNAME || pass.length() > LEN_PASS){
     cerr << RES_ERR_LOGIN << endl;
   }
-  vec msg = vec_from_string("");
-  vec_append(msg, user.length());
-  vec_append(msg, user);
-  vec_append(msg, pass.length());
-  vec_append(msg, pass);
-  vec response = client_request(sd, pubkey, vec_from_string("SAV"), msg);
+  vec msg = make_msg(REQ_SAV, user, pass, "");
+  vec response = client_request(sd, pubkey, vec_from_string(REQ_SAV), msg);
   cerr << string(response.data(), response.data() + response.size()) << endl;
 }
 
@@ -175,15 +320,8 @@ void client_set(int sd, RSA *pubkey, const string &user, const string &pass,
   if(user.length() > LEN_UNAME || pass.length() > LEN_PASS || setfile.length() > LEN_CONTENT){
     cerr << RES_ERR_LOGIN << endl;
   }
-  vec msg = vec_from_string("");
-  vec content = load_entire_file(setfile);
-  vec_append(msg, user.length());
-  vec_append(msg, user);
-  vec_append(msg, pass.length());
-  vec_append(msg, pass);
-  vec_append(msg, content.size());
-  vec_append(msg, content);
-  vec response = client_request(sd, pubkey, vec_from_string("SET"), msg);
+  vec msg = make_msg(REQ_SET, user, pass, setfile);
+  vec response = client_request(sd, pubkey, vec_from_string(REQ_SET), msg);
   cerr << string(response.data(), response.data() + response.size()) << endl;;
 }
 
@@ -200,14 +338,8 @@ void client_get(int sd, RSA *pubkey, const string &user, const string &pass,
   if(user.length() > LEN_UNAME || pass.length() > LEN_PASS || getname.length() > LEN_UNAME){
     cerr << RES_ERR_LOGIN << endl;
   }
-  vec msg = vec_from_string("");
-  vec_append(msg, user.length());
-  vec_append(msg, user);
-  vec_append(msg, pass.length());
-  vec_append(msg, pass);
-  vec_append(msg, getname.length());
-  vec_append(msg, getname);
-  vec response = client_request(sd, pubkey, vec_from_string("GET"), msg);
+  vec msg = make_msg(REQ_GET, user, pass, getname);
+  vec response = client_request(sd, pubkey, vec_from_string(REQ_GET), msg);
 
   //if ok, writes user's content to file
   if (response.size() >= 2 && response[0] == 'O' && response[1] == 'K'){
@@ -237,12 +369,8 @@ void client_all(int sd, RSA *pubkey, const string &user, const string &pass,
   if(user.length() > LEN_UNAME || pass.length() > LEN_PASS){
     cerr << RES_ERR_LOGIN << endl;
   }
-  vec msg = vec_from_string("");
-  vec_append(msg, user.length());
-  vec_append(msg, user);
-  vec_append(msg, pass.length());
-  vec_append(msg, pass);
-  vec response = client_request(sd, pubkey, vec_from_string("ALL"), msg);
+  vec msg = make_msg(REQ_ALL, user, pass, "");
+  vec response = client_request(sd, pubkey, vec_from_string(REQ_ALL), msg);
 
   //if ok, writes all users to allfile
   if (response.size() >= 2 && response[0] == 'O' && response[1] == 'K'){
@@ -257,3 +385,101 @@ void client_all(int sd, RSA *pubkey, const string &user, const string &pass,
     cerr << string(response.data(), response.data() + response.size()) << endl;;
   }
 }
+
+/// client_batch() makes the requests listed in a file, one per line, as
+/// <command> <user> <password> [<argument>], where the argument is the same as
+/// -1 would be.  The requests are pipelined in a session: a sender thread makes
+/// and sends every request without waiting for its response, while this thread
+/// matches each response to its request by ID, in whatever order they come.
+///
+/// @param sd        An open socket, on which a session has been started
+/// @param pubkey    The public key of the server
+/// @param batchfile The file listing the requests
+/// @param repeat    How many times the file's requests are sent
+void client_batch(int sd, RSA *pubkey, const string &batchfile,
+                  int repeat) {
+  //read the requests, and build their messages up front, so that the sender
+  //only has to encrypt and send
+  vector<pair<string, vec>> reqs;
+  ifstream in(batchfile);
+  string line;
+  while (getline(in, line)) {
+    istringstream words(line);
+    string cmd, user, pass, arg;
+    if (!(words >> cmd >> user >> pass)) {
+      continue;
+    }
+    words >> arg;
+    if (user.length() > LEN_UNAME || pass.length() > LEN_PASS) {
+      cerr << RES_ERR_LOGIN << endl;
+    }
+    reqs.emplace_back(cmd, make_msg(cmd, user, pass, arg));
+  }
+  //with -n, the file's requests go out that many times over, all in flight
+  //together
+  size_t lines = reqs.size();
+  reqs.reserve(lines * max(repeat, 1));
+  for (int run = 1; run < repeat; ++run) {
+    for (size_t i = 0; i < lines; ++i) {
+      reqs.push_back(reqs[i]);
+    }
+  }
+
+  //the aes key of each request that has been sent but not answered
+  unordered_map<int, vec> keys;
+  mutex keys_lock;
+
+  auto start = chrono::steady_clock::now();
+  thread sender([&]() {
+    for (auto &r : reqs) {
+      vec a_key;
+      vec blocks = make_request(pubkey, vec_from_string(r.first), r.second,
+                                a_key);
+      int id = next_id++;
+      {
+        lock_guard<mutex> g(keys_lock);
+        keys[id] = a_key;
+      }
+      vec framed = vec_from_string("");
+      vec_append(framed, id);
+      vec_append(framed, blocks);
+      if (blocks.empty() || !send_reliably(sd, framed)) {
+        cerr << "request is not sent\n";
+        break;
+      }
+    }
+    //once the server has answered everything, it will see EOF and end the
+    //session, so the loop below can't wait for a response that never comes
+    shutdown(sd, SHUT_WR);
+  });
+
+  //collect the responses, and count them by result
+  map<string, size_t> results;
+  size_t received = 0;
+  while (received < reqs.size()) {
+    int id = -1;
+    vec response = get_session_response(sd, id);
+    vec a_key;
+    {
+      lock_guard<mutex> g(keys_lock);
+      auto k = keys.find(id);
+      if (k == keys.end()) {
+        break;
+      }
+      a_key = k->second;
+      keys.erase(k);
+    }
+    response = decrypt_response(a_key, response);
+    string res(response.begin(), response.end());
+    ++results[res.substr(0, res.compare(0, 2, RES_OK) ? res.length() : 2)];
+    ++received;
+  }
+  sender.join();
+  double secs =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  cout << received << " of " << reqs.size() << " requests answered in " << secs
+       << " s (pipelined): " << received / secs << " ops/sec\n";
+  for (auto &r : results) {
+    cout << "  " << r.first << ": " << r.second << "\n";
+  }
+}
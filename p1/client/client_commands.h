@@ -10,6 +10,17 @@
 /// @param keyfile The name of the file to which the key should be written
 void client_key(int sd, const std::string &keyfile);
 
+/// client_session() starts a session on a socket.  From then on, the socket
+/// stays open after each request that is made on it, and each response is
+/// framed by its request's ID and its length.
+///
+/// @param sd     An open socket
+/// @param pubkey The public key of the server, to start a keyed session in
+///               which only the first request is encrypted with it, or null
+///
+/// @returns true if the server started the session
+bool client_session(int sd, RSA *pubkey = nullptr);
+
 /// client_reg() sends the REG command to register a new user
 ///
 /// @param sd      The socket descriptor for communicating with the server
@@ -74,3 +85,16 @@ void client_get(int sd, RSA *pubkey, const std::string &user,
 void client_all(int sd, RSA *pubkey, const std::string &user,
                 const std::string &pass, const std::string &allfile,
                 const std::string &);
+
+/// client_batch() makes the requests listed in a file, one per line, as
+/// <command> <user> <password> [<argument>], where the argument is the same as
+/// -1 would be.  The requests are pipelined in a session: they are all sent
+/// without waiting for responses, and each response is matched to its request
+/// by ID, in whatever order they come.
+///
+/// @param sd        An open socket, on which a session has been started
+/// @param pubkey    The public key of the server
+/// @param batchfile The file listing the requests
+/// @param repeat    How many times the file's requests are sent
+void client_batch(int sd, RSA *pubkey, const std::string &batchfile,
+                  int repeat = 1);
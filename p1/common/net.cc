@@ -135,6 +135,28 @@ vec reliable_get_to_eof(int sd) {
   }
 }
 
+/// Perform a reliable read of a message that is framed by its length: a 4-byte
+/// binary length, and then that many bytes.
+///
+/// @param sd The socket from which to read
+///
+/// @returns A vector with the message, or an empty vector on error
+vec reliable_get_framed(int sd) {
+  vec len(4);
+  if (reliable_get_to_eof_or_n(sd, len.begin(), 4) != 4) {
+    return {};
+  }
+  int size = *(int *)len.data();
+  if (size < 0) {
+    return {};
+  }
+  vec res(size);
+  if (reliable_get_to_eof_or_n(sd, res.begin(), size) != size) {
+    return {};
+  }
+  return res;
+}
+
 /// Connect to a server so that we can have bidirectional communication on the
 /// socket (represented by a file descriptor) that this function returns
 ///
@@ -201,7 +223,7 @@ int create_server_socket(size_t port) {
     sys_error(errno, "Error binding socket to local address: ");
     return -1;
   }
-  if (listen(sd, 0) < 0) {
+  if (listen(sd, SOMAXCONN) < 0) {
     close(sd);
     sys_error(errno, "Error listening on socket: ");
     return -1;
@@ -51,6 +51,14 @@ int reliable_get_to_eof_or_n(int sd, vec::iterator pos, int amnt);
 /// error
 vec reliable_get_to_eof(int sd);
 
+/// Perform a reliable read of a message that is framed by its length: a 4-byte
+/// binary length, and then that many bytes.
+///
+/// @param sd The socket from which to read
+///
+/// @returns A vector with the message, or an empty vector on error
+vec reliable_get_framed(int sd);
+
 /// Connect to a server so that we can have bidirectional communication on the
 /// socket (represented by a file descriptor) that this function returns
 ///
@@ -18,11 +18,11 @@
 ///
 /// A request always begins with a fixed-size RSA-encrypted block of bytes
 /// (@rblock), followed by a variable-size AES-encrypted block of bytes
-/// (@ablock).  The only exception to this is the KEY request, which consists of
-/// a fixed-size unencrypted block of bytes (@kblock). The @kblock or @rblock
-/// will always be LEN_MSG_MIN bytes, regardless of whether it is an
-/// RSA-encrypted block, or the "KEY" message.  KEY messages are padded with
-/// '\0' characters. In the discussion below, this padding is represented by the
+/// (@ablock).  The only exceptions to this are the KEY and SES requests, which
+/// consist of a fixed-size unencrypted block of bytes (@kblock). The @kblock or
+/// @rblock will always be LEN_MSG_MIN bytes, regardless of whether it is an
+/// RSA-encrypted block, or the "KEY" or "SES" message.  These messages are
+/// padded with '\0' characters. In the discussion below, this padding is represented by the
 /// function pad0(). RSA-encrypted blocks should be padded with random bytes by
 /// the RSA library.
 ///
@@ -64,6 +64,38 @@ const int LEN_RBLOCK_CONTENT = 128;
 /// @errors   None
 const std::string REQ_KEY = "KEY";
 
+/// Start a session, in which any number of requests can be made on the same
+/// connection.  Each request in the session is made just as it would be on a
+/// connection of its own (@rblock.@ablock), but with a 4-byte binary ID (@i)
+/// in front of it, which the client chooses.  Its response (@r) is framed by
+/// the same ID and its length instead of by <EOF>.  A client may send many
+/// requests without waiting for their responses, and the responses may come
+/// back in any order.  The session ends when the client closes the connection
+/// (or shuts down its writing side) between requests, or after the response to
+/// a BYE that stops the server.
+///
+/// @kblock   pad0("SES")
+/// @response "OK"
+/// @request  @i.@rblock.@ablock            -- Repeated for each request
+/// @response @i.len(@r).@r
+/// @errors   None
+///
+/// A session can instead be started with a keyed request: an ordinary rblock
+/// whose command is SES, and whose aeskey (@k, the AES key and an IV that the
+/// session doesn't use) becomes the session key.  After that, the server never
+/// decrypts an rblock again.  Each request gets a fresh random IV (@v), and its
+/// command (@c, such as "REG") and message (@m, just as it would go in an
+/// ablock) are encrypted with @k and @v.  The response is encrypted the same
+/// way.
+///
+/// @rblock   enc(pubkey, "SES".@k.length(@ablock))
+/// @ablock   enc(@k, "")
+/// @response enc(@k, "OK")
+/// @request  @i.@v.len(@x).@x              -- where @x = enc(@k.@v, @c.@m)
+/// @response @i.len(@r).@r                 -- where @r = enc(@k.@v, response)
+/// @errors   ERR_MSG_FMT (the keyed request can't be read)
+const std::string REQ_SES = "SES";
+
 /// Request the creation of a new user, with null content.  The user name must
 /// not already exist.
 ///
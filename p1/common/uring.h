@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <linux/io_uring.h>
+
+/// Uring is a minimal io_uring instance, set up with the raw io_uring_setup()
+/// and io_uring_enter() system calls (there is no liburing).  Requests are
+/// queued as submission queue entries (SQEs) without any system call, and a
+/// single submit() hands all of them to the kernel, and can wait for their
+/// completion queue entries (CQEs) in the same call.
+///
+/// Uring is not thread-safe: one thread should own it.
+class Uring {
+  /// The io_uring's file descriptor, or -1
+  int fd = -1;
+
+  /// The mapped submission and completion rings, and their sizes
+  void *sq_ptr = nullptr, *cq_ptr = nullptr;
+  size_t sq_len = 0, cq_len = 0;
+
+  /// The submission queue's fields, within sq_ptr
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+
+  /// The submission queue entries, and how many there are
+  io_uring_sqe *sqes = nullptr;
+  unsigned sq_entries = 0;
+
+  /// The tail of the submission queue, including SQEs that haven't been
+  /// handed to the kernel yet
+  unsigned local_tail = 0;
+
+  /// The completion queue's fields, within cq_ptr
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe *cqes;
+
+public:
+  /// The number of io_uring_enter() calls that have been made
+  uint64_t enters = 0;
+
+  /// The IORING_FEAT_* flags of the kernel's io_uring
+  unsigned features = 0;
+
+  /// Unmap the rings and close the io_uring
+  ~Uring();
+
+  /// Create the io_uring
+  ///
+  /// @param entries The number of submission queue entries
+  ///
+  /// @returns false if io_uring is unavailable (or too old to be used)
+  bool init(unsigned entries);
+
+  /// Get a zeroed SQE to fill in.  If the submission queue is full, the queued
+  /// SQEs are submitted first.
+  ///
+  /// @returns the SQE, or nullptr if the queue is still full
+  io_uring_sqe *get_sqe();
+
+  /// Hand every queued SQE to the kernel, and wait for CQEs
+  ///
+  /// @param wait The number of CQEs to wait for (0 to not wait)
+  ///
+  /// @returns the number of SQEs submitted, or -errno on error
+  int submit(unsigned wait);
+
+  /// Get the next CQE, without waiting
+  ///
+  /// @returns the CQE, or nullptr if there is none
+  io_uring_cqe *peek();
+
+  /// Mark the CQE from peek() as consumed
+  void seen();
+};
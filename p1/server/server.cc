@@ -7,7 +7,7 @@
 #include "../common/net.h"
 
 #include "server_args.h"
-#include "server_parsing.h"
+#include "server_reactor.h"
 #include "server_storage.h"
 
 using namespace std;
@@ -49,11 +49,11 @@ int main(int argc, char **argv) {
   int sd = create_server_socket(args.port);
   ContextManager csd([&]() { close(sd); });
 
-  // On a connection, parse the message, then dispatch
-  accept_client(sd,
-                [&](int sd) { return serve_client(sd, pri, pub, storage); });
+  // Serve connections from an event loop, with a pool of threads that parse
+  // the messages and dispatch them
+  serve_clients(sd, args.threads, args.uring, pri, pub, storage);
 
-  // When accept_client returns, it means we received a BYE command, so shut
+  // When serve_clients returns, it means we received a BYE command, so shut
   // down the storage and close the server socket
   storage.shutdown();
   cerr << "Server terminated\n";
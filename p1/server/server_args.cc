@@ -14,7 +14,7 @@ using namespace std;
 /// @param args The struct into which the parsed args should go
 void parse_args(int argc, char **argv, server_arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "p:f:k:ht:b:i:u:d:r:o:a:")) != -1) {
+  while ((opt = getopt(argc, argv, "p:f:k:ht:Ub:i:u:d:r:o:a:")) != -1) {
     switch (opt) {
     case 'p':
       args.port = atoi(optarg);
@@ -29,6 +29,12 @@ void parse_args(int argc, char **argv, server_arg_t &args) {
       args.usage = true;
       break;
     case 't':
+      args.threads = atoi(optarg);
+      args.usage |= args.threads < 1;
+      break;
+    case 'U':
+      args.uring = true;
+      break;
     case 'b':
     case 'i':
     case 'u':
@@ -53,7 +59,8 @@ void usage(char *progname) {
        << "  -p [int]    Port on which to listen for incoming connections\n"
        << "  -f [string] File for storing all data\n"
        << "  -k [string] Basename of file for storing the server's RSA keys\n"
-       << "  -t [int]    Ignored\n"
+       << "  -t [int]    # of threads that parse and run requests (default 4)\n"
+       << "  -U          Use io_uring for socket I/O (falls back to epoll)\n"
        << "  -b [int]    Ignored\n"
        << "  -i [int]    Ignored\n"
        << "  -u [int]    Ignored\n"
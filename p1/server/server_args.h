@@ -13,6 +13,12 @@ struct server_arg_t {
   /// The file holding the AES key
   std::string keyfile;
 
+  /// The number of threads that parse and run requests
+  int threads = 4;
+
+  /// Use io_uring for socket I/O, if the kernel has it?
+  bool uring = false;
+
   /// Display a usage message?
   bool usage = false;
 };
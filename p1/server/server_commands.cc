@@ -14,17 +14,16 @@ using namespace std;
 /// Respond to an ALL command by generating a list of all the usernames in the
 /// Auth table and returning them, one per line.
 ///
-/// @param sd      The socket onto which the result should be written
+/// @param out     The vec onto which the (encrypted) response is appended
 /// @param storage The Storage object, which contains the auth table
 /// @param ctx     The AES encryption context
 /// @param req     The unencrypted contents of the request
 ///
 /// @returns false, to indicate that the server shouldn't stop
-bool server_cmd_all(int sd, Storage &storage, EVP_CIPHER_CTX *ctx,
+bool server_cmd_all(vec &out, Storage &storage, EVP_CIPHER_CTX *ctx,
                     const vec &req) {
   
   int index = 0;
-  vec response = vec_from_string("");
 
   int u = *(int *)(req.data() + index);
   string username(req.begin() + index + 4, req.begin() + index + u + 4);
@@ -34,26 +33,22 @@ bool server_cmd_all(int sd, Storage &storage, EVP_CIPHER_CTX *ctx,
   string password(req.begin() + index + 4, req.begin() + index + p + 4);
   index += p + 4;
 
-  vec_append(response, aes_crypt_msg(ctx, storage.get_all_users(username, password).second));
-  if(!send_reliably(sd, response)){
-    cerr << "response is not sent\n";
-  }
+  vec_append(out, aes_crypt_msg(ctx, storage.get_all_users(username, password).second));
   return false;
 }
 
 /// Respond to a SET command by putting the provided data into the Auth table
 ///
-/// @param sd      The socket onto which the result should be written
+/// @param out     The vec onto which the (encrypted) response is appended
 /// @param storage The Storage object, which contains the auth table
 /// @param ctx     The AES encryption context
 /// @param req     The unencrypted contents of the request
 ///
 /// @returns false, to indicate that the server shouldn't stop
-bool server_cmd_set(int sd, Storage &storage, EVP_CIPHER_CTX *ctx,
+bool server_cmd_set(vec &out, Storage &storage, EVP_CIPHER_CTX *ctx,
                     const vec &req) {
 
   int index = 0;
-  vec response = vec_from_string("");
 
   int u = *(int *)(req.data() + index);
   string username(req.begin() + index + 4, req.begin() + index + u + 4);
@@ -70,26 +65,22 @@ bool server_cmd_set(int sd, Storage &storage, EVP_CIPHER_CTX *ctx,
   }
   index += c + 4;
 
-  vec_append(response, aes_crypt_msg(ctx, storage.set_user_data(username, password, content)));
-  if(!send_reliably(sd, response)){
-    cerr << "response is not sent\n";
-  }
+  vec_append(out, aes_crypt_msg(ctx, storage.set_user_data(username, password, content)));
   return false;
 }
 
 /// Respond to a GET command by getting the data for a user
 ///
-/// @param sd      The socket onto which the result should be written
+/// @param out     The vec onto which the (encrypted) response is appended
 /// @param storage The Storage object, which contains the auth table
 /// @param ctx     The AES encryption context
 /// @param req     The unencrypted contents of the request
 ///
 /// @returns false, to indicate that the server shouldn't stop
-bool server_cmd_get(int sd, Storage &storage, EVP_CIPHER_CTX *ctx,
+bool server_cmd_get(vec &out, Storage &storage, EVP_CIPHER_CTX *ctx,
                     const vec &req) {
 
   int index = 0;
-  vec response = vec_from_string("");
 
   int u = *(int *)(req.data() + index);
   string username(req.begin() + index + 4, req.begin() + index + u + 4);
@@ -103,26 +94,22 @@ bool server_cmd_get(int sd, Storage &storage, EVP_CIPHER_CTX *ctx,
   string who(req.begin() + index + 4, req.begin() + index + w + 4);
   index += w + 4;
 
-  vec_append(response, aes_crypt_msg(ctx, storage.get_user_data(username, password, who).second));
-  if(!send_reliably(sd, response)){
-    cerr << "response is not sent\n";
-  }
+  vec_append(out, aes_crypt_msg(ctx, storage.get_user_data(username, password, who).second));
   return false;
 }
 
 /// Respond to a REG command by trying to add a new user
 ///
-/// @param sd      The socket onto which the result should be written
+/// @param out     The vec onto which the (encrypted) response is appended
 /// @param storage The Storage object, which contains the auth table
 /// @param ctx     The AES encryption context
 /// @param req     The unencrypted contents of the request
 ///
 /// @returns false, to indicate that the server shouldn't stop
-bool server_cmd_reg(int sd, Storage &storage, EVP_CIPHER_CTX *ctx,
+bool server_cmd_reg(vec &out, Storage &storage, EVP_CIPHER_CTX *ctx,
                     const vec &req) {
 
   int index = 0;
-  vec response = vec_from_string("");
 
   int u = *(int *)(req.data() + index);
   string username(req.begin() + index + 4, req.begin() + index + u + 4);
@@ -133,42 +120,35 @@ bool server_cmd_reg(int sd, Storage &storage, EVP_CIPHER_CTX *ctx,
   index += p + 4;
 
   if(!storage.add_user(username, password)){
-    vec_append(response, aes_crypt_msg(ctx, vec_from_string(RES_ERR_USER_EXISTS)));
-    if(!send_reliably(sd, response)){
-      cerr << "response is not sent\n";
-    }
+    vec_append(out, aes_crypt_msg(ctx, vec_from_string(RES_ERR_USER_EXISTS)));
     return false;
   }
-  vec_append(response, aes_crypt_msg(ctx, vec_from_string(RES_OK)));
-  if(!send_reliably(sd, response)){
-    cerr << "response is not sent\n";
-  }
+  vec_append(out, aes_crypt_msg(ctx, vec_from_string(RES_OK)));
   return false;
 }
 
-/// In response to a request for a key, do a reliable send of the contents of
-/// the pubfile
+/// In response to a request for a key, respond with the contents of the
+/// pubfile
 ///
-/// @param sd The socket on which to write the pubfile
+/// @param out     The vec onto which the response is appended
 /// @param pubfile A vector consisting of pubfile contents
-void server_cmd_key(int sd, const vec &pubfile) {
-  send_reliably(sd, pubfile);
+void server_cmd_key(vec &out, const vec &pubfile) {
+  vec_append(out, pubfile);
 }
 
 /// Respond to a BYE command by returning false, but only if the user
 /// authenticates
 ///
-/// @param sd      The socket onto which the result should be written
+/// @param out     The vec onto which the (encrypted) response is appended
 /// @param storage The Storage object, which contains the auth table
 /// @param ctx     The AES encryption context
 /// @param req     The unencrypted contents of the request
 ///
 /// @returns true, to indicate that the server should stop, or false on an error
-bool server_cmd_bye(int sd, Storage &storage, EVP_CIPHER_CTX *ctx,
+bool server_cmd_bye(vec &out, Storage &storage, EVP_CIPHER_CTX *ctx,
                     const vec &req) {
 
   int index = 0;
-  vec response = vec_from_string("");
 
   int u = *(int *)(req.data() + index);
   string username(req.begin() + index + 4, req.begin() + index + u + 4);
@@ -179,33 +159,26 @@ bool server_cmd_bye(int sd, Storage &storage, EVP_CIPHER_CTX *ctx,
   index += p + 4;
 
   if(!storage.auth(username, password)){
-    vec_append(response, aes_crypt_msg(ctx, vec_from_string(RES_ERR_LOGIN)));
-    if(!send_reliably(sd, response)){
-      cerr << "response is not sent\n";
-    }
+    vec_append(out, aes_crypt_msg(ctx, vec_from_string(RES_ERR_LOGIN)));
     return false;
   }
-  vec_append(response, aes_crypt_msg(ctx, vec_from_string(RES_OK)));
-  if(!send_reliably(sd, response)){
-    cerr << "response is not sent\n";
-  }
+  vec_append(out, aes_crypt_msg(ctx, vec_from_string(RES_OK)));
   return true;
 }
 
 /// Respond to a SAV command by persisting the file, but only if the user
 /// authenticates
 ///
-/// @param sd      The socket onto which the result should be written
+/// @param out     The vec onto which the (encrypted) response is appended
 /// @param storage The Storage object, which contains the auth table
 /// @param ctx     The AES encryption context
 /// @param req     The unencrypted contents of the request
 ///
 /// @returns false, to indicate that the server shouldn't stop
-bool server_cmd_sav(int sd, Storage &storage, EVP_CIPHER_CTX *ctx,
+bool server_cmd_sav(vec &out, Storage &storage, EVP_CIPHER_CTX *ctx,
                     const vec &req) {
 
   int index = 0;
-  vec response = vec_from_string("");
 
   int u = *(int *)(req.data() + index);
   string username(req.begin() + index + 4, req.begin() + index + u + 4);
@@ -216,16 +189,10 @@ bool server_cmd_sav(int sd, Storage &storage, EVP_CIPHER_CTX *ctx,
   index += p + 4;
 
   if(!storage.auth(username, password)){
-    vec_append(response, aes_crypt_msg(ctx, vec_from_string(RES_ERR_LOGIN)));
-    if(!send_reliably(sd, response)){
-      cerr << "response is not sent\n";
-    }
+    vec_append(out, aes_crypt_msg(ctx, vec_from_string(RES_ERR_LOGIN)));
     return false;
   }
   storage.persist();
-  vec_append(response, aes_crypt_msg(ctx, vec_from_string(RES_OK)));
-  if(!send_reliably(sd, response)){
-    cerr << "response is not sent\n";
-  }
+  vec_append(out, aes_crypt_msg(ctx, vec_from_string(RES_OK)));
   return false;
 }
@@ -1,10 +1,10 @@
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <openssl/rsa.h>
 
 #include "../common/contextmanager.h"
 #include "../common/crypto.h"
-#include "../common/net.h"
 #include "../common/protocol.h"
 #include "../common/vec.h"
 
@@ -14,13 +14,13 @@
 
 using namespace std;
 
-///check the request block is k_block
-bool is_key(vec &block) {
-  if (block.size() != 256){ 
+///check the request block is a k_block: a name padded with '\0' characters
+bool is_kblock(const vec &block, const string &name) {
+  if (block.size() != LEN_RKBLOCK){
     return false;
   }
-  if (block[0] == 'K' && block[1] == 'E' && block[2] == 'Y') {
-    for(int i = 3 ; i < 256 ; i++){
+  if (equal(name.begin(), name.end(), block.begin())) {
+    for(int i = name.length() ; i < LEN_RKBLOCK ; i++){
       if(block[i] != '\0'){
         return false;
       }
@@ -30,77 +30,126 @@ bool is_key(vec &block) {
   return false;
 }
 
-/// When a new client connection is accepted, this code will run to figure out
-/// what the client is requesting, and to dispatch to the right function for
-/// satisfying the request.
+/// Run a request's command, once its message has been decrypted
 ///
-/// @param sd      The socket on which communication with the client takes place
-/// @param pri     The private key used by the server
-/// @param pub     The public key file contents, to send to the client
-/// @param storage The Storage object with which clients interact
+/// @param cmd      The command
+/// @param a_block  The decrypted message
+/// @param aes_ctx  An AES context, ready to encrypt the response
+/// @param storage  The Storage object with which clients interact
+/// @param response The vec to which the encrypted response is appended
 ///
-/// @returns true if the server should halt immediately, false otherwise
-bool serve_client(int sd, RSA *pri, const vec &pub, Storage &storage) {
+/// @returns true if the server should halt once the response is sent
+static bool dispatch(const string &cmd, const vec &a_block,
+                     EVP_CIPHER_CTX *aes_ctx, Storage &storage,
+                     vec &response) {
+  vector<string> cmds = {REQ_REG, REQ_BYE, REQ_SET, REQ_GET, REQ_ALL, REQ_SAV};
+  decltype(server_cmd_reg) *funcs[] = {server_cmd_reg, server_cmd_bye, server_cmd_set,
+                                   server_cmd_get, server_cmd_all, server_cmd_sav};
 
-  //generate pre-block for rk_block and response message for a_block;
-  //256 : len of rk_block
-  //1048780 : maximum possible size of a_block
-  unsigned char block1[256];
-  unsigned char block2[1048780];
-  unsigned char r_block[128];
-  vec first_block = vec(block1, block1 + 256);
-  vec second_block = vec(block2, block2 + 1048780);
-  vec a_block = vec_from_string("");
-  
-  //read request
-  if(reliable_get_to_eof_or_n(sd, first_block.begin(), LEN_RKBLOCK) < 0){
-    cerr << "cannot read rk_block 256 bytes from client\n";
-  }
-  //check first block is k_block
-  if (is_key(first_block)) {
-    server_cmd_key(sd, pub);
-    return false;
+  for (size_t i = 0; i < cmds.size(); ++i) {
+    if (cmd == cmds[i]) {
+      return funcs[i](response, storage, aes_ctx, a_block);
+    }
   }
 
+  //invalid command error
+  vec_append(response, aes_crypt_msg(aes_ctx, vec_from_string(RES_ERR_INV_CMD)));
+  return false;
+}
+
+/// Decrypt a request's r_block
+///
+/// @param pri    The private key used by the server
+/// @param block  The r_block, as it came from the client
+/// @param rblock Set to the parts of the r_block
+///
+/// @returns false if the r_block can't be decrypted
+bool parse_rblock(RSA *pri, const vec &block, rblock_t &rblock) {
+  unsigned char r_block[128];
+
   //decrypt r_block from client request
-  int len = RSA_private_decrypt(256, first_block.data(), r_block, pri, RSA_PKCS1_OAEP_PADDING);
+  int len = RSA_private_decrypt(256, block.data(), r_block, pri, RSA_PKCS1_OAEP_PADDING);
   if (len == -1) {
     cerr << "error decrypting\n";
     return false;
   }
 
   //command
-  string cmd = string(r_block, r_block + 3);
+  rblock.cmd = string(r_block, r_block + 3);
   //aes_key
-  vec aes_key = vec(r_block + 3, r_block + 51);
+  rblock.aes_key = vec(r_block + 3, r_block + 51);
   //size of a_block
-  int a_block_size = *(int *)(r_block + 51);
+  rblock.a_block_size = *(int *)(r_block + 51);
+  return true;
+}
 
-  //read request from given size of a_block
+/// Handle a request, once its a_block has arrived: decrypt the a_block, and
+/// dispatch to the right command.
+///
+/// @param storage     The Storage object with which clients interact
+/// @param rblock      The parts of the request's r_block
+/// @param second_block The request's a_block, as it came from the client.  If
+///                    it isn't a_block_size bytes, the request is malformed.
+/// @param response    The vec to which the encrypted response is appended
+/// @param session_key If not null, a SES request starts a keyed session, and
+///                    this is set to its key
+///
+/// @returns true if the server should halt once the response is sent
+bool serve_request(Storage &storage, const rblock_t &rblock,
+                   const vec &second_block, vec &response, vec *session_key) {
+  vec aes_key = rblock.aes_key;
   EVP_CIPHER_CTX *aes_ctx = create_aes_context(aes_key, false);
-  //check if a_block's size is as expected 
-  if(reliable_get_to_eof_or_n(sd, second_block.begin(), a_block_size) < 0){
+  ContextManager ctx_reclaim([&]() { reclaim_aes_context(aes_ctx); });
+
+  //check if a_block's size is as expected
+  if (rblock.a_block_size < 0 || rblock.a_block_size > LEN_ABLOCK_MAX ||
+      (int)second_block.size() != rblock.a_block_size) {
      reset_aes_context(aes_ctx, aes_key, true);
-     send_reliably(sd, aes_crypt_msg(aes_ctx, vec_from_string(RES_ERR_MSG_FMT)));
+     vec_append(response, aes_crypt_msg(aes_ctx, vec_from_string(RES_ERR_MSG_FMT)));
      return false;
   }
   //decrypt request into a_block
-  vec_append(a_block, aes_crypt_msg(aes_ctx, vec(second_block.begin(), second_block.begin() + a_block_size)));
+  vec a_block = aes_crypt_msg(aes_ctx, second_block);
   reset_aes_context(aes_ctx, aes_key, true);
 
-  vector<string> cmds = {REQ_REG, REQ_BYE, REQ_SET, REQ_GET, REQ_ALL, REQ_SAV};
-  decltype(server_cmd_reg) *funcs[] = {server_cmd_reg, server_cmd_bye, server_cmd_set,
-                                   server_cmd_get, server_cmd_all, server_cmd_sav};
-
-  for (size_t i = 0; i < cmds.size(); ++i) {
-    if (cmd == cmds[i]) {
-      return funcs[i](sd, storage, aes_ctx, a_block);
-    }
+  //a keyed session keeps the request's aes key for all of its requests
+  if (session_key != nullptr && rblock.cmd == REQ_SES) {
+    *session_key = aes_key;
+    vec_append(response, aes_crypt_msg(aes_ctx, vec_from_string(RES_OK)));
+    return false;
   }
+  return dispatch(rblock.cmd, a_block, aes_ctx, storage, response);
+}
 
-  //invalid command error
-  vec response = vec_from_string("");
-  vec_append(response, aes_crypt_msg(aes_ctx, vec_from_string(RES_ERR_INV_CMD)));
-  send_reliably(sd, response);
-  return false;
+/// Handle a request of a keyed session.  It is decrypted with the session key
+/// and the IV that comes with it, so no RSA work is done for it.
+///
+/// @param storage  The Storage object with which clients interact
+/// @param key      The session key
+/// @param iv       The request's IV
+/// @param body     The encrypted command and message
+/// @param response The vec to which the encrypted response is appended
+///
+/// @returns true if the server should halt once the response is sent
+bool serve_keyed_request(Storage &storage, const vec &key, const vec &iv,
+                         const vec &body, vec &response) {
+  //decrypt the command and message with the request's IV, and then encrypt
+  //the response with it too
+  vec request_key = key;
+  copy(iv.begin(), iv.end(), request_key.begin() + AES_KEYSIZE);
+  EVP_CIPHER_CTX *aes_ctx = create_aes_context(request_key, false);
+  if (aes_ctx == nullptr) {
+    return false;
+  }
+  ContextManager ctx_reclaim([&]() { reclaim_aes_context(aes_ctx); });
+  vec msg = aes_crypt_msg(aes_ctx, body);
+  reset_aes_context(aes_ctx, request_key, true);
+  if (msg.size() < 3) {
+    vec_append(response,
+               aes_crypt_msg(aes_ctx, vec_from_string(RES_ERR_MSG_FMT)));
+    return false;
+  }
+  return dispatch(string(msg.begin(), msg.begin() + 3),
+                  vec(msg.begin() + 3, msg.end()), aes_ctx, storage,
+                  response);
 }
@@ -1,15 +1,68 @@
 #pragma once
 
+#include <openssl/rsa.h>
+#include <string>
+
+#include "../common/vec.h"
+
 #include "server_storage.h"
 
-/// When a new client connection is accepted, this code will run to figure out
-/// what the client is requesting, and to dispatch to the right function for
-/// satisfying the request.
+/// The largest a_block (or keyed request) that the server will read
+const int LEN_ABLOCK_MAX = 1048780;
+
+/// The parts of a request's r_block, once it has been decrypted
+struct rblock_t {
+  /// The command
+  std::string cmd;
+
+  /// The AES key and iv of the request
+  vec aes_key;
+
+  /// The size of the request's a_block
+  int a_block_size = 0;
+};
+
+/// Check if a block is a k_block: a name padded with '\0' characters
+///
+/// @param block The block
+/// @param name  The name
+///
+/// @returns true if the block is name's k_block
+bool is_kblock(const vec &block, const std::string &name);
+
+/// Decrypt a request's r_block
+///
+/// @param pri    The private key used by the server
+/// @param block  The r_block, as it came from the client
+/// @param rblock Set to the parts of the r_block
+///
+/// @returns false if the r_block can't be decrypted
+bool parse_rblock(RSA *pri, const vec &block, rblock_t &rblock);
+
+/// Handle a request, once its a_block has arrived: decrypt the a_block, and
+/// dispatch to the right command.
+///
+/// @param storage     The Storage object with which clients interact
+/// @param rblock      The parts of the request's r_block
+/// @param second_block The request's a_block, as it came from the client.  If
+///                    it isn't a_block_size bytes, the request is malformed.
+/// @param response    The vec to which the encrypted response is appended
+/// @param session_key If not null, a SES request starts a keyed session, and
+///                    this is set to its key
+///
+/// @returns true if the server should halt once the response is sent
+bool serve_request(Storage &storage, const rblock_t &rblock,
+                   const vec &second_block, vec &response, vec *session_key);
+
+/// Handle a request of a keyed session.  It is decrypted with the session key
+/// and the IV that comes with it, so no RSA work is done for it.
 ///
-/// @param sd      The socket on which communication with the client takes place
-/// @param pri     The private key used by the server
-/// @param pub     The public key file contents, to send to the client
-/// @param storage The Storage object with which clients interact
+/// @param storage  The Storage object with which clients interact
+/// @param key      The session key
+/// @param iv       The request's IV
+/// @param body     The encrypted command and message
+/// @param response The vec to which the encrypted response is appended
 ///
-/// @returns true if the server should halt immediately, false otherwise
-bool serve_client(int sd, RSA *pri, const vec &pub, Storage &storage);
+/// @returns true if the server should halt once the response is sent
+bool serve_keyed_request(Storage &storage, const vec &key, const vec &iv,
+                         const vec &body, vec &response);
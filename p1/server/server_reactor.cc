@@ -0,0 +1,1027 @@
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/crypto.h"
+#include "../common/err.h"
+#include "../common/protocol.h"
+#include "../common/uring.h"
+#include "../common/vec.h"
+
+#include "server_commands.h"
+#include "server_parsing.h"
+#include "server_reactor.h"
+#include "server_storage.h"
+
+using namespace std;
+
+namespace {
+
+/// The most requests of one session that workers may hold at once.  Past this,
+/// the session's bytes are left unread until some of them are answered.
+const int MAX_INFLIGHT = 64;
+
+/// The most bytes of a connection that are read ahead of the frame that is
+/// being assembled
+const size_t READ_AHEAD = 64 << 10;
+
+/// The size of the header of a keyed request: its ID, IV and length
+const size_t LEN_KEYED_HEADER = 4 + AES_IVSIZE + 4;
+
+/// The number of submission queue entries of the io_uring
+const unsigned URING_ENTRIES = 4096;
+
+/// With io_uring, a receive doesn't get a buffer until data arrives, so that
+/// idle connections don't hold any.  The kernel picks one from a pool of this
+/// many buffers, of this size, which the reactor gives back once it has copied
+/// the data out.
+const unsigned URING_BUFFERS = 512;
+const size_t URING_BUFFER_SIZE = 16 << 10;
+
+/// conn_t is the state of one connection.  Only the reactor thread touches it.
+struct conn_t {
+  /// What the connection's next bytes should be
+  enum state_t {
+    /// The first block of the connection
+    FIRST,
+
+    /// Nothing, yet: a worker is decrypting an r_block, and until it's done,
+    /// the size of the a_block isn't known
+    PARSING,
+
+    /// The a_block of the request whose r_block was just decrypted
+    ABLOCK,
+
+    /// The ID and r_block of the next request of a session
+    SESSION,
+
+    /// The next request of a keyed session
+    KEYED,
+
+    /// Nothing: the connection is closed once its responses are sent
+    DONE
+  };
+
+  /// The connection's socket
+  int sd;
+
+  /// What the connection's next bytes should be
+  state_t state = FIRST;
+
+  /// Set once a session has started, so that responses are framed
+  bool session = false;
+
+  /// The key of a keyed session
+  vec session_key;
+
+  /// The r_block of the request whose a_block is being read, and (in a
+  /// session) the request's ID
+  rblock_t rblock;
+  vec id;
+
+  /// Bytes that have been read but not yet assembled into frames, from in_pos
+  vec in;
+  size_t in_pos = 0;
+
+  /// Bytes of responses that have not been sent yet, from out_pos
+  vec out;
+  size_t out_pos = 0;
+
+  /// With io_uring, the bytes of responses that have been submitted to be
+  /// sent, from sending_pos.  Responses that come in the meantime go to out,
+  /// so that this doesn't move while the kernel is reading it.
+  vec sending;
+  size_t sending_pos = 0;
+
+  /// With io_uring, whether a receive or send is in flight, and whether the
+  /// receive is being cancelled so that the connection can be closed
+  bool recv_armed = false;
+  bool send_armed = false;
+  bool cancelling = false;
+
+  /// The number of the connection's frames that the workers hold
+  int inflight = 0;
+
+  /// Set once the client has shut down its side of the connection
+  bool eof = false;
+
+  /// Set when the connection can't be used anymore, so it should be closed as
+  /// soon as no worker holds any of its frames
+  bool broken = false;
+
+  /// Set when reading stopped because enough was read ahead, instead of
+  /// because the socket had nothing more, so reading has to be resumed without
+  /// waiting for epoll
+  bool throttled = false;
+
+  /// Set when the server should halt once this connection's responses are sent
+  bool halt = false;
+
+  /// With io_uring, set while the connection is waiting to retry an operation
+  /// that couldn't be submitted because the submission queue was full
+  bool deferred = false;
+};
+
+/// job_t is a frame for a worker to handle, and, once it has, the result
+struct job_t {
+  /// The kinds of frames
+  enum kind_t {
+    /// An r_block, to decrypt
+    RBLOCK,
+
+    /// An a_block, whose r_block has been decrypted
+    REQUEST,
+
+    /// A request of a keyed session
+    KEYED
+  };
+
+  /// The kind of frame
+  kind_t kind;
+
+  /// The connection that the frame came from
+  conn_t *conn;
+
+  /// The request's ID, in a session
+  vec id;
+
+  /// The r_block (RBLOCK), the a_block (REQUEST), or the IV (KEYED)
+  vec block;
+
+  /// The encrypted command and message (KEYED)
+  vec body;
+
+  /// The r_block, once it is decrypted (RBLOCK), or to use (REQUEST)
+  rblock_t rblock;
+
+  /// The session key (KEYED)
+  vec key;
+
+  /// For REQUEST, whether a SES request may start a keyed session
+  bool may_start_session = false;
+
+  /// Set to false if the frame can't be handled, and the connection should be
+  /// closed
+  bool ok = true;
+
+  /// The encrypted response
+  vec response;
+
+  /// Set if the server should halt once the response is sent
+  bool halt = false;
+
+  /// Set to the key of the keyed session that the request starts, if any
+  vec session_key;
+};
+
+/// reactor_t is the state of the reactor thread and its workers
+struct reactor_t {
+  /// The private key used by the server
+  RSA *pri;
+
+  /// The public key file contents, to send to the client
+  const vec &pub;
+
+  /// The Storage object with which clients interact
+  Storage &storage;
+
+  /// The listening socket, the epoll instance, and the eventfd through which
+  /// workers wake the reactor
+  int listen_sd, ep, efd;
+
+  /// Every open connection, by socket
+  unordered_map<int, unique_ptr<conn_t>> conns;
+
+  /// Frames that are waiting for a worker, and frames that workers are done
+  /// with, which are waiting for the reactor.  Protected by lock.
+  deque<unique_ptr<job_t>> jobs, done;
+
+  /// Set when the workers should exit.  Protected by lock.
+  bool stop = false;
+
+  /// Protects jobs, done and stop
+  mutex lock;
+
+  /// Wakes workers when there are jobs
+  condition_variable work;
+
+  /// Set once a BYE has been answered
+  bool halted = false;
+
+  /// Buffer for reads
+  vec scratch = vec(READ_AHEAD);
+
+  /// The io_uring, or null to use epoll, and its pool of receive buffers
+  Uring *ring;
+  unsigned char *buffers;
+
+  /// What each io_uring operation is for.  An operation's user_data is its
+  /// socket, shifted left by 8 bits, and its op_t.
+  enum op_t { OP_ACCEPT, OP_EVENT, OP_RECV, OP_SEND, OP_CANCEL, OP_BUFFERS, OP_CLOSE };
+
+  /// Where the io_uring reads the eventfd's count to
+  uint64_t event_count;
+
+  /// Operations that couldn't be submitted because the submission queue was
+  /// full, which are retried on the next pass of the loop: the sockets of
+  /// connections to retry, ranges of buffers to give back (first ID and
+  /// count), and whether the accept and the eventfd read need to be armed
+  vector<int> deferred_conns;
+  vector<pair<unsigned, unsigned>> deferred_buffers;
+  bool deferred_accept = false, deferred_event = false;
+
+  /// The number of system calls made to do I/O (not counting io_uring_enter),
+  /// and the number of requests answered
+  atomic<uint64_t> syscalls{0};
+  uint64_t requests = 0;
+
+  reactor_t(RSA *_pri, const vec &_pub, Storage &_storage, int sd,
+            Uring *_ring, unsigned char *_buffers)
+      : pri(_pri), pub(_pub), storage(_storage), listen_sd(sd), ring(_ring),
+        buffers(_buffers) {}
+
+  /// A worker's main loop: take jobs, handle them, and hand them back
+  void worker_loop() {
+    while (true) {
+      unique_ptr<job_t> j;
+      {
+        unique_lock<mutex> g(lock);
+        work.wait(g, [&]() { return stop || !jobs.empty(); });
+        if (stop) {
+          return;
+        }
+        j = move(jobs.front());
+        jobs.pop_front();
+      }
+      if (j->kind == job_t::RBLOCK) {
+        j->ok = parse_rblock(pri, j->block, j->rblock);
+      } else if (j->kind == job_t::REQUEST) {
+        j->halt = serve_request(storage, j->rblock, j->block, j->response,
+                                j->may_start_session ? &j->session_key
+                                                     : nullptr);
+      } else {
+        j->halt =
+            serve_keyed_request(storage, j->key, j->block, j->body, j->response);
+      }
+      //the reactor takes everything that is done at once, so it only needs
+      //waking by the first of a batch
+      bool wake;
+      {
+        lock_guard<mutex> g(lock);
+        wake = done.empty();
+        done.push_back(move(j));
+      }
+      uint64_t one = 1;
+      if (wake) {
+        ++syscalls;
+        if (write(efd, &one, sizeof(one)) < 0) {
+          sys_error(errno, "Error waking the reactor: ");
+        }
+      }
+    }
+  }
+
+  /// Hand a frame of a connection to the workers
+  void submit(conn_t &c, job_t::kind_t kind, vec id, vec block) {
+    auto j = make_unique<job_t>();
+    j->kind = kind;
+    j->conn = &c;
+    j->id = move(id);
+    j->block = move(block);
+    submit(move(j));
+  }
+
+  /// Hand a job to the workers
+  void submit(unique_ptr<job_t> j) {
+    ++j->conn->inflight;
+    {
+      lock_guard<mutex> g(lock);
+      jobs.push_back(move(j));
+    }
+    work.notify_one();
+  }
+
+  /// Take the next bytes of a connection's input
+  vec take(conn_t &c, size_t bytes) {
+    vec res(c.in.begin() + c.in_pos, c.in.begin() + c.in_pos + bytes);
+    c.in_pos += bytes;
+    if (c.in_pos == c.in.size()) {
+      //an idle connection shouldn't keep a big buffer around
+      if (c.in.capacity() > READ_AHEAD) {
+        vec().swap(c.in);
+      }
+      c.in.clear();
+      c.in_pos = 0;
+    } else if (c.in_pos >= READ_AHEAD) {
+      c.in.erase(c.in.begin(), c.in.begin() + c.in_pos);
+      c.in_pos = 0;
+    }
+    return res;
+  }
+
+  /// The number of bytes that the frame being assembled needs
+  size_t frame_bytes(conn_t &c) {
+    if (c.state == conn_t::ABLOCK) {
+      return c.rblock.a_block_size;
+    }
+    if (c.state == conn_t::KEYED &&
+        c.in.size() - c.in_pos >= LEN_KEYED_HEADER) {
+      return LEN_KEYED_HEADER +
+             *(int *)(c.in.data() + c.in_pos + 4 + AES_IVSIZE);
+    }
+    return 0;
+  }
+
+  /// Assemble as many frames as possible from the bytes that have been read,
+  /// and hand them to the workers
+  void assemble(conn_t &c) {
+    while (!c.broken) {
+      size_t avail = c.in.size() - c.in_pos;
+      if (c.state == conn_t::FIRST) {
+        if (avail < LEN_RKBLOCK) {
+          return;
+        }
+        vec block = take(c, LEN_RKBLOCK);
+        if (is_kblock(block, REQ_KEY)) {
+          ++requests;
+          server_cmd_key(c.out, pub);
+          c.state = conn_t::DONE;
+          flush(c);
+        } else if (is_kblock(block, REQ_SES)) {
+          vec_append(c.out, RES_OK);
+          c.session = true;
+          c.state = conn_t::SESSION;
+          flush(c);
+        } else {
+          submit(c, job_t::RBLOCK, vec(), move(block));
+          c.state = conn_t::PARSING;
+        }
+      } else if (c.state == conn_t::SESSION) {
+        if (c.inflight >= MAX_INFLIGHT || avail < 4 + LEN_RKBLOCK) {
+          return;
+        }
+        vec id = take(c, 4);
+        submit(c, job_t::RBLOCK, move(id), take(c, LEN_RKBLOCK));
+        c.state = conn_t::PARSING;
+      } else if (c.state == conn_t::ABLOCK) {
+        //a one-shot request whose a_block is cut short still gets a response
+        if (avail < (size_t)c.rblock.a_block_size && !(c.eof && !c.session)) {
+          return;
+        }
+        submit_request(c, take(c, min(avail, (size_t)c.rblock.a_block_size)));
+        c.state = c.session ? conn_t::SESSION : conn_t::DONE;
+      } else if (c.state == conn_t::KEYED) {
+        if (c.inflight >= MAX_INFLIGHT || avail < LEN_KEYED_HEADER) {
+          return;
+        }
+        int len = *(int *)(c.in.data() + c.in_pos + 4 + AES_IVSIZE);
+        if (len < 0 || len > LEN_ABLOCK_MAX) {
+          cerr << "keyed request is too big\n";
+          c.broken = true;
+          return;
+        }
+        if (avail < LEN_KEYED_HEADER + len) {
+          return;
+        }
+        auto j = make_unique<job_t>();
+        j->kind = job_t::KEYED;
+        j->conn = &c;
+        j->id = take(c, 4);
+        j->block = take(c, AES_IVSIZE);
+        take(c, 4);
+        j->body = take(c, len);
+        j->key = c.session_key;
+        submit(move(j));
+      } else {
+        return;
+      }
+    }
+  }
+
+  /// Hand a request whose a_block has arrived to the workers
+  void submit_request(conn_t &c, vec a_block) {
+    auto j = make_unique<job_t>();
+    j->kind = job_t::REQUEST;
+    j->conn = &c;
+    j->id = c.id;
+    j->block = move(a_block);
+    j->rblock = c.rblock;
+    j->may_start_session = !c.session;
+    submit(move(j));
+  }
+
+  /// Read what a connection has sent, and assemble it into frames, until the
+  /// socket has nothing more or enough has been read ahead
+  void on_readable(conn_t &c) {
+    c.throttled = false;
+    if (ring != nullptr) {
+      assemble(c);
+      arm_recv(c);
+      return;
+    }
+    while (!c.broken) {
+      assemble(c);
+      if (c.eof || c.broken) {
+        return;
+      }
+      size_t buffered = c.in.size() - c.in_pos;
+      size_t want = max(READ_AHEAD, frame_bytes(c));
+      if (buffered >= want) {
+        c.throttled = true;
+        return;
+      }
+      ++syscalls;
+      ssize_t got = recv(c.sd, scratch.data(),
+                         min(scratch.size(), want - buffered), 0);
+      if (got > 0) {
+        c.in.insert(c.in.end(), scratch.begin(), scratch.begin() + got);
+      } else if (got == 0) {
+        c.eof = true;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      } else if (errno != EINTR) {
+        c.broken = true;
+      }
+    }
+  }
+
+  /// Send as much of a connection's pending responses as the socket will take
+  /// (or, with io_uring, submit them to be sent)
+  void flush(conn_t &c) {
+    if (ring != nullptr) {
+      arm_send(c);
+      return;
+    }
+    while (c.out_pos < c.out.size()) {
+      ++syscalls;
+      ssize_t sent = send(c.sd, c.out.data() + c.out_pos,
+                          c.out.size() - c.out_pos, MSG_NOSIGNAL);
+      if (sent > 0) {
+        c.out_pos += sent;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      } else if (errno != EINTR) {
+        c.broken = true;
+        return;
+      }
+    }
+    if (c.out.capacity() > READ_AHEAD) {
+      vec().swap(c.out);
+    }
+    c.out.clear();
+    c.out_pos = 0;
+  }
+
+  /// Take back a frame that a worker is done with, and send its response
+  void on_done(unique_ptr<job_t> j) {
+    conn_t &c = *j->conn;
+    --c.inflight;
+    if (c.broken) {
+      //the connection will be closed, so there's no one to respond to
+    } else if (j->kind == job_t::RBLOCK) {
+      if (!j->ok) {
+        c.broken = true;
+      } else {
+        c.id = j->id;
+        c.rblock = j->rblock;
+        c.state = conn_t::ABLOCK;
+        //an a_block that is too big to read is answered with an error, and
+        //leaves the connection's framing unknown, so it's the last request
+        if (c.rblock.a_block_size < 0 ||
+            c.rblock.a_block_size > LEN_ABLOCK_MAX) {
+          submit_request(c, vec());
+          c.state = conn_t::DONE;
+        }
+      }
+    } else {
+      ++requests;
+      //in a session, the response is framed by its request's ID and length
+      if (!j->id.empty()) {
+        vec_append(c.out, j->id);
+        vec_append(c.out, j->response.size());
+      }
+      vec_append(c.out, j->response);
+      if (!j->session_key.empty()) {
+        c.session = true;
+        c.session_key = j->session_key;
+        c.state = conn_t::KEYED;
+      }
+      if (j->halt) {
+        c.halt = true;
+        c.state = conn_t::DONE;
+      }
+      flush(c);
+    }
+    //with io_uring, a connection that has just become a keyed session may
+    //need its receive armed
+    if (c.throttled || ring != nullptr) {
+      on_readable(c);
+    } else {
+      assemble(c);
+    }
+    finish(c);
+  }
+
+  /// Close a connection if it is done: no worker holds any of its frames, and
+  /// either it is broken, or its responses are sent and no more requests will
+  /// be read from it
+  void finish(conn_t &c) {
+    if (c.inflight > 0) {
+      return;
+    }
+    bool flushed =
+        c.out_pos == c.out.size() && c.sending_pos == c.sending.size();
+    if (!c.broken && !(flushed && (c.state == conn_t::DONE || c.eof))) {
+      return;
+    }
+    //the kernel may not hold any of the connection's buffers once it is gone
+    if (c.send_armed) {
+      return;
+    }
+    if (c.recv_armed) {
+      if (!c.cancelling) {
+        io_uring_sqe *sqe = get_sqe();
+        if (sqe == nullptr) {
+          defer(c);
+          return;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = tag(c.sd, OP_RECV);
+        sqe->user_data = tag(c.sd, OP_CANCEL);
+        c.cancelling = true;
+      }
+      return;
+    }
+    halted |= c.halt;
+    // NB: ignore errors in close().  If the submission queue is full, the
+    //     socket is closed right away instead.
+    io_uring_sqe *sqe = ring != nullptr ? get_sqe() : nullptr;
+    if (sqe != nullptr) {
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->fd = c.sd;
+      sqe->user_data = tag(c.sd, OP_CLOSE);
+    } else {
+      ++syscalls;
+      close(c.sd);
+    }
+    conns.erase(c.sd);
+  }
+
+  /// Accept every connection that is waiting
+  void on_accept() {
+    while (true) {
+      ++syscalls;
+      int sd = accept4(listen_sd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (sd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          sys_error(errno, "Error accepting request from client: ");
+        }
+        return;
+      }
+      nodelay(sd);
+      ++syscalls;
+      epoll_event ev = {};
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.fd = sd;
+      if (epoll_ctl(ep, EPOLL_CTL_ADD, sd, &ev) < 0) {
+        sys_error(errno, "Error adding connection to epoll: ");
+        close(sd);
+        continue;
+      }
+      auto c = make_unique<conn_t>();
+      c->sd = sd;
+      conns[sd] = move(c);
+    }
+  }
+
+  /// Turn off Nagle's algorithm on a connection: responses are written whole,
+  /// so there's nothing for it to combine
+  void nodelay(int sd) {
+    int one = 1;
+    ++syscalls;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  /// Take the frames that workers are done with
+  void take_done() {
+    deque<unique_ptr<job_t>> finished;
+    {
+      lock_guard<mutex> g(lock);
+      finished.swap(done);
+    }
+    for (auto &j : finished) {
+      on_done(move(j));
+    }
+  }
+
+  /// The reactor's main loop, with epoll
+  void run() {
+    vector<epoll_event> events(256);
+    while (!halted) {
+      ++syscalls;
+      int n = epoll_wait(ep, events.data(), events.size(), -1);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        sys_error(errno, "Error in epoll_wait(): ");
+        return;
+      }
+      for (int i = 0; i < n && !halted; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == listen_sd) {
+          on_accept();
+        } else if (fd == efd) {
+          uint64_t count;
+          ++syscalls;
+          if (read(efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            sys_error(errno, "Error reading eventfd: ");
+          }
+          take_done();
+        } else {
+          auto c = conns.find(fd);
+          if (c == conns.end()) {
+            continue;
+          }
+          conn_t &conn = *c->second;
+          if (events[i].events & EPOLLERR) {
+            conn.broken = true;
+          }
+          if (events[i].events & EPOLLOUT) {
+            flush(conn);
+          }
+          if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+            on_readable(conn);
+          }
+          finish(conn);
+        }
+      }
+    }
+  }
+  /// The user_data of an io_uring operation
+  static uint64_t tag(int fd, op_t op) { return (uint64_t)fd << 8 | op; }
+
+  /// Get an SQE.  If the submission queue is full, even after submitting it
+  /// (for example, because the kernel returns -EBUSY until the completions
+  /// that overflowed are reaped), the caller defers its operation to the next
+  /// pass of the loop.
+  ///
+  /// @returns the SQE, or nullptr if the queue is full
+  io_uring_sqe *get_sqe() { return ring->get_sqe(); }
+
+  /// Retry a connection's operations on the next pass of the loop
+  void defer(conn_t &c) {
+    if (!c.deferred) {
+      c.deferred = true;
+      deferred_conns.push_back(c.sd);
+    }
+  }
+
+  /// Retry the operations that couldn't be submitted before
+  void retry_deferred() {
+    if (deferred_accept) {
+      deferred_accept = false;
+      arm_accept();
+    }
+    if (deferred_event) {
+      deferred_event = false;
+      arm_event();
+    }
+    vector<pair<unsigned, unsigned>> buffers;
+    buffers.swap(deferred_buffers);
+    for (auto &b : buffers) {
+      provide_buffers(b.first, b.second);
+    }
+    vector<int> sockets;
+    sockets.swap(deferred_conns);
+    for (int sd : sockets) {
+      auto c = conns.find(sd);
+      if (c == conns.end() || !c->second->deferred) {
+        continue;
+      }
+      conn_t &conn = *c->second;
+      conn.deferred = false;
+      arm_recv(conn);
+      arm_send(conn);
+      finish(conn);
+    }
+  }
+
+  /// Submit a receive on a connection, unless one is in flight, or enough
+  /// has been read ahead, or no more should be read
+  void arm_recv(conn_t &c) {
+    if (c.recv_armed || c.eof || c.broken || c.cancelling ||
+        c.state == conn_t::DONE) {
+      return;
+    }
+    size_t buffered = c.in.size() - c.in_pos;
+    if (buffered >= max(READ_AHEAD, frame_bytes(c))) {
+      c.throttled = true;
+      return;
+    }
+    io_uring_sqe *sqe = get_sqe();
+    if (sqe == nullptr) {
+      defer(c);
+      return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c.sd;
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = tag(c.sd, OP_RECV);
+    c.recv_armed = true;
+  }
+
+  /// Submit a send of a connection's pending responses, unless one is in
+  /// flight
+  void arm_send(conn_t &c) {
+    if (c.send_armed || c.broken) {
+      return;
+    }
+    if (c.sending_pos == c.sending.size()) {
+      if (c.out.empty()) {
+        return;
+      }
+      c.sending.swap(c.out);
+      c.sending_pos = 0;
+      c.out.clear();
+    }
+    io_uring_sqe *sqe = get_sqe();
+    if (sqe == nullptr) {
+      defer(c);
+      return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c.sd;
+    sqe->addr = (uint64_t)(c.sending.data() + c.sending_pos);
+    sqe->len = c.sending.size() - c.sending_pos;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = tag(c.sd, OP_SEND);
+    c.send_armed = true;
+  }
+
+  /// Give receive buffers to the kernel
+  ///
+  /// @param first The first buffer's ID
+  /// @param count The number of buffers
+  void provide_buffers(unsigned first, unsigned count) {
+    io_uring_sqe *sqe = get_sqe();
+    if (sqe == nullptr) {
+      deferred_buffers.push_back({first, count});
+      return;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uint64_t)(buffers + first * URING_BUFFER_SIZE);
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->off = first;
+    sqe->buf_group = 0;
+    sqe->user_data = tag(0, OP_BUFFERS);
+  }
+
+  /// Submit an accept on the listening socket
+  void arm_accept() {
+    io_uring_sqe *sqe = get_sqe();
+    if (sqe == nullptr) {
+      deferred_accept = true;
+      return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_sd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = tag(listen_sd, OP_ACCEPT);
+  }
+
+  /// Submit a read of the eventfd through which workers wake the reactor
+  void arm_event() {
+    io_uring_sqe *sqe = get_sqe();
+    if (sqe == nullptr) {
+      deferred_event = true;
+      return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = efd;
+    sqe->addr = (uint64_t)&event_count;
+    sqe->len = sizeof(event_count);
+    sqe->user_data = tag(efd, OP_EVENT);
+  }
+
+  /// Handle the completion of a receive
+  void on_recv(conn_t &c, int res, unsigned flags) {
+    c.recv_armed = false;
+    if (flags & IORING_CQE_F_BUFFER) {
+      unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+      unsigned char *buf = buffers + id * URING_BUFFER_SIZE;
+      if (res > 0) {
+        c.in.insert(c.in.end(), buf, buf + res);
+      }
+      provide_buffers(id, 1);
+    }
+    if (res > 0 || res == -ENOBUFS || res == -EINTR || res == -EAGAIN) {
+      on_readable(c);
+    } else if (res == 0) {
+      c.eof = true;
+      assemble(c);
+    } else if (res != -ECANCELED) {
+      c.broken = true;
+    }
+  }
+
+  /// Handle the completion of a send
+  void on_send(conn_t &c, int res) {
+    c.send_armed = false;
+    if (res < 0) {
+      c.broken = true;
+      return;
+    }
+    c.sending_pos += res;
+    if (c.sending_pos == c.sending.size()) {
+      if (c.sending.capacity() > READ_AHEAD) {
+        vec().swap(c.sending);
+      }
+      c.sending.clear();
+      c.sending_pos = 0;
+    }
+    arm_send(c);
+  }
+
+  /// The reactor's main loop, with io_uring: each pass hands every SQE that
+  /// has been queued to the kernel and waits for completions, with one system
+  /// call.  Only an error from io_uring_enter() itself stops the loop early; a
+  /// full submission queue just defers operations to the next pass.
+  void run_uring() {
+    arm_accept();
+    arm_event();
+    while (!halted) {
+      //if an operation is still deferred, don't wait: nothing that is in
+      //flight may ever complete to wake us up
+      retry_deferred();
+      bool deferring = !deferred_conns.empty() || !deferred_buffers.empty() ||
+                       deferred_accept || deferred_event;
+      int res = ring->submit(deferring ? 0 : 1);
+      if (res < 0 && res != -EINTR && res != -EBUSY) {
+        sys_error(-res, "Error in io_uring_enter(): ");
+        return;
+      }
+      io_uring_cqe *cqe;
+      while (!halted && (cqe = ring->peek()) != nullptr) {
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        ring->seen();
+        int fd = data >> 8;
+        op_t op = (op_t)(data & 0xff);
+        if (op == OP_ACCEPT) {
+          if (res >= 0) {
+            nodelay(res);
+            auto c = make_unique<conn_t>();
+            c->sd = res;
+            conn_t &conn = *c;
+            conns[res] = move(c);
+            on_readable(conn);
+          } else if (res != -EINTR && res != -ECONNABORTED) {
+            sys_error(-res, "Error accepting request from client: ");
+          }
+          arm_accept();
+        } else if (op == OP_EVENT) {
+          take_done();
+          arm_event();
+        } else if (op == OP_RECV || op == OP_SEND) {
+          auto c = conns.find(fd);
+          if (c == conns.end()) {
+            if (flags & IORING_CQE_F_BUFFER) {
+              provide_buffers(flags >> IORING_CQE_BUFFER_SHIFT, 1);
+            }
+            continue;
+          }
+          if (op == OP_RECV) {
+            on_recv(*c->second, res, flags);
+          } else {
+            on_send(*c->second, res);
+          }
+          finish(*c->second);
+        } else if (op == OP_BUFFERS && res < 0) {
+          sys_error(-res, "Error providing buffers to io_uring: ");
+        }
+      }
+    }
+    //hand over the last closes
+    ring->submit(0);
+  }
+};
+
+} // namespace
+
+/// Serve clients from a listening socket until one of them sends a BYE.
+///
+/// @param sd      The listening socket
+/// @param threads The number of worker threads
+/// @param uring   Use io_uring instead of epoll, if the kernel has it
+/// @param pri     The private key used by the server
+/// @param pub     The public key file contents, to send to the client
+/// @param storage The Storage object with which clients interact
+void serve_clients(int sd, int threads, bool uring, RSA *pri, const vec &pub,
+                   Storage &storage) {
+  //every connection needs a descriptor, so allow as many as we can
+  rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+
+  //the receive buffers must outlive the io_uring, which the kernel tears down
+  //when it is closed
+  vec buffers;
+  Uring ring;
+  if (uring && !ring.init(URING_ENTRIES)) {
+    cerr << "io_uring is unavailable, so using epoll\n";
+    uring = false;
+  }
+  if (uring) {
+    buffers.resize(URING_BUFFERS * URING_BUFFER_SIZE);
+  }
+  reactor_t r(pri, pub, storage, sd, uring ? &ring : nullptr, buffers.data());
+
+  //with io_uring, the kernel waits on blocking descriptors for us, and an
+  //older kernel fails operations on non-blocking ones instead
+  if (uring) {
+    r.provide_buffers(0, URING_BUFFERS);
+    io_uring_cqe *cqe;
+    if (ring.submit(1) < 0 || (cqe = ring.peek()) == nullptr ||
+        cqe->res < 0) {
+      cerr << "io_uring can't select buffers, so using epoll\n";
+      uring = false;
+      r.ring = nullptr;
+    } else {
+      ring.seen();
+    }
+  }
+  r.ep = uring ? -1 : epoll_create1(EPOLL_CLOEXEC);
+  r.efd = eventfd(0, EFD_CLOEXEC | (uring ? 0 : EFD_NONBLOCK));
+  if ((!uring && r.ep < 0) || r.efd < 0 ||
+      (!uring && fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) < 0)) {
+    sys_error(errno, "Error setting up the reactor: ");
+    return;
+  }
+  for (int fd : {sd, r.efd}) {
+    epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd;
+    if (!uring && epoll_ctl(r.ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      sys_error(errno, "Error setting up the reactor: ");
+      return;
+    }
+  }
+
+  vector<thread> workers;
+  for (int i = 0; i < max(threads, 1); ++i) {
+    workers.emplace_back([&]() { r.worker_loop(); });
+  }
+  if (uring) {
+    r.run_uring();
+  } else {
+    r.run();
+  }
+
+  //once the BYE is answered, the rest of the connections are dropped
+  {
+    lock_guard<mutex> g(r.lock);
+    r.stop = true;
+  }
+  r.work.notify_all();
+  for (auto &t : workers) {
+    t.join();
+  }
+  for (auto &c : r.conns) {
+    close(c.first);
+  }
+  close(r.efd);
+  if (r.ep >= 0) {
+    close(r.ep);
+  }
+
+  uint64_t calls = r.syscalls + ring.enters;
+  cout << "Served " << r.requests << " requests with " << calls
+       << " system calls for I/O, " << (uring ? "with io_uring" : "with epoll")
+       << " (" << (double)calls / max(r.requests, (uint64_t)1)
+       << " per request)\n";
+}
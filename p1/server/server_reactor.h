@@ -0,0 +1,38 @@
+#pragma once
+
+#include <openssl/rsa.h>
+
+#include "../common/vec.h"
+
+#include "server_storage.h"
+
+/// Serve clients from a listening socket until one of them sends a BYE.
+///
+/// One thread runs an edge-triggered epoll loop over the listening socket and
+/// every connection.  It does non-blocking reads, assembles each connection's
+/// bytes into frames (k_blocks, r_blocks, a_blocks and keyed requests), and
+/// does non-blocking writes of responses.  It never blocks on a client, so a
+/// client that sends slowly, or not at all, only costs a few hundred bytes of
+/// memory.  Once a frame has fully arrived, it is handed to a pool of worker
+/// threads, which do the RSA and AES work and run the command.
+///
+/// Within a session, the next request is read while earlier ones are still
+/// being worked on, so responses can come back in a different order than the
+/// requests.
+///
+/// With io_uring, the loop doesn't wait for readiness and then read and write:
+/// accepts, receives, sends and closes are queued as SQEs, and each pass of the
+/// loop submits all of them and waits for their completions with a single
+/// io_uring_enter().  If the kernel doesn't support io_uring, epoll is used.
+///
+/// When the server halts, it reports how many system calls it made for I/O,
+/// per request.
+///
+/// @param sd      The listening socket
+/// @param threads The number of worker threads
+/// @param uring   Use io_uring instead of epoll, if the kernel has it
+/// @param pri     The private key used by the server
+/// @param pub     The public key file contents, to send to the client
+/// @param storage The Storage object with which clients interact
+void serve_clients(int sd, int threads, bool uring, RSA *pri, const vec &pub,
+                   Storage &storage);
@@ -1,5 +1,7 @@
 #include <iostream>
+#include <mutex>
 #include <openssl/md5.h>
+#include <shared_mutex>
 #include <unordered_map>
 #include <utility>
 
@@ -42,6 +44,21 @@ struct Storage::Internal {
   /// and to which we persist the Storage object every time it changes
   string filename = "";
 
+  /// Requests are served by many threads at once, so the auth table is shared
+  /// by readers and exclusive to writers
+  shared_mutex lock;
+
+  /// Check a user's password, with lock already held
+  ///
+  /// @param user_name The name of the user who made the request
+  /// @param pass_hash The hash of the password for the user
+  ///
+  /// @returns True if the user and password are valid, false otherwise
+  bool auth(const string &user_name, const string &pass_hash) {
+    auto user = auth_table.find(user_name);
+    return user != auth_table.end() && user->second.pass_hash == pass_hash;
+  }
+
   /// Construct the Storage::Internal object by setting the filename
   ///
   /// @param fname The name of the file that should be used to load/store the
@@ -194,17 +211,14 @@ string hashPassword(string pass) {
 ///
 /// @returns False if the username already exists, true otherwise
 bool Storage::add_user(const string &user_name, const string &pass) {
-
-  //check if user exists
-  if (fields->auth_table.find(user_name) != fields->auth_table.end()) {
-    return false;
-  }
   Internal::AuthTableEntry new_user;
   new_user.username = user_name;
   new_user.pass_hash = hashPassword(pass);
   new_user.content = vec_from_string("");
-  fields->auth_table[user_name] = new_user;
-  return true;
+
+  //check if user exists
+  unique_lock<shared_mutex> g(fields->lock);
+  return fields->auth_table.emplace(user_name, move(new_user)).second;
 }
 
 /// Set the data bytes for a user, but do so if and only if the password
@@ -219,6 +233,8 @@ bool Storage::add_user(const string &user_name, const string &pass) {
 ///          attempt
 vec Storage::set_user_data(const string &user_name, const string &pass,
                            const vec &content) {
+  string pass_hash = hashPassword(pass);
+  unique_lock<shared_mutex> g(fields->lock);
 
   //check if user exists
   if (fields->auth_table.find(user_name) == fields->auth_table.end()) {
@@ -227,7 +243,7 @@ vec Storage::set_user_data(const string &user_name, const string &pass,
   }
 
   //check if the password matches
-  if (!auth(user_name, pass)) {
+  if (!fields->auth(user_name, pass_hash)) {
     cerr << "Wrong password \n";
     return vec_from_string(RES_ERR_LOGIN);
   }
@@ -249,6 +265,8 @@ vec Storage::set_user_data(const string &user_name, const string &pass,
 ///          attempt.  Note that "no data" is an error
 pair<bool, vec> Storage::get_user_data(const string &user_name,
                                        const string &pass, const string &who) {
+  string pass_hash = hashPassword(pass);
+  shared_lock<shared_mutex> g(fields->lock);
 
   //check if user exists
   if (fields->auth_table.find(user_name) == fields->auth_table.end()) {
@@ -256,7 +274,7 @@ pair<bool, vec> Storage::get_user_data(const string &user_name,
   }
 
   //check if the password matches
-  if (!auth(user_name, pass)) {
+  if (!fields->auth(user_name, pass_hash)) {
     return {false, vec_from_string(RES_ERR_LOGIN)};
   }
   
@@ -266,8 +284,7 @@ pair<bool, vec> Storage::get_user_data(const string &user_name,
   }
   
   //check data is not empty
-  vec content = vec_from_string("");
-  content = fields->auth_table[who].content;
+  const vec &content = fields->auth_table.at(who).content;
   if(content.size() == 0){
     return {false, vec_from_string(RES_ERR_NO_DATA)};
   }
@@ -286,6 +303,8 @@ pair<bool, vec> Storage::get_user_data(const string &user_name,
 /// @returns A vector with the data, or a vector with an error message
 pair<bool, vec> Storage::get_all_users(const string &user_name,
                                        const string &pass) {
+  string pass_hash = hashPassword(pass);
+  shared_lock<shared_mutex> g(fields->lock);
 
   //check if user exists
   if (fields->auth_table.find(user_name) == fields->auth_table.end()) {
@@ -293,7 +312,7 @@ pair<bool, vec> Storage::get_all_users(const string &user_name,
   }
 
   //check if the password matches
-  if (!auth(user_name, pass)) {
+  if (!fields->auth(user_name, pass_hash)) {
     return {false, vec_from_string(RES_ERR_LOGIN)};
   }
 
@@ -315,7 +334,9 @@ pair<bool, vec> Storage::get_all_users(const string &user_name,
 ///
 /// @returns True if the user and password are valid, false otherwise
 bool Storage::auth(const string &user_name, const string &pass) {
-  return hashPassword(pass) == fields->auth_table[user_name].pass_hash;
+  string pass_hash = hashPassword(pass);
+  shared_lock<shared_mutex> g(fields->lock);
+  return fields->auth(user_name, pass_hash);
 }
 
 /// Write the entire Storage object (right now just the Auth table) to the
@@ -324,6 +345,8 @@ bool Storage::auth(const string &user_name, const string &pass) {
 /// (this.filename.tmp).  Then the temporary file can be renamed to replace
 /// the older version of the Storage object.
 void Storage::persist() { 
+  //an exclusive lock, so that two SAVs don't write the file at once
+  unique_lock<shared_mutex> g(fields->lock);
 
   size_t bytes = 0;
   vec data = vec_from_string("");
@@ -14,7 +14,8 @@
 /// The public interface of Storage provides functions that correspond 1:1 with
 /// the data requests that a client can make.  In that manner, the server
 /// command handlers need only parse a request, send its parts to the Storage
-/// object, and then format and return the result.
+/// object, and then format and return the result.  Its functions may be called
+/// from many threads at once.
 ///
 /// Storage is a persistent object.  For the time being, persistence is
 /// achieved by writing the entire object to disk in response to SAV
@@ -128,6 +128,10 @@ class ClientConfig:
         """Configure a command for persisting the server"""
         return self.cmd0(user, "SAV")
 
+    def batch(self, filename, repeat):
+        """Configure a command for pipelining the requests in a file, repeat times over, in a session"""
+        return [self.exe, "-k", self.keyfile, "-s", self.server, "-p", self.port, "-B", filename, "-n", str(repeat)]
+
 def delfile(file):
     """delete a file, but only if it exists:"""
     if os.path.exists(file):
@@ -176,6 +180,21 @@ def do_cmd(msg, expect, cmd):
         print("["+red("ERR")+"] '" + str(res_o) + " " + str(res_e)+"'")
     return s
 
+def do_cmd_report(msg, expect, cmd):
+    """Launch /cmd/ in a subprocess, and then check if the lines of its output equal the expected list.  The first line ends with a time, so it only has to start with the first expected line."""
+    if verbose:
+        for x in cmd:
+            print(x, end=" ")
+        print("", end="\n")
+    print((msg+" Expect: '" + expect[0]+"'").ljust(indentation), end="")
+    s = subprocess.Popen(cmd, stderr=subprocess.PIPE, stdout=subprocess.PIPE)
+    res = s.stdout.read().decode("utf-8").rstrip().split("\n")
+    if len(res) == len(expect) and res[0].startswith(expect[0]) and res[1:] == expect[1:]:
+        print("["+green("OK")+"]")
+    else:
+        print("["+red("ERR")+"] '" + " / ".join(res)+"'")
+    return s
+
 def await_server(msg, expect, server):
     """Wait for server to terminate"""
     print((msg+" Expect: '" + expect+"'").ljust(indentation), end="")
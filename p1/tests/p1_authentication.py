@@ -1,4 +1,8 @@
 #!/usr/bin/python3
+import os
+import socket
+import struct
+import subprocess
 import cse303
 
 # Configure constants and users
@@ -61,4 +65,86 @@ cse303.line()
 cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
 cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
 cse303.line()
-cse303.clean_common_files(server, client)
\ No newline at end of file
+cse303.clean_common_files(server, client)
+def check_keyed_oversized(msg):
+    """Start a keyed session on a socket, as -K does, and then send a request
+    whose length is more than any a_block can be.  The server should close the
+    connection instead of waiting for the request's bytes."""
+    print(msg.ljust(cse303.indentation), end="")
+    # The r_block is "SES", the aes key and iv, and the a_block's size, and the
+    # a_block is an empty message
+    key = os.urandom(48)
+    rblock = (b"SES" + key + struct.pack("<q", 16)).ljust(128, b"\0")
+    rsa = subprocess.run(["openssl", "pkeyutl", "-encrypt", "-pubin", "-inkey", client.keyfile, "-pkeyopt", "rsa_padding_mode:oaep"], input=rblock, capture_output=True).stdout
+    aes = ["openssl", "enc", "-aes-256-cbc", "-K", key[:32].hex(), "-iv", key[32:].hex()]
+    ablock = subprocess.run(aes, input=b"", capture_output=True).stdout
+    sd = socket.create_connection((client.server, int(client.port)))
+    sd.sendall(rsa + ablock)
+    reply = b""
+    while len(reply) < 16:
+        got = sd.recv(16 - len(reply))
+        if got == b"":
+            break
+        reply += got
+    started = subprocess.run(aes + ["-d"], input=reply, capture_output=True).stdout == b"OK"
+    # id, iv and a length one past LEN_ABLOCK_MAX, with no body
+    sd.sendall(struct.pack("<i", 0) + os.urandom(16) + struct.pack("<i", 1048781))
+    sd.settimeout(5)
+    try:
+        closed = sd.recv(1) == b""
+    except socket.timeout:
+        closed = False
+    sd.close()
+    if started and closed:
+        print("["+cse303.green("OK")+"]")
+    elif not started:
+        print("["+cse303.red("ERR")+"] session is not started")
+    else:
+        print("["+cse303.red("ERR")+"] connection is still open")
+
+# The same requests should work in a session (-S), where one connection carries
+# each client's requests
+server.pid = cse303.do_cmd("Starting server.", "File not found: " + server.dirfile, server.launchcmd())
+cse303.waitfor(2)
+cse303.line()
+cse303.do_cmd("Registering new user alice in a session.", "OK", client.reg(alice) + ["-S"])
+cse303.do_cmd("Re-registering alice in a session.", "ERR_USER_EXISTS", client.reg(alice) + ["-S"])
+cse303.do_cmd("Setting alice's content in a session.", "OK", client.setC(alice, afile1) + ["-S"])
+cse303.do_cmd("Checking alice's content in a session.", "OK", client.getC(alice, alice.name) + ["-S"])
+cse303.check_file_result(afile1, alice.name)
+cse303.do_cmd("Attempting access with bad password in a session.", "ERR_LOGIN", client.getC(fakealice, alice.name) + ["-S"])
+cse303.do_cmd("Registering user bob in a session.", "OK", client.reg(bob) + ["-S"])
+cse303.do_cmd("Getting bob's nonexistent data in a session.", "ERR_NO_DATA", client.getC(bob, bob.name) + ["-S"])
+cse303.do_cmd("Getting all users in a session.", "OK", client.getA(alice, allfile) + ["-S"])
+cse303.check_file_list(allfile, [alice.name, bob.name])
+cse303.line()
+
+# With many requests in flight on one session (-B, repeated with -n), each
+# response should still be paired with its own request: the client decrypts a
+# response with the key of the request whose ID it carries, and the requests'
+# results all differ
+batchfile = "batchfile"
+cse303.build_file_as(batchfile, "GET " + alice.name + " " + alice.pwd + " " + alice.name + "\n" +
+                     "GET " + bob.name + " " + bob.pwd + " " + bob.name + "\n" +
+                     "GET " + fakealice.name + " " + fakealice.pwd + " " + alice.name + "\n" +
+                     "REG " + bob.name + " " + bob.pwd + "\n")
+cse303.do_cmd_report("Pipelining 4 different requests 8 times.", ["32 of 32 requests answered", "  ERR_LOGIN: 8", "  ERR_NO_DATA: 8", "  ERR_USER_EXISTS: 8", "  OK: 8"], client.batch(batchfile, 8))
+cse303.delfile(batchfile)
+cse303.line()
+
+# A keyed session (-K) should give the same results, errors included
+cse303.do_cmd("Checking alice's content in a keyed session.", "OK", client.getC(alice, alice.name) + ["-K"])
+cse303.check_file_result(afile1, alice.name)
+cse303.do_cmd("Attempting access with bad password.", "ERR_LOGIN", client.getC(fakealice, alice.name))
+cse303.do_cmd("Attempting access with bad password in a keyed session.", "ERR_LOGIN", client.getC(fakealice, alice.name) + ["-K"])
+cse303.do_cmd("Re-registering bob in a keyed session.", "ERR_USER_EXISTS", client.reg(bob) + ["-K"])
+check_keyed_oversized("Sending an oversized keyed request.")
+cse303.await_server("Checking that the server refused it.", "keyed request is too big", server.pid)
+cse303.do_cmd("Instructing server to persist data in a session.", "OK", client.persist(alice) + ["-S"])
+cse303.line()
+
+# Clean up
+cse303.do_cmd("Stopping server in a session.", "OK", client.bye(alice) + ["-S"])
+cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
+cse303.line()
+cse303.clean_common_files(server, client)
@@ -1,12 +1,21 @@
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <functional>
 #include <iostream>
+#include <fcntl.h>
 #include <libgen.h>
+#include <sys/stat.h>
+#include <memory>
+#include <string>
 #include <thread>
 #include <unistd.h>
 #include <vector>
 
 #include "../common/hashtable.h"
+#include "../common/shardedtable.h"
+#include "../server/server_persist.h"
+#include "../server/server_storage.h"
 
 using namespace std;
 
@@ -29,6 +38,47 @@ struct server_arg_t {
 
   /// Number of buckets for the server's hash tables
   size_t buckets = 1024;
+
+  /// The average bucket size at which the table grows (0 for a fixed size)
+  double max_load = 2;
+
+  /// Run the growth scenario instead of the mixed workload?
+  bool growth = false;
+
+  /// Run the bulk-load scenario instead of the mixed workload?
+  bool bulk = false;
+
+  /// The value size for the copy scenario, or 0 to not run it
+  size_t copy_bytes = 0;
+
+  /// The file for the log scenario, or "" to not run it
+  string log_file = "";
+
+  /// Run the sibling scenario (with the log in log_file) instead of the log
+  /// scenario?
+  bool siblings = false;
+
+  /// Run the call-overhead scenario instead of the mixed workload?
+  bool calls = false;
+
+  /// The bucket locking mode (mutex, rwlock, epoch or sharded)
+  string mode = "mutex";
+
+  /// The number of shards in sharded mode (0 for one per core)
+  size_t shards = 0;
+
+  /// The bucket layout (chained or fingerprint)
+  string layout = "chained";
+
+  /// Use string keys instead of integer keys?
+  bool strings = false;
+
+  /// How the scan scenario iterates (2pl or snapshot), or "" to not run it
+  string scan = "";
+
+  /// The zlib level for the compression scenario (with log_file), or -1 to not
+  /// run it
+  int compression = -1;
 };
 
 /// Parse the command-line arguments, and use them to populate the provided args
@@ -39,7 +89,7 @@ struct server_arg_t {
 /// @param args The struct into which the parsed args should go
 void parse_args(int argc, char **argv, server_arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "k:t:r:i:b:h")) != -1) {
+  while ((opt = getopt(argc, argv, "k:t:r:i:b:l:m:y:n:a:e:w:z:sgcuxh")) != -1) {
     switch (opt) {
     case 'k':
       args.keys = atoi(optarg);
@@ -56,6 +106,45 @@ void parse_args(int argc, char **argv, server_arg_t &args) {
     case 'b':
       args.buckets = atoi(optarg);
       break;
+    case 'l':
+      args.max_load = atof(optarg);
+      break;
+    case 'g':
+      args.growth = true;
+      break;
+    case 'c':
+      args.calls = true;
+      break;
+    case 'u':
+      args.bulk = true;
+      break;
+    case 'e':
+      args.copy_bytes = atoi(optarg);
+      break;
+    case 'w':
+      args.log_file = string(optarg);
+      break;
+    case 'x':
+      args.siblings = true;
+      break;
+    case 'z':
+      args.compression = atoi(optarg);
+      break;
+    case 'm':
+      args.mode = string(optarg);
+      break;
+    case 'n':
+      args.shards = atoi(optarg);
+      break;
+    case 'y':
+      args.layout = string(optarg);
+      break;
+    case 's':
+      args.strings = true;
+      break;
+    case 'a':
+      args.scan = string(optarg);
+      break;
     case 'h':
       args.usage = true;
       break;
@@ -77,6 +166,30 @@ void usage(char *progname) {
        << "  -r [int] Read-only percent\n"
        << "  -i [int] Iterations per thread\n"
        << "  -b [int] Number of buckets\n"
+       << "  -l [num] Average bucket size that triggers a resize (0 = fixed)\n"
+       << "  -m [str] Bucket locking mode (mutex, rwlock, epoch, sharded)\n"
+       << "  -n [int] Shards, in sharded mode (default: one per core)\n"
+       << "  -y [str] Bucket layout (chained, fingerprint)\n"
+       << "  -s       Use 32-byte string keys instead of integer keys\n"
+       << "  -g       Growth scenario: insert keys 0..k-1, report throughput\n"
+       << "           over time\n"
+       << "  -u       Bulk-load scenario: load keys 0..k-1 into an empty\n"
+       << "           table with insert() and with bulk_load() on t threads\n"
+       << "  -e [int] Copy scenario: upserts of values of this many bytes,\n"
+       << "           report the value bytes copied per upsert\n"
+       << "  -w [str] Log scenario: each thread appends i records to this\n"
+       << "           file and waits for them, at each durability level,\n"
+       << "           with write() and with io_uring\n"
+       << "  -x       Sibling scenario (with -w): lookup latency of keys that\n"
+       << "           share buckets with keys being written, when writers\n"
+       << "           wait for the log inside and outside the bucket lock\n"
+       << "  -z [int] Compression scenario (with -w): k JSON-like values are\n"
+       << "           persisted to and loaded from this file, uncompressed and\n"
+       << "           at this zlib level; report file size, SAV and load time\n"
+       << "  -c       Call-overhead scenario: ns/op of each operation, with\n"
+       << "           std::function and with plain lambdas (single thread)\n"
+       << "  -a [str] Scan scenario: writer latency while another thread\n"
+       << "           keeps iterating the table (2pl, snapshot)\n"
        << "  -h       Print help (this message)\n";
 }
 
@@ -91,23 +204,108 @@ enum EVENTS {
   COUNT = 6
 };
 
-int main(int argc, char **argv) {
-  // Parse the command-line arguments
-  server_arg_t args;
-  parse_args(argc, argv, args);
-  if (args.usage) {
-    usage(argv[0]);
-    return 0;
+/// Construct the table under test.  A ConcurrentHashTable gets args.buckets
+/// buckets.
+///
+/// @param args The command-line arguments
+///
+/// @returns the new table
+template <typename TABLE> struct make_table {
+  static TABLE *make(const server_arg_t &args) {
+    return new TABLE(args.buckets, args.max_load);
   }
+};
 
-  // Print configuration
-  cout << "# (k,t,r,i,b) = (" << args.keys << "," << args.threads << ","
-       << args.reads << "," << args.iters << "," << args.buckets << ")\n";
+/// A ShardedTable gets args.shards shards, which share args.buckets buckets
+/// between them
+template <typename K, typename V, typename L, typename H>
+struct make_table<ShardedTable<K, V, L, H>> {
+  static ShardedTable<K, V, L, H> *make(const server_arg_t &args) {
+    size_t shards = args.shards;
+    if (shards == 0)
+      shards = max(thread::hardware_concurrency(), 1u);
+    return new ShardedTable<K, V, L, H>(
+        shards, max(args.buckets / shards, size_t(1)), args.max_load);
+  }
+};
 
+/// Run the growth scenario: starting from args.buckets buckets, the threads
+/// insert args.keys distinct keys, and we report the throughput of each 100ms
+/// interval along with the table's size, so that any pauses or slowdowns caused
+/// by resizing are visible.
+///
+/// @param args The command-line arguments
+/// @param keys The keys, indexed by key number
+template <typename TABLE, typename K>
+void run_growth(const server_arg_t &args, const vector<K> &keys) {
+  unique_ptr<TABLE> owner(make_table<TABLE>::make(args));
+  TABLE &tbl = *owner;
+
+  // Threads report progress in chunks, so that the counter isn't contended
+  const size_t CHUNK = 1024;
+  atomic<size_t> progress(0), finished(0);
+  auto start_time = chrono::high_resolution_clock::now();
+  vector<thread> threads;
+  for (size_t i = 0; i < args.threads; ++i) {
+    threads.push_back(thread(
+        [&](size_t tid) {
+          size_t mine = 0;
+          for (size_t key = tid; key < args.keys; key += args.threads) {
+            tbl.insert(keys[key], 0, []() {});
+            if (++mine % CHUNK == 0)
+              progress += CHUNK;
+          }
+          progress += mine % CHUNK;
+          ++finished;
+        },
+        i));
+  }
+
+  // Sample the progress counter until all threads are done
+  cout << "# time (sec), throughput (ops/sec), keys, buckets\n";
+  auto last_time = start_time;
+  size_t last = 0;
+  while (finished != args.threads) {
+    this_thread::sleep_for(chrono::milliseconds(100));
+    auto now = chrono::high_resolution_clock::now();
+    size_t done = progress;
+    auto elapsed =
+        chrono::duration_cast<chrono::duration<double>>(now - start_time)
+            .count();
+    auto interval =
+        chrono::duration_cast<chrono::duration<double>>(now - last_time)
+            .count();
+    cout << elapsed << ", " << (done - last) / interval << ", " << done << ", "
+         << tbl.bucket_count() << endl;
+    last = done;
+    last_time = now;
+  }
+  for (size_t i = 0; i < args.threads; ++i) {
+    threads[i].join();
+  }
+  auto end_time = chrono::high_resolution_clock::now();
+
+  auto dur =
+      chrono::duration_cast<chrono::duration<double>>(end_time - start_time)
+          .count();
+  cout << "Throughput (ops/sec): " << tbl.size() / dur << endl;
+  cout << "Execution Time (sec): " << dur << endl;
+  cout << "Total Keys:           " << tbl.size() << endl;
+  cout << "Final Buckets:        " << tbl.bucket_count() << endl;
+}
+
+/// Run the mixed workload: each thread performs args.iters random lookups,
+/// inserts and removes, in the ratio given by args.reads
+///
+/// @param args The command-line arguments
+/// @param keys The keys, indexed by key number
+template <typename TABLE, typename K>
+void run_mixed(const server_arg_t &args, const vector<K> &keys) {
   // Make a hash table, populate it with 50% of the keys.  We ignore values
-  ConcurrentHashTable<int, int> tbl(args.buckets);
+  unique_ptr<TABLE> owner(make_table<TABLE>::make(args));
+  TABLE &tbl = *owner;
   for (size_t i = 0; i < args.keys; i += 2) {
-    tbl.insert(i, 0, []() {});
+    tbl.insert(keys[i], 0, []() {});
   }
 
   // These vars are needed by the threads:
@@ -143,17 +341,17 @@ int main(int argc, char **argv) {
             size_t action = rand_r(&seed) % 100;
             size_t key = rand_r(&seed) % args.keys;
             if (action < args.reads) {
-              if (tbl.do_with_readonly(key, [](int) {}))
+              if (tbl.do_with_readonly(keys[key], [](int) {}))
                 ++my_stats[EVENTS::LOK_T];
               else
                 ++my_stats[EVENTS::LOK_F];
             } else if (action < args.reads + (100 - args.reads) / 2) {
-              if (tbl.insert(key, 0, []() {}))
+              if (tbl.insert(keys[key], 0, []() {}))
                 ++my_stats[EVENTS::INS_T];
               else
                 ++my_stats[EVENTS::INS_F];
             } else {
-              if (tbl.remove(key, []() {}))
+              if (tbl.remove(keys[key], []() {}))
                 ++my_stats[EVENTS::RMV_T];
               else
                 ++my_stats[EVENTS::RMV_F];
@@ -192,3 +390,587 @@ int main(int argc, char **argv) {
   cout << "  Remove (True) :     " << stats[EVENTS::RMV_T] << endl;
   cout << "  Remove (False):     " << stats[EVENTS::RMV_F] << endl;
 }
+
+/// Wrap a callable in a std::function, or pass it through unchanged.  This is
+/// how the call-overhead scenario gets the "before" (type-erased) and "after"
+/// (inlined) versions of the same lambda.
+///
+/// @param f The callable
+///
+/// @returns f, or a std::function<SIG> holding f if ERASED is true
+template <typename SIG, bool ERASED, typename F> auto callable(F f) {
+  if constexpr (ERASED)
+    return function<SIG>(f);
+  else
+    return f;
+}
+
+/// Time n calls to op, and report the average cost of one call
+///
+/// @param name The name of the operation
+/// @param n    The number of calls
+/// @param op   The operation, which receives the call number
+template <typename OP> void time_op(const char *name, size_t n, OP op) {
+  auto start_time = chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < n; ++i)
+    op(i);
+  auto end_time = chrono::high_resolution_clock::now();
+  auto ns =
+      chrono::duration_cast<chrono::duration<double, nano>>(end_time -
+                                                            start_time)
+          .count();
+  cout << "  " << name << ns / n << " ns/op" << endl;
+}
+
+/// counted_vec is a value type that counts how many bytes are copied when it
+/// is copied.  Moving it is free.
+struct counted_vec {
+  /// The total number of bytes copied, over all counted_vecs
+  inline static atomic<size_t> copied{0};
+
+  vector<uint8_t> data;
+
+  counted_vec() = default;
+  explicit counted_vec(size_t bytes) : data(bytes) {}
+  counted_vec(const counted_vec &o) : data(o.data) { copied += data.size(); }
+  counted_vec(counted_vec &&o) noexcept = default;
+  counted_vec &operator=(const counted_vec &o) {
+    data = o.data;
+    copied += data.size();
+    return *this;
+  }
+  counted_vec &operator=(counted_vec &&o) noexcept = default;
+};
+
+/// with_value gives the type of a table like TABLE, but with values of type V
+template <typename TABLE, typename V> struct with_value;
+template <typename K, typename V0, typename L, typename Y, typename H,
+          typename V>
+struct with_value<ConcurrentHashTable<K, V0, L, Y, H>, V> {
+  typedef ConcurrentHashTable<K, V, L, Y, H> type;
+};
+template <typename K, typename V0, typename Y, typename H, typename V>
+struct with_value<ShardedTable<K, V0, Y, H>, V> {
+  typedef ShardedTable<K, V, Y, H> type;
+};
+
+/// Run the copy scenario: upsert values of args.copy_bytes bytes into a table
+/// that holds every other key, the way Storage does for a KVU, and report how
+/// many bytes of values get copied per upsert.  The value is passed once by
+/// const reference (so the table gets a copy, as in kv_upsert(const vec &))
+/// and once by moving it (as in kv_upsert(vec &&)).
+///
+/// @param args The command-line arguments
+/// @param keys The keys, indexed by key number
+template <typename TABLE, typename K>
+void run_copies(const server_arg_t &args, const vector<K> &keys) {
+  typedef typename with_value<TABLE, counted_vec>::type VTABLE;
+  for (bool moved : {false, true}) {
+    unique_ptr<VTABLE> owner(make_table<VTABLE>::make(args));
+    VTABLE &tbl = *owner;
+    for (size_t i = 0; i < args.keys; i += 2)
+      tbl.insert(keys[i], counted_vec(args.copy_bytes), []() {});
+    counted_vec::copied = 0;
+    size_t log_bytes = 0;
+    auto start_time = chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < args.iters; ++i) {
+      // The request buffer that the value arrives in
+      counted_vec val(args.copy_bytes);
+      auto on_write = [&]() { log_bytes += val.data.size(); };
+      if (moved)
+        tbl.upsert(keys[i % args.keys], move(val), on_write, on_write);
+      else
+        tbl.upsert(keys[i % args.keys], as_const(val), on_write, on_write);
+    }
+    auto dur = chrono::duration_cast<chrono::duration<double, nano>>(
+                   chrono::high_resolution_clock::now() - start_time)
+                   .count();
+    cout << (moved ? "moved value:     " : "const & value:   ")
+         << double(counted_vec::copied) / args.iters
+         << " bytes copied/upsert, " << dur / args.iters << " ns/upsert\n";
+  }
+}
+
+/// Run the bulk-load scenario: fill an empty table with args.keys keys, the
+/// way Storage::load() used to (one insert() per record, with a std::function
+/// callback) and with bulk_load() on args.threads threads, and report how long
+/// each takes.
+///
+/// @param args The command-line arguments
+/// @param keys The keys, indexed by key number
+template <typename TABLE, typename K>
+void run_bulk(const server_arg_t &args, const vector<K> &keys) {
+  auto report = [&](const char *name, auto start_time, TABLE &tbl) {
+    auto dur = chrono::duration_cast<chrono::duration<double>>(
+                   chrono::high_resolution_clock::now() - start_time)
+                   .count();
+    cout << name << dur << " sec (" << args.keys / dur << " records/sec, "
+         << tbl.size() << " keys, " << tbl.bucket_count() << " buckets)\n";
+  };
+  {
+    unique_ptr<TABLE> owner(make_table<TABLE>::make(args));
+    TABLE &tbl = *owner;
+    function<void()> empty_func = []() {};
+    auto start_time = chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < args.keys; ++i)
+      tbl.insert(keys[i], int(i), empty_func);
+    report("insert():    ", start_time, tbl);
+  }
+  {
+    unique_ptr<TABLE> owner(make_table<TABLE>::make(args));
+    TABLE &tbl = *owner;
+    // Building the batch is part of the cost, as it is in load()
+    auto start_time = chrono::high_resolution_clock::now();
+    vector<pair<K, int>> batch;
+    for (size_t i = 0; i < args.keys; ++i)
+      batch.emplace_back(keys[i], int(i));
+    tbl.bulk_load(move(batch), args.threads);
+    report("bulk_load(): ", start_time, tbl);
+  }
+}
+
+/// Measure the per-call cost of each table operation from a single thread.
+/// The callbacks capture several variables by reference, like the ones in
+/// Storage do, which is enough to make std::function allocate.
+///
+/// @param args The command-line arguments
+/// @param keys The keys, indexed by key number
+template <typename TABLE, bool ERASED, typename K>
+void run_calls_with(const server_arg_t &args, const vector<K> &keys) {
+  unique_ptr<TABLE> owner(make_table<TABLE>::make(args));
+  TABLE &tbl = *owner;
+  size_t hits = 0, sum = 0, key = 0;
+  int val = 1;
+  cout << (ERASED ? "std::function callbacks:\n" : "lambda callbacks:\n");
+  time_op("insert:           ", args.iters, [&](size_t i) {
+    key = i % args.keys;
+    tbl.insert(keys[key], val, callable<void(), ERASED>([&]() {
+                 hits += key + val;
+                 sum += key;
+               }));
+  });
+  time_op("upsert:           ", args.iters, [&](size_t i) {
+    key = i % args.keys;
+    tbl.upsert(keys[key], val,
+               callable<void(), ERASED>([&]() { hits += key + val + sum; }),
+               callable<void(), ERASED>([&]() { sum += key + val + hits; }));
+  });
+  time_op("do_with:          ", args.iters, [&](size_t i) {
+    key = i % args.keys;
+    tbl.do_with(keys[key], callable<void(int &), ERASED>([&](int &v) {
+                  v += val;
+                  sum += key + hits;
+                }));
+  });
+  time_op("do_with_readonly: ", args.iters, [&](size_t i) {
+    key = i % args.keys;
+    tbl.do_with_readonly(keys[key],
+                         callable<void(const int &), ERASED>([&](const int &v) {
+                           sum += v + key + hits;
+                         }));
+  });
+  // One scan visits every key, so report the cost per key visited
+  size_t scans = max(size_t(1), args.iters / max(size_t(1), tbl.size()));
+  time_op("do_all_readonly:  ", scans * tbl.size(), [&](size_t i) {
+    if (i % tbl.size() != 0)
+      return;
+    tbl.do_all_readonly(
+        callable<void(const K, const int &), ERASED>(
+            [&](const K &, const int &v) { sum += v + hits + key; }),
+        callable<void(), ERASED>([&]() { hits += sum + key; }));
+  });
+  time_op("remove:           ", args.iters, [&](size_t i) {
+    key = i % args.keys;
+    tbl.remove(keys[key], callable<void(), ERASED>([&]() {
+                 hits += key + val;
+                 sum -= key;
+               }));
+  });
+  // Print the results, so that the compiler can't drop the callbacks
+  cout << "  (checksum " << hits + sum << ")\n";
+}
+
+/// Run the call-overhead scenario, first with std::function callbacks and then
+/// with plain lambdas
+///
+/// @param args The command-line arguments
+/// @param keys The keys, indexed by key number
+template <typename TABLE, typename K>
+void run_calls(const server_arg_t &args, const vector<K> &keys) {
+  run_calls_with<TABLE, true>(args, keys);
+  run_calls_with<TABLE, false>(args, keys);
+}
+
+/// Run the scan scenario: the threads insert and remove random keys, and time
+/// each operation, while one more thread iterates over the whole table again
+/// and again.  The latency percentiles show how long writers wait for a scan.
+///
+/// @param args The command-line arguments
+/// @param keys The keys, indexed by key number
+template <typename TABLE, typename K>
+void run_scan(const server_arg_t &args, const vector<K> &keys) {
+  // Make a hash table, populate it with 50% of the keys.  We ignore values
+  unique_ptr<TABLE> owner(make_table<TABLE>::make(args));
+  TABLE &tbl = *owner;
+  for (size_t i = 0; i < args.keys; i += 2) {
+    tbl.insert(keys[i], 0, []() {});
+  }
+
+  // The scanner runs until the writers are done
+  atomic<bool> done(false);
+  size_t scans = 0, visited = 0;
+  thread scanner([&]() {
+    auto f = [&](const K &, const int &) { ++visited; };
+    while (!done) {
+      if (args.scan == "2pl")
+        tbl.do_all_readonly(f, []() {});
+      else
+        tbl.do_all_snapshot(f, []() {});
+      ++scans;
+    }
+  });
+
+  // Each writer records the latency of each of its operations, in ns
+  vector<vector<double>> lat(args.threads);
+  vector<thread> threads;
+  auto start_time = chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < args.threads; ++i) {
+    threads.push_back(thread(
+        [&](size_t tid) {
+          unsigned seed = tid;
+          lat[tid].reserve(args.iters);
+          for (size_t o = 0; o < args.iters; ++o) {
+            size_t key = rand_r(&seed) % args.keys;
+            bool ins = rand_r(&seed) % 2;
+            auto t0 = chrono::high_resolution_clock::now();
+            if (ins)
+              tbl.insert(keys[key], 0, []() {});
+            else
+              tbl.remove(keys[key], []() {});
+            auto t1 = chrono::high_resolution_clock::now();
+            lat[tid].push_back(
+                chrono::duration_cast<chrono::duration<double, nano>>(t1 - t0)
+                    .count());
+          }
+        },
+        i));
+  }
+  for (size_t i = 0; i < args.threads; ++i) {
+    threads[i].join();
+  }
+  auto end_time = chrono::high_resolution_clock::now();
+  done = true;
+  scanner.join();
+
+  vector<double> all;
+  for (auto &l : lat)
+    all.insert(all.end(), l.begin(), l.end());
+  sort(all.begin(), all.end());
+  auto pct = [&](double p) { return all[size_t(p * (all.size() - 1))]; };
+  auto dur =
+      chrono::duration_cast<chrono::duration<double>>(end_time - start_time)
+          .count();
+  cout << "Writer Throughput (ops/sec): " << all.size() / dur << endl;
+  cout << "Writer Latency p50 (ns):     " << pct(0.5) << endl;
+  cout << "Writer Latency p99 (ns):     " << pct(0.99) << endl;
+  cout << "Writer Latency p99.9 (ns):   " << pct(0.999) << endl;
+  cout << "Writer Latency max (ns):     " << all.back() << endl;
+  cout << "Scans Completed:             " << scans << endl;
+  cout << "Entries Visited:             " << visited << endl;
+}
+
+/// Run the log scenario: args.threads threads each append args.iters 64-byte
+/// records to a log, and wait for each one (as Storage does), at each
+/// durability level, once with write() and fdatasync() and once with
+/// io_uring.  Report ops/sec, syncs/sec and system calls per op for each.
+///
+/// @param args The command-line arguments
+void run_log(const server_arg_t &args) {
+  vec record(64, 'r');
+  auto run_level = [&](const string &name, durability_t d) {
+    unlink(args.log_file.c_str());
+    LogWriter log(d);
+    log.open(args.log_file);
+    vector<thread> threads;
+    auto start_time = chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < args.threads; ++i) {
+      threads.push_back(thread([&]() {
+        for (size_t o = 0; o < args.iters; ++o)
+          log.wait(log.append(record, record.size()));
+      }));
+    }
+    for (auto &t : threads)
+      t.join();
+    auto dur = chrono::duration_cast<chrono::duration<double>>(
+                   chrono::high_resolution_clock::now() - start_time)
+                   .count();
+    double ops = args.threads * args.iters;
+    cout << name << ops / dur << " ops/sec, " << log.syncs() / dur
+         << " syncs/sec, " << log.syscalls() / ops << " syscalls/op\n";
+    log.close();
+    unlink(args.log_file.c_str());
+  };
+  for (bool uring : {false, true}) {
+    durability_t d;
+    d.uring = uring;
+    string io = uring ? "(io_uring) " : "(write)    ";
+    d.level = durability_t::STRICT;
+    run_level("strict " + io + "          ", d);
+    d.level = durability_t::BATCHED;
+    run_level("batched " + io + "         ", d);
+    d.window_us = 100;
+    run_level("batched (100us) " + io + " ", d);
+    d.level = durability_t::PERIODIC;
+    d.interval_ms = 10;
+    run_level("periodic (10ms) " + io + " ", d);
+    d.level = durability_t::NONE;
+    run_level("none " + io + "            ", d);
+  }
+}
+
+/// Run the compression scenario: fill a Storage with args.keys JSON-like
+/// values, then time persist() and load() of args.log_file, once without
+/// compression and once at zlib level args.compression.  Report the file size
+/// and both times for each.
+///
+/// @param args The command-line arguments
+void run_compress(const server_arg_t &args) {
+  auto run_level = [&](const string &name, int level) {
+    unlink(args.log_file.c_str());
+    durability_t d;
+    d.level = durability_t::NONE;
+    d.compression = level;
+    {
+      Storage store(args.log_file, args.buckets, 0, d);
+      store.load();
+      store.add_user("bench", "bench");
+      for (size_t i = 0; i < args.keys; ++i) {
+        string n = to_string(i);
+        string val = "{\"id\":" + n + ",\"name\":\"user" + n +
+                     "\",\"email\":\"user" + n +
+                     "@example.com\",\"active\":true,\"roles\":[\"reader\","
+                     "\"writer\"],\"score\":" + to_string(i % 1000) + "}";
+        store.kv_insert("bench", "bench", "key" + n, vec_from_string(val));
+      }
+      auto start_time = chrono::high_resolution_clock::now();
+      store.persist();
+      auto sav = chrono::duration_cast<chrono::duration<double>>(
+                     chrono::high_resolution_clock::now() - start_time)
+                     .count();
+      store.shutdown();
+      struct stat st;
+      stat(args.log_file.c_str(), &st);
+      cout << name << st.st_size << " bytes, SAV " << sav << " s, ";
+    }
+    Storage store(args.log_file, args.buckets, 0, d);
+    auto start_time = chrono::high_resolution_clock::now();
+    store.load();
+    auto load = chrono::duration_cast<chrono::duration<double>>(
+                    chrono::high_resolution_clock::now() - start_time)
+                    .count();
+    cout << "load " << load << " s\n";
+    store.shutdown();
+    unlink(args.log_file.c_str());
+  };
+  run_level("uncompressed: ", 0);
+  if (args.compression > 0)
+    run_level("zlib level " + to_string(args.compression) + ": ",
+              args.compression);
+}
+
+/// Run the sibling scenario: args.threads writers upsert the first half of the
+/// keys, logging each write to args.log_file, while one more thread times
+/// lookups of the other half.  With few buckets, every lookup shares its
+/// bucket with keys that are being written.  The writers first wait for their
+/// record to be durable inside the upsert's callback, while the bucket is
+/// locked, and then after the upsert returns.
+///
+/// @param args The command-line arguments
+/// @param keys The keys, indexed by key number
+template <typename TABLE, typename K>
+void run_siblings(const server_arg_t &args, const vector<K> &keys) {
+  vec record(64, 'r');
+  size_t half = max(args.keys / 2, size_t(1));
+  for (bool inside : {true, false}) {
+    unique_ptr<TABLE> owner(make_table<TABLE>::make(args));
+    TABLE &tbl = *owner;
+    for (size_t i = 0; i < args.keys; ++i)
+      tbl.insert(keys[i], 0, []() {});
+    unlink(args.log_file.c_str());
+    LogWriter log;
+    log.open(args.log_file);
+
+    // The reader runs until the writers are done
+    atomic<bool> done(false);
+    vector<double> lat;
+    thread reader([&]() {
+      unsigned seed = 0;
+      while (!done) {
+        size_t key = half + rand_r(&seed) % (args.keys - half);
+        auto t0 = chrono::high_resolution_clock::now();
+        tbl.do_with_readonly(keys[key], [](const int &) {});
+        auto t1 = chrono::high_resolution_clock::now();
+        lat.push_back(
+            chrono::duration_cast<chrono::duration<double, nano>>(t1 - t0)
+                .count());
+      }
+    });
+
+    vector<thread> threads;
+    auto start_time = chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < args.threads; ++i) {
+      threads.push_back(thread(
+          [&](size_t tid) {
+            unsigned seed = tid + 1;
+            for (size_t o = 0; o < args.iters; ++o) {
+              uint64_t lsn = 0;
+              auto on_write = [&]() {
+                lsn = log.append(record, record.size());
+                if (inside)
+                  log.wait(lsn);
+              };
+              tbl.upsert(keys[rand_r(&seed) % half], int(o), on_write,
+                         on_write);
+              log.wait(lsn);
+            }
+          },
+          i));
+    }
+    for (auto &t : threads)
+      t.join();
+    auto dur =
+        chrono::duration_cast<chrono::duration<double>>(
+            chrono::high_resolution_clock::now() - start_time)
+            .count();
+    done = true;
+    reader.join();
+    unlink(args.log_file.c_str());
+
+    sort(lat.begin(), lat.end());
+    auto pct = [&](double p) { return lat[size_t(p * (lat.size() - 1))]; };
+    cout << (inside ? "wait inside the bucket lock:\n"
+                    : "wait after unlocking the bucket:\n");
+    cout << "  Writer Throughput (ops/sec): " << args.threads * args.iters / dur
+         << endl;
+    cout << "  Sibling Lookup p50 (ns):     " << pct(0.5) << endl;
+    cout << "  Sibling Lookup p99 (ns):     " << pct(0.99) << endl;
+    cout << "  Sibling Lookup p99.9 (ns):   " << pct(0.999) << endl;
+    cout << "  Sibling Lookup max (ns):     " << lat.back() << endl;
+  }
+}
+
+/// Run the scenario selected on the command line against one kind of table
+///
+/// @param args The command-line arguments
+/// @param keys The keys, indexed by key number
+template <typename TABLE, typename K>
+void run(const server_arg_t &args, const vector<K> &keys) {
+  if (args.growth)
+    run_growth<TABLE>(args, keys);
+  else if (args.bulk)
+    run_bulk<TABLE>(args, keys);
+  else if (args.copy_bytes > 0)
+    run_copies<TABLE>(args, keys);
+  else if (args.siblings)
+    run_siblings<TABLE>(args, keys);
+  else if (args.calls)
+    run_calls<TABLE>(args, keys);
+  else if (!args.scan.empty())
+    run_scan<TABLE>(args, keys);
+  else
+    run_mixed<TABLE>(args, keys);
+}
+
+/// Instantiate the benchmark for the requested locking mode
+///
+/// @param args The command-line arguments
+/// @param keys The keys, indexed by key number
+///
+/// @returns false if the mode is not known
+template <typename K, typename LAYOUT>
+bool run_mode(const server_arg_t &args, const vector<K> &keys) {
+  if (args.mode == "mutex")
+    run<ConcurrentHashTable<K, int, exclusive_locking, LAYOUT>>(args, keys);
+  else if (args.mode == "rwlock")
+    run<ConcurrentHashTable<K, int, shared_locking, LAYOUT>>(args, keys);
+  else if (args.mode == "epoch")
+    run<ConcurrentHashTable<K, int, epoch_reads, LAYOUT>>(args, keys);
+  else if (args.mode == "sharded")
+    run<ShardedTable<K, int, LAYOUT>>(args, keys);
+  else
+    return false;
+  return true;
+}
+
+/// Instantiate the benchmark for the requested bucket layout
+///
+/// @param args The command-line arguments
+/// @param keys The keys, indexed by key number
+///
+/// @returns false if the layout or mode is not known
+template <typename K>
+bool run_layout(const server_arg_t &args, const vector<K> &keys) {
+  if (args.layout == "chained")
+    return run_mode<K, chained_layout>(args, keys);
+  else if (args.layout == "fingerprint")
+    return run_mode<K, fingerprint_layout>(args, keys);
+  return false;
+}
+
+int main(int argc, char **argv) {
+  // Parse the command-line arguments
+  server_arg_t args;
+  parse_args(argc, argv, args);
+  if (args.usage) {
+    usage(argv[0]);
+    return 0;
+  }
+  if (!args.scan.empty() && args.scan != "2pl" && args.scan != "snapshot") {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (args.siblings && args.log_file.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (args.compression >= 0 && args.log_file.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (args.compression >= 0) {
+    run_compress(args);
+    return 0;
+  }
+  if (!args.log_file.empty() && !args.siblings) {
+    run_log(args);
+    return 0;
+  }
+
+  // Print configuration
+  cout << "# (k,t,r,i,b,l,m,n,y,s) = (" << args.keys << "," << args.threads
+       << "," << args.reads << "," << args.iters << "," << args.buckets << ","
+       << args.max_load << "," << args.mode << "," << args.shards << ","
+       << args.layout << "," << args.strings << ")\n";
+
+  // Make the keys.  String keys are long enough that each has its own heap
+  // buffer, as the server's keys would.
+  bool ok;
+  if (args.strings) {
+    vector<string> keys(args.keys);
+    for (size_t i = 0; i < args.keys; ++i) {
+      string n = to_string(i);
+      keys[i] = string(32 - n.size(), 'k') + n;
+    }
+    ok = run_layout(args, keys);
+  } else {
+    vector<int> keys(args.keys);
+    for (size_t i = 0; i < args.keys; ++i)
+      keys[i] = i;
+    ok = run_layout(args, keys);
+  }
+  if (!ok) {
+    usage(argv[0]);
+    return 1;
+  }
+}
@@ -0,0 +1,175 @@
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "epoch.h"
+
+using namespace std;
+
+namespace {
+
+/// A thread_rec is a thread's announcement of the epoch it is reading in.
+/// Records are never freed: when a thread exits, its record is released so that
+/// a later thread can claim it.
+struct thread_rec {
+  /// The epoch this thread entered, or 0 if it is not in an epoch
+  atomic<uint64_t> local{0};
+
+  /// True while a live thread owns this record
+  atomic<bool> in_use{true};
+
+  /// The next record in the list of all records
+  thread_rec *next = nullptr;
+};
+
+/// An object that has been retired, along with the epoch it was retired in
+struct retired_t {
+  uint64_t epoch;
+  void *p;
+  void (*deleter)(void *);
+};
+
+/// The global epoch.  It starts at 1, so that 0 can mean "not in an epoch".
+atomic<uint64_t> global_epoch(1);
+
+/// The list of all thread records
+atomic<thread_rec *> records(nullptr);
+
+/// orphan_list holds retired objects left behind by threads that exited before
+/// they could be reclaimed.  Whatever is left when the program exits is
+/// reclaimed then, since no thread can be reading it any more.
+struct orphan_list {
+  mutex lock;
+  vector<retired_t> list;
+
+  ~orphan_list() {
+    for (auto &r : list)
+      r.deleter(r.p);
+  }
+};
+
+orphan_list orphans;
+
+/// The number of retired objects a thread accumulates before it tries to
+/// reclaim some of them
+const size_t RECLAIM_BATCH = 64;
+
+/// Delete every object in a list that was retired at least two epochs ago, and
+/// remove it from the list
+///
+/// @param list The list of retired objects
+/// @param now  The current global epoch
+void free_expired(vector<retired_t> &list, uint64_t now) {
+  size_t kept = 0;
+  for (size_t i = 0; i < list.size(); ++i) {
+    if (list[i].epoch + 2 <= now)
+      list[i].deleter(list[i].p);
+    else
+      list[kept++] = list[i];
+  }
+  list.resize(kept);
+}
+
+/// Advance the global epoch if every thread that is in an epoch has already
+/// seen the current one
+///
+/// @returns The global epoch after the attempt
+uint64_t try_advance() {
+  uint64_t now = global_epoch.load();
+  for (thread_rec *r = records.load(); r != nullptr; r = r->next) {
+    uint64_t l = r->local.load();
+    if (l != 0 && l != now)
+      return now;
+  }
+  global_epoch.compare_exchange_strong(now, now + 1);
+  return global_epoch.load();
+}
+
+/// thread_state is the per-thread part of the epoch system.  Its destructor
+/// runs when the thread exits.
+struct thread_state {
+  /// This thread's record, claimed on first use
+  thread_rec *rec = nullptr;
+
+  /// How deeply nested the calls to epoch_enter() are
+  int depth = 0;
+
+  /// Objects this thread retired that have not been reclaimed yet
+  vector<retired_t> limbo;
+
+  /// Claim a free record, or add a new one to the list
+  thread_rec *get_rec() {
+    if (rec != nullptr)
+      return rec;
+    for (thread_rec *r = records.load(); r != nullptr; r = r->next) {
+      bool expected = false;
+      if (r->in_use.compare_exchange_strong(expected, true)) {
+        rec = r;
+        return rec;
+      }
+    }
+    rec = new thread_rec();
+    rec->next = records.load();
+    while (!records.compare_exchange_weak(rec->next, rec)) {
+    }
+    return rec;
+  }
+
+  /// Hand this thread's leftovers to the orphan list and release its record
+  ~thread_state() {
+    if (!limbo.empty()) {
+      lock_guard<mutex> g(orphans.lock);
+      orphans.list.insert(orphans.list.end(), limbo.begin(), limbo.end());
+    }
+    if (rec != nullptr) {
+      rec->local = 0;
+      rec->in_use = false;
+    }
+  }
+};
+
+thread_local thread_state me;
+
+} // namespace
+
+/// Announce that the calling thread is about to read shared data without
+/// locking.  Calls may nest; only the outermost call has any effect.
+void epoch_enter() {
+  if (me.depth++ > 0)
+    return;
+  thread_rec *r = me.get_rec();
+  // Publish the epoch, then make sure it didn't move while we did so
+  uint64_t e = global_epoch.load();
+  r->local.store(e);
+  while (global_epoch.load() != e) {
+    e = global_epoch.load();
+    r->local.store(e);
+  }
+}
+
+/// Announce that the calling thread is done reading shared data.  Every call
+/// to epoch_enter() must be matched by a call to epoch_exit().
+void epoch_exit() {
+  if (--me.depth > 0)
+    return;
+  me.rec->local.store(0, memory_order_release);
+}
+
+/// Arrange for an object to be reclaimed once no thread can still be reading
+/// it.  The caller must already have made the object unreachable.
+///
+/// @param p       The object to reclaim
+/// @param deleter The function that reclaims p
+void epoch_retire(void *p, void (*deleter)(void *)) {
+  if (p == nullptr)
+    return;
+  me.limbo.push_back({global_epoch.load(), p, deleter});
+  if (me.limbo.size() < RECLAIM_BATCH)
+    return;
+  uint64_t now = try_advance();
+  free_expired(me.limbo, now);
+  unique_lock<mutex> g(orphans.lock, try_to_lock);
+  if (g.owns_lock())
+    free_expired(orphans.list, now);
+}
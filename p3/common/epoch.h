@@ -0,0 +1,45 @@
+#pragma once
+
+/// The epoch functions implement epoch-based reclamation (EBR).  A thread that
+/// reads shared data without holding a lock does so inside an epoch, by keeping
+/// an epoch_guard in scope.  A thread that unlinks a shared object must not
+/// delete it right away, since readers may still be looking at it; instead it
+/// passes the object to epoch_retire(), and the object is deleted once every
+/// thread that could have seen it has left its epoch.
+///
+/// Entering and leaving an epoch only writes to the calling thread's own
+/// record, so readers never write to a cache line that other readers use.
+
+/// Announce that the calling thread is about to read shared data without
+/// locking.  Calls may nest; only the outermost call has any effect.
+void epoch_enter();
+
+/// Announce that the calling thread is done reading shared data.  Every call
+/// to epoch_enter() must be matched by a call to epoch_exit().
+void epoch_exit();
+
+/// Arrange for an object to be reclaimed once no thread can still be reading
+/// it.  The caller must already have made the object unreachable.
+///
+/// @param p       The object to reclaim
+/// @param deleter The function that reclaims p
+void epoch_retire(void *p, void (*deleter)(void *));
+
+/// Arrange for an object allocated with new to be deleted once no thread can
+/// still be reading it.
+///
+/// @param p The object to delete
+template <typename T> void epoch_retire(T *p) {
+  epoch_retire((void *)p, [](void *q) { delete static_cast<T *>(q); });
+}
+
+/// epoch_guard is an RAII object that keeps the calling thread in an epoch for
+/// as long as it is in scope
+class epoch_guard {
+public:
+  /// Enter an epoch
+  epoch_guard() { epoch_enter(); }
+
+  /// Leave the epoch
+  ~epoch_guard() { epoch_exit(); }
+};
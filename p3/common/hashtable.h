@@ -1,56 +1,882 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
-#include <functional>
+#include <cstdint>
 #include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+#include "epoch.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/// exclusive_locking is a locking policy for ConcurrentHashTable in which each
+/// bucket is protected by a std::mutex.  Read-only operations lock their bucket
+/// exclusively, just like writes do.
+struct exclusive_locking {
+  /// The type of each bucket's lock
+  typedef std::mutex lock_t;
+
+  /// Do read-only lookups skip the bucket lock?
+  static const bool LOCK_FREE_READS = false;
+
+  /// Acquire a bucket lock for a read-only operation
+  static void lock_shared(lock_t &l) { l.lock(); }
+
+  /// Release a bucket lock acquired by lock_shared
+  static void unlock_shared(lock_t &l) { l.unlock(); }
+};
+
+/// shared_locking is a locking policy for ConcurrentHashTable in which each
+/// bucket is protected by a std::shared_mutex.  Read-only operations on the
+/// same bucket proceed in parallel, which helps read-mostly workloads with hot
+/// keys; writes still get the bucket to themselves.
+struct shared_locking {
+  /// The type of each bucket's lock
+  typedef std::shared_mutex lock_t;
+
+  /// Do read-only lookups skip the bucket lock?
+  static const bool LOCK_FREE_READS = false;
+
+  /// Acquire a bucket lock for a read-only operation
+  static void lock_shared(lock_t &l) { l.lock_shared(); }
+
+  /// Release a bucket lock acquired by lock_shared
+  static void unlock_shared(lock_t &l) { l.unlock_shared(); }
+};
+
+/// epoch_reads is a locking policy for ConcurrentHashTable in which
+/// do_with_readonly takes no lock at all.  Each bucket's entries are an
+/// immutable snapshot: writers lock the bucket with a std::mutex, build a new
+/// snapshot, publish it, and retire the old one through epoch_retire().
+/// Readers only write to their own epoch record, so lookups scale with cores.
+/// The price is that every write copies its bucket, so this policy suits
+/// tables that are read far more often than they are written.
+struct epoch_reads {
+  /// The type of each bucket's lock
+  typedef std::mutex lock_t;
+
+  /// Do read-only lookups skip the bucket lock?
+  static const bool LOCK_FREE_READS = true;
+
+  /// Acquire a bucket lock for a read-only scan (do_all_readonly)
+  static void lock_shared(lock_t &l) { l.lock(); }
+
+  /// Release a bucket lock acquired by lock_shared
+  static void unlock_shared(lock_t &l) { l.unlock(); }
+};
+
+/// chained_layout is the default bucket layout for ConcurrentHashTable.  Each
+/// bucket's entries are a std::vector of key/value pairs, and a lookup compares
+/// its key against the key of each entry until it finds a match.
+struct chained_layout {
+  /// The entries of one bucket
+  template <typename K, typename V>
+  struct entries : public std::vector<std::pair<K, V>> {
+    entries() = default;
+
+    /// Copy another bucket's entries, except that the value of entry i is
+    /// replaced by val (and the old one is not copied)
+    entries(const entries &o, size_t i, V &&val) {
+      this->reserve(o.size());
+      for (size_t j = 0; j < o.size(); j++) {
+        if (j == i) {
+          this->emplace_back(o[j].first, std::move(val));
+        } else {
+          this->push_back(o[j]);
+        }
+      }
+    }
+
+    /// Find the entry for a key
+    ///
+    /// @param key The key to find (its hash is not needed by this layout)
+    ///
+    /// @returns the index of the entry, or -1 if the key isn't present
+    template <typename Q> ptrdiff_t find(size_t, const Q &key) const {
+      for (size_t i = 0; i < this->size(); i++) {
+        if ((*this)[i].first == key) {
+          return i;
+        }
+      }
+      return -1;
+    }
+
+    /// Add an entry whose key has the given hash
+    template <typename E> void add(size_t, E &&e) {
+      this->push_back(std::forward<E>(e));
+    }
+
+    /// Remove the entry at index i
+    void remove(size_t i) { this->erase(this->begin() + i); }
+  };
+};
+
+/// fingerprint_layout is a bucket layout for ConcurrentHashTable in the style
+/// of a Swiss table.  Next to its key/value pairs, each bucket keeps a 1-byte
+/// fingerprint of every key's hash, in groups of 16 that can be compared
+/// against a lookup's fingerprint with one SIMD instruction.  A lookup only
+/// compares full keys (and only touches the pair array, and a string key's
+/// heap buffer) on a fingerprint hit, so a miss usually costs a single cache
+/// line.
+struct fingerprint_layout {
+  /// The entries of one bucket.  The first group of fingerprints and the
+  /// pointers to everything else fill one cache line.
+  template <typename K, typename V> class alignas(64) entries {
+    /// The number of fingerprints in a group
+    static const size_t GROUP = 16;
+
+    /// A group of fingerprints.  0 means "no entry"; fingerprints always have
+    /// their high bit set.
+    struct alignas(16) group {
+      uint8_t tag[GROUP] = {};
+    };
+
+    /// The fingerprints of the first GROUP entries
+    group first;
+
+    /// The key/value pairs
+    std::vector<std::pair<K, V>> slots;
+
+    /// The fingerprints of the entries past the first GROUP
+    std::vector<group> more;
+
+    /// The fingerprint of a hash: its top 7 bits, with the high bit set
+    static uint8_t tag_of(size_t h) {
+      return 0x80 | (h >> (sizeof(size_t) * 8 - 7));
+    }
+
+    /// The fingerprint of the entry at index i
+    uint8_t &tag(size_t i) {
+      return i < GROUP ? first.tag[i] : more[i / GROUP - 1].tag[i % GROUP];
+    }
+
+    /// The gth group of fingerprints
+    const group &group_at(size_t g) const {
+      return g == 0 ? first : more[g - 1];
+    }
+
+    /// Compare every fingerprint in a group to t
+    ///
+    /// @returns a bitmask with bit i set if fingerprint i matches
+    static uint32_t match(const group &g, uint8_t t) {
+#ifdef __SSE2__
+      __m128i tags = _mm_load_si128(reinterpret_cast<const __m128i *>(g.tag));
+      return _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8((char)t)));
+#else
+      uint32_t m = 0;
+      for (size_t i = 0; i < GROUP; i++) {
+        if (g.tag[i] == t) {
+          m |= 1u << i;
+        }
+      }
+      return m;
+#endif
+    }
+
+  public:
+    entries() = default;
+
+    /// Copy another bucket's entries, except that the value of entry i is
+    /// replaced by val (and the old one is not copied)
+    entries(const entries &o, size_t i, V &&val)
+        : first(o.first), more(o.more) {
+      slots.reserve(o.slots.size());
+      for (size_t j = 0; j < o.slots.size(); j++) {
+        if (j == i) {
+          slots.emplace_back(o.slots[j].first, std::move(val));
+        } else {
+          slots.push_back(o.slots[j]);
+        }
+      }
+    }
+
+    typedef typename std::vector<std::pair<K, V>>::iterator iterator;
+    typedef typename std::vector<std::pair<K, V>>::const_iterator
+        const_iterator;
+
+    iterator begin() { return slots.begin(); }
+    iterator end() { return slots.end(); }
+    const_iterator begin() const { return slots.begin(); }
+    const_iterator end() const { return slots.end(); }
+    size_t size() const { return slots.size(); }
+    bool empty() const { return slots.empty(); }
+    std::pair<K, V> &operator[](size_t i) { return slots[i]; }
+    const std::pair<K, V> &operator[](size_t i) const { return slots[i]; }
+
+    /// Find the entry for a key
+    ///
+    /// @param h   The key's hash
+    /// @param key The key to find
+    ///
+    /// @returns the index of the entry, or -1 if the key isn't present
+    template <typename Q> ptrdiff_t find(size_t h, const Q &key) const {
+      uint8_t t = tag_of(h);
+      for (size_t g = 0; g * GROUP < slots.size(); g++) {
+        //unused fingerprints are 0, so every hit is a real entry
+        for (uint32_t m = match(group_at(g), t); m != 0; m &= m - 1) {
+          size_t i = g * GROUP + __builtin_ctz(m);
+          if (slots[i].first == key) {
+            return i;
+          }
+        }
+      }
+      return -1;
+    }
+
+    /// Add an entry whose key has the given hash
+    template <typename E> void add(size_t h, E &&e) {
+      size_t i = slots.size();
+      if (i >= GROUP && i % GROUP == 0) {
+        more.emplace_back();
+      }
+      tag(i) = tag_of(h);
+      slots.push_back(std::forward<E>(e));
+    }
+
+    /// Remove the entry at index i, by moving the last entry into its place
+    void remove(size_t i) {
+      size_t last = slots.size() - 1;
+      if (i != last) {
+        slots[i] = std::move(slots[last]);
+        tag(i) = tag(last);
+      }
+      tag(last) = 0;
+      slots.pop_back();
+      if (last >= GROUP && last % GROUP == 0) {
+        more.pop_back();
+      }
+    }
+
+    void clear() {
+      first = group();
+      slots.clear();
+      more.clear();
+    }
+
+    void shrink_to_fit() {
+      slots.shrink_to_fit();
+      more.shrink_to_fit();
+    }
+  };
+};
+
+/// table_hash is the hash function that ConcurrentHashTable uses by default.
+/// For most key types it is just std::hash.
+template <typename K> struct table_hash {
+  size_t operator()(const K &key) const { return std::hash<K>{}(key); }
+};
+
+/// For std::string keys, table_hash is transparent: it hashes anything that
+/// converts to a std::string_view, and gives the same hash for a string and a
+/// view of the same bytes.  This lets lookups use a std::string_view into a
+/// request buffer without first copying it into a std::string.
+template <> struct table_hash<std::string> {
+  typedef void is_transparent;
+
+  size_t operator()(std::string_view key) const {
+    return std::hash<std::string_view>{}(key);
+  }
+};
+
+/// hash_is_transparent tells whether a hash function accepts lookup keys that
+/// are not of the table's key type
+template <typename H, typename = void>
+struct hash_is_transparent : std::false_type {};
+
+template <typename H>
+struct hash_is_transparent<H, std::void_t<typename H::is_transparent>>
+    : std::true_type {};
 
 /// ConcurrentHashTable is a concurrent hash table (a Key/Value store).  It is
-/// not resizable, which means that the O(1) guarantees of a hash table are lost
-/// if the number of elements in the table gets too big.
+/// resizable: whenever the average number of entries per bucket exceeds
+/// max_load, a new array of buckets that is twice as large is allocated, and
+/// the entries are migrated into it incrementally.  Each operation on the table
+/// migrates a few buckets before doing its own work, so there is never a
+/// stop-the-world pause while the whole table is rehashed.
 ///
-/// The ConcurrentHashTable is templated on the Key and Value types
+/// The ConcurrentHashTable is templated on the Key and Value types, and on a
+/// Locking policy (exclusive_locking, shared_locking or epoch_reads) that
+/// decides how read-only operations reach a bucket.  The Layout
+/// (chained_layout or fingerprint_layout) decides how a bucket stores its
+/// entries.  The Hash defaults to table_hash.  When it is transparent,
+/// do_with, do_with_readonly and remove accept any key type that can be hashed
+/// by Hash and compared to a K (e.g., a std::string_view for a table keyed by
+/// std::string).
 ///
 /// The general structure of the ConcurrentHashTable is that we have an array of
-/// buckets.  Each bucket has a mutex and a vector of entries.  Each entry is a
-/// pair, consisting of a key and a value.  We can use std::hash() to choose a
-/// bucket from a key.
-template <typename K, typename V> class ConcurrentHashTable {
+/// buckets.  Each bucket has a lock and a collection of entries.  Each entry is
+/// a pair, consisting of a key and a value.  We use Hash to choose a bucket
+/// from a key.  While a resize is in progress there are two arrays of buckets:
+/// a key lives in the old array until its bucket has been migrated, and in the
+/// new array after that.
+///
+/// do_all_readonly visits every entry under two-phase locking, which keeps all
+/// writers out until it is done.  do_all_snapshot instead visits a consistent
+/// snapshot of the table while writers keep going: the first write to a bucket
+/// after the snapshot is taken saves the bucket's old entries (copy-on-write),
+/// and the iterator visits those instead of the live ones.
+///
+/// The code that operations run on success (or on each entry) can be any
+/// callable.  The methods are templated on the callable's type, so a lambda is
+/// inlined into the bucket loop instead of being wrapped in a std::function.
+template <typename K, typename V, typename Locking = exclusive_locking,
+          typename Layout = chained_layout, typename Hash = table_hash<K>>
+class ConcurrentHashTable {
+
+  /// Is this table using lock-free reads?
+  static const bool LF = Locking::LOCK_FREE_READS;
+
+  /// The type that a lookup key of type Q is used as.  Without a transparent
+  /// hash, it is converted to a K first.
+  template <typename Q>
+  using lookup_t = std::conditional_t<hash_is_transparent<Hash>::value, Q, K>;
 
 public:
 
-  //each bucket has a lock and an array of pairs K, V
+  /// The entries of a bucket
+  typedef typename Layout::template entries<K, V> entries_t;
+
+  //each bucket has a lock and an array of pairs K, V.  Under epoch_reads, the
+  //array is an immutable snapshot (nullptr when the bucket is empty)
   struct bucket {
-    std::mutex lock;
-    std::vector<std::pair<K, V>> entry;
+    typename Locking::lock_t lock;
+    std::conditional_t<LF, std::atomic<entries_t *>, entries_t> entry{};
+    //true once all of this bucket's entries have moved to the next directory
+    std::atomic<bool> migrated{false};
+    //the id of the latest snapshot that has visited or saved this bucket
+    uint64_t snap_seen = 0;
+    //the entries as of snapshot snap_seen, saved by the first write after it
+    //was taken (nullptr if the bucket was empty or hasn't been written)
+    entries_t *preserved = nullptr;
+
+    ~bucket() {
+      if constexpr (LF)
+        delete entry.load();
+      delete preserved;
+    }
+  };
+
+  /// A directory is one generation of the table's array of buckets.  Note that
+  /// we store pointers to buckets, not buckets themselves, so that locks are
+  /// less likely to be on the same cache line.
+  struct directory {
+    std::vector<bucket*> b_vector;
+    size_t num_buckets;
+    //the directory this one is being migrated into, if any
+    std::atomic<directory *> next{nullptr};
+
+    //a directory made while snapshot snap runs isn't visited by it, so its
+    //buckets count as already seen, and writes to them save nothing
+    directory(size_t _buckets, uint64_t snap = 0) : num_buckets(_buckets) {
+      for (size_t i = 0; i < _buckets; i++) {
+        b_vector.push_back(new bucket());
+        b_vector.back()->snap_seen = snap;
+      }
+    }
+
+    ~directory() {
+      for (auto b : b_vector) {
+        delete b;
+      }
+    }
+  };
+
+private:
+
+  /// bucket_guard holds a bucket's lock for as long as it is in scope, in
+  /// shared mode for read-only operations and in exclusive mode otherwise
+  template <bool SHARED> struct bucket_guard {
+    bucket *b;
+
+    bucket_guard(bucket *_b) : b(_b) {
+      if (SHARED)
+        Locking::lock_shared(b->lock);
+      else
+        b->lock.lock();
+    }
+
+    ~bucket_guard() {
+      if (SHARED)
+        Locking::unlock_shared(b->lock);
+      else
+        b->lock.unlock();
+    }
+  };
+
+  /// bucket_view is how an operation reaches the entries of a bucket whose lock
+  /// it holds.  read() gives the current entries.  write() gives entries that
+  /// can be modified: the bucket's own vector, or under epoch_reads a private
+  /// copy of the snapshot, which is published when the view goes out of scope
+  /// (while the bucket is still locked).  If do_all_snapshot is running, the
+  /// first write to a bucket saves its old entries for the iterator.
+  struct bucket_view {
+    bucket *b;
+    uint64_t snap;
+    entries_t *copy = nullptr;
+
+    bucket_view(bucket *_b, uint64_t _snap) : b(_b), snap(_snap) {}
+
+    const entries_t &read() {
+      if constexpr (LF) {
+        if (copy != nullptr)
+          return *copy;
+        entries_t *e = b->entry.load(std::memory_order_acquire);
+        return e != nullptr ? *e : empty();
+      } else {
+        return b->entry;
+      }
+    }
+
+    entries_t &write() {
+      if constexpr (LF) {
+        if (copy == nullptr) {
+          entries_t *e = b->entry.load(std::memory_order_acquire);
+          copy = e != nullptr ? new entries_t(*e) : new entries_t();
+        }
+        return *copy;
+      } else {
+        preserve_entries(b, snap);
+        return b->entry;
+      }
+    }
+
+    /// Replace the value of entry i.  Under epoch_reads, if the bucket hasn't
+    /// been copied yet, the copy is made with the new value already in place,
+    /// so that the old value isn't copied just to be overwritten.
+    void replace(size_t i, V &&val) {
+      if constexpr (LF) {
+        if (copy == nullptr) {
+          copy = new entries_t(*b->entry.load(std::memory_order_acquire), i,
+                               std::move(val));
+          return;
+        }
+      }
+      write()[i].second = std::move(val);
+    }
+
+    ~bucket_view() {
+      if constexpr (LF) {
+        if (copy != nullptr) {
+          if (copy->empty()) {
+            delete copy;
+            copy = nullptr;
+          }
+          replace_snapshot(b, copy, snap);
+        }
+      }
+    }
   };
-  std::vector<bucket*> b_vector;
-  size_t num_buckets;
+
+  /// Before the first write to a bucket after snapshot snap was taken, save a
+  /// copy of its entries for do_all_snapshot.  The bucket must be locked.
+  ///
+  /// @param b    The bucket that is about to be written
+  /// @param snap The running snapshot, or 0 if there is none
+  static void preserve_entries(bucket *b, uint64_t snap) {
+    if (snap != 0 && b->snap_seen != snap) {
+      b->preserved = new entries_t(b->entry);
+      b->snap_seen = snap;
+    }
+  }
+
+  /// Publish a bucket's new snapshot under epoch_reads.  The old snapshot is
+  /// retired, unless it is the first one replaced since snapshot snap was
+  /// taken, in which case do_all_snapshot gets to keep it (no copy needed,
+  /// since snapshots are immutable).  The bucket must be locked.
+  ///
+  /// @param b    The bucket being written
+  /// @param next The new snapshot (nullptr for an empty bucket)
+  /// @param snap The running snapshot, or 0 if there is none
+  static void replace_snapshot(bucket *b, entries_t *next, uint64_t snap) {
+    entries_t *prev = b->entry.exchange(next, std::memory_order_acq_rel);
+    if (snap != 0 && b->snap_seen != snap) {
+      b->preserved = prev;
+      b->snap_seen = snap;
+    } else {
+      epoch_retire(prev);
+    }
+  }
+
+  /// The entries of an empty bucket under epoch_reads
+  static const entries_t &empty() {
+    static const entries_t e;
+    return e;
+  }
+
+  /// The number of old buckets that each operation migrates while a resize is
+  /// in progress
+  static const size_t MIGRATE_STEP = 4;
+
+  /// The directory that new entries go into
+  directory *cur;
+
+  /// The directory that is being migrated into cur, or nullptr if no resize is
+  /// in progress
+  directory *old = nullptr;
+
+  /// The oldest directory that may still hold entries (old if a resize is in
+  /// progress, cur otherwise).  Lock-free readers start here and follow the
+  /// next pointers of migrated buckets, so they never touch resize_lock.
+  std::atomic<directory *> head;
+
+  /// Protects the cur and old pointers.  Every operation except a lock-free
+  /// read holds it in shared mode; it is only taken exclusively to start or
+  /// finish a resize, both of which are O(1) pointer swaps.
+  std::shared_mutex resize_lock;
+
+  /// Set while one thread is allocating the next directory, so that two
+  /// threads don't both allocate one
+  std::atomic<bool> growing;
+
+  /// The next bucket of old that needs to be migrated
+  std::atomic<size_t> migrate_next;
+
+  /// The number of buckets of old that have been migrated
+  std::atomic<size_t> migrate_done;
+
+  /// The number of key/value pairs in the table
+  std::atomic<size_t> count;
+
+  /// The average bucket size that triggers a resize.  0 disables resizing.
+  const double max_load;
+
+  /// The id of the snapshot that do_all_snapshot is visiting, or 0 if there is
+  /// none.  It is written with resize_lock held exclusively and read with it
+  /// held in shared mode, so every write either happens before the snapshot or
+  /// sees its id.
+  uint64_t active_snap = 0;
+
+  /// Directories whose resize finished while a snapshot was running.  The
+  /// snapshot may still have to visit their buckets, so they are only freed
+  /// once it is done.  Protected by resize_lock.
+  std::vector<directory *> snap_held;
+
+  /// The id of the most recent snapshot
+  uint64_t last_snap = 0;
+
+  /// Only one do_all_snapshot runs at a time
+  std::mutex snap_lock;
+
+  /// Reclaim a directory that no operation can reach any more.  Lock-free
+  /// readers might still be walking it, so under epoch_reads it is retired.
+  ///
+  /// @param d The directory to reclaim
+  void free_directory(directory *d) {
+    if constexpr (LF)
+      epoch_retire(d);
+    else
+      delete d;
+  }
+
+  /// Move every entry of an old bucket into the bucket of cur that it hashes
+  /// to.  The caller must hold resize_lock in shared mode.  Locks are always
+  /// acquired old-then-new, so this can't deadlock with do_all_readonly.
+  ///
+  /// @param ob The bucket of old to migrate
+  void migrate_bucket(bucket *ob) {
+    bucket_guard<false> guard(ob);
+    bucket_view ov(ob, active_snap);
+    auto place = [&](auto &&e) {
+      size_t h = Hash{}(e.first);
+      bucket *nb = cur->b_vector[h % cur->num_buckets];
+      bucket_guard<false> nguard(nb);
+      bucket_view nv(nb, active_snap);
+      nv.write().add(h, std::forward<decltype(e)>(e));
+    };
+    //lock-free readers may still be reading the old snapshot, so its entries
+    //are copied rather than moved
+    if constexpr (LF) {
+      for (auto &e : ov.read())
+        place(e);
+    } else {
+      preserve_entries(ob, active_snap);
+      for (auto &e : ob->entry)
+        place(std::move(e));
+    }
+    //readers check migrated after loading a snapshot, so the entries must be
+    //in cur before the flag is set
+    ob->migrated.store(true, std::memory_order_release);
+    if constexpr (LF) {
+      replace_snapshot(ob, nullptr, active_snap);
+    } else {
+      ob->entry.clear();
+      ob->entry.shrink_to_fit();
+    }
+  }
+
+  /// Help an in-progress resize by migrating up to MIGRATE_STEP buckets.  The
+  /// caller must hold resize_lock in shared mode.
+  void migrate_some() {
+    if (old == nullptr) {
+      return;
+    }
+    for (size_t s = 0; s < MIGRATE_STEP; s++) {
+      size_t i = migrate_next.fetch_add(1);
+      if (i >= old->num_buckets) {
+        return;
+      }
+      migrate_bucket(old->b_vector[i]);
+      migrate_done.fetch_add(1);
+    }
+  }
+
+  /// Run f on the locked bucket that holds (or would hold) a key.  While a
+  /// resize is in progress, that is the key's bucket in old, unless that bucket
+  /// has already been migrated.
+  ///
+  /// @tparam SHARED True if f only reads the bucket
+  ///
+  /// @param h The hash of the key whose bucket is needed
+  /// @param f The code to run on a view of the bucket, while its lock is held
+  ///
+  /// @returns the result of f
+  template <bool SHARED, typename F> bool with_bucket(size_t h, F f) {
+    bool result;
+    bool resize = false;
+    {
+      std::shared_lock<std::shared_mutex> dir_guard(resize_lock);
+      migrate_some();
+      bool done = false;
+      if (old != nullptr) {
+        bucket *ob = old->b_vector[h % old->num_buckets];
+        bucket_guard<SHARED> guard(ob);
+        if (!ob->migrated) {
+          bucket_view v(ob, active_snap);
+          result = f(v);
+          done = true;
+        }
+      }
+      if (!done) {
+        bucket *nb = cur->b_vector[h % cur->num_buckets];
+        bucket_guard<SHARED> guard(nb);
+        bucket_view v(nb, active_snap);
+        result = f(v);
+      }
+      resize = (old != nullptr && migrate_done == old->num_buckets) ||
+               (old == nullptr && max_load > 0 &&
+                count > max_load * cur->num_buckets);
+    }
+    if (resize) {
+      resize_step();
+    }
+    return result;
+  }
+
+  /// Run f on the snapshot of the bucket that holds a key, without taking any
+  /// lock.  The snapshot is loaded before the bucket's migrated flag is
+  /// checked, so a snapshot from an unmigrated bucket was current at the time
+  /// of the check.  The caller must be in an epoch.
+  ///
+  /// @param h The hash of the key whose bucket is needed
+  /// @param f The code to run on the bucket's entries
+  ///
+  /// @returns the result of f
+  template <typename F> bool with_snapshot(size_t h, F f) {
+    directory *d = head.load(std::memory_order_acquire);
+    while (true) {
+      bucket *b = d->b_vector[h % d->num_buckets];
+      entries_t *e = b->entry.load(std::memory_order_acquire);
+      if (!b->migrated.load(std::memory_order_acquire))
+        return f(e != nullptr ? *e : empty());
+      d = d->next.load(std::memory_order_acquire);
+    }
+  }
+
+  /// Start or finish a resize.  Allocating the new directory happens without
+  /// holding resize_lock, so that other operations aren't blocked for the time
+  /// it takes to create all of its buckets.  A running snapshot doesn't hold
+  /// resizes off: it already has its list of buckets, and migrating a bucket
+  /// saves its entries for the snapshot like any other write.
+  void resize_step() {
+    //finish: all of old has been migrated, so it can be reclaimed
+    {
+      std::unique_lock<std::shared_mutex> dir_guard(resize_lock);
+      if (old != nullptr) {
+        if (migrate_done == old->num_buckets) {
+          head.store(cur, std::memory_order_release);
+          //a running snapshot may not have visited old's buckets yet
+          if (active_snap != 0) {
+            snap_held.push_back(old);
+          } else {
+            free_directory(old);
+          }
+          old = nullptr;
+        }
+        return;
+      }
+      if (max_load == 0 || count <= max_load * cur->num_buckets) {
+        return;
+      }
+    }
+    //start: only one thread gets to allocate the next directory
+    bool expected = false;
+    if (!growing.compare_exchange_strong(expected, true)) {
+      return;
+    }
+    size_t next_size;
+    uint64_t snap;
+    {
+      std::shared_lock<std::shared_mutex> dir_guard(resize_lock);
+      next_size = cur->num_buckets * 2;
+      snap = active_snap;
+    }
+    directory *next = new directory(next_size, snap);
+    {
+      std::unique_lock<std::shared_mutex> dir_guard(resize_lock);
+      //someone else may have resized (or cleared) while we allocated, or a
+      //snapshot that would visit next's buckets may have started
+      if (old == nullptr && cur->num_buckets * 2 == next_size &&
+          (active_snap == 0 || active_snap == snap)) {
+        cur->next.store(next, std::memory_order_release);
+        old = cur;
+        cur = next;
+        migrate_next = 0;
+        migrate_done = 0;
+        next = nullptr;
+      }
+    }
+    delete next;
+    growing = false;
+  }
+
+public:
   /// Construct a concurrent hash table by specifying the number of buckets it
   /// should have
   ///
-  /// @param _buckets The number of buckets in the concurrent hash table
-  ConcurrentHashTable(size_t _buckets) {
-    this->num_buckets = _buckets;
-    //std::vector<std::mutex> l_array(_buckets);
-    for (int i=0; i< int(_buckets); i++) {
-      bucket* buc = new bucket();
-      this->b_vector.push_back(buc);
-    }
+  /// @param _buckets  The initial number of buckets in the concurrent hash
+  ///                  table
+  /// @param _max_load The average number of entries per bucket at which the
+  ///                  table doubles its bucket count (0 for a fixed size)
+  ConcurrentHashTable(size_t _buckets, double _max_load = 2)
+      : cur(new directory(_buckets)), head(cur), growing(false),
+        migrate_next(0), migrate_done(0), count(0), max_load(_max_load) {}
+
+  /// Destruct a concurrent hash table by freeing all of its buckets
+  ~ConcurrentHashTable() {
+    delete old;
+    delete cur;
   }
 
   /// Clear the Concurrent Hash Table.  This operation needs to use 2pl
   void clear() {
-    //first acquire all the locks 
-    for (int i=0; i<int(b_vector.size()); i++) {
-      b_vector[i]->lock.lock();
-      b_vector[i]->entry.clear();
+    //wait for any snapshot to finish, since it needs both directories
+    std::lock_guard<std::mutex> snap_guard(snap_lock);
+    //holding resize_lock exclusively keeps every other operation out
+    std::unique_lock<std::shared_mutex> dir_guard(resize_lock);
+    if (old != nullptr) {
+      head.store(cur, std::memory_order_release);
+      free_directory(old);
+      old = nullptr;
     }
-    //after all the operations, unlock all of them
-    for (int i=0; i<int(b_vector.size()); i++) {
-      b_vector[i]->lock.unlock();
+    for (int i=0; i<int(cur->b_vector.size()); i++) {
+      bucket_view v(cur->b_vector[i], 0);
+      v.write().clear();
     }
+    count = 0;
+  }
+
+  /// Fill an empty table with a batch of key/value pairs.  This is much faster
+  /// than inserting them one at a time: the table is sized for the whole batch
+  /// up front, and the buckets are built directly, without taking their locks
+  /// or looking for duplicates.  The caller must make sure that the table is
+  /// empty, that the keys are distinct, and that no other thread uses the
+  /// table until bulk_load returns.
+  ///
+  /// @param items   The key/value pairs, which are moved into the table
+  /// @param threads The number of threads that build the table.  Each one
+  ///                builds its own range of buckets.
+  void bulk_load(std::vector<std::pair<K, V>> &&items, size_t threads = 1) {
+    std::lock_guard<std::mutex> snap_guard(snap_lock);
+    std::unique_lock<std::shared_mutex> dir_guard(resize_lock);
+    //grow the same way that resizing would, until the batch fits
+    size_t size = cur->num_buckets;
+    while (max_load > 0 && items.size() > max_load * size) {
+      size *= 2;
+    }
+    if (old != nullptr) {
+      free_directory(old);
+      old = nullptr;
+    }
+    if (size != cur->num_buckets) {
+      free_directory(cur);
+      cur = new directory(size);
+    }
+    head.store(cur, std::memory_order_release);
+
+    size_t n = items.size();
+    threads = std::max(size_t(1), std::min({threads, size, n}));
+    //run f(t) for each t in [0, threads), on that many threads
+    auto parallel = [&](auto f) {
+      std::vector<std::thread> workers;
+      for (size_t t = 1; t < threads; t++) {
+        workers.push_back(std::thread(f, t));
+      }
+      f(0);
+      for (auto &w : workers) {
+        w.join();
+      }
+    };
+
+    //each thread hashes a slice of the items, and counts how many go to each
+    //thread's range of buckets
+    std::vector<size_t> hashes(n);
+    std::vector<std::vector<size_t>> counts(threads,
+                                            std::vector<size_t>(threads));
+    auto range_of = [&](size_t h) { return (h % size) * threads / size; };
+    parallel([&](size_t t) {
+      for (size_t i = t * n / threads; i < (t + 1) * n / threads; i++) {
+        hashes[i] = Hash{}(items[i].first);
+        counts[t][range_of(hashes[i])]++;
+      }
+    });
+    //order lists the items by range; within a range, slice t's items start at
+    //starts[t][range]
+    std::vector<size_t> order(n);
+    std::vector<std::vector<size_t>> starts(threads,
+                                            std::vector<size_t>(threads));
+    std::vector<size_t> range_start(threads + 1);
+    size_t pos = 0;
+    for (size_t r = 0; r < threads; r++) {
+      range_start[r] = pos;
+      for (size_t t = 0; t < threads; t++) {
+        starts[t][r] = pos;
+        pos += counts[t][r];
+      }
+    }
+    range_start[threads] = n;
+    parallel([&](size_t t) {
+      for (size_t i = t * n / threads; i < (t + 1) * n / threads; i++) {
+        order[starts[t][range_of(hashes[i])]++] = i;
+      }
+    });
+    //each thread builds the buckets of its range
+    parallel([&](size_t r) {
+      for (size_t o = range_start[r]; o < range_start[r + 1]; o++) {
+        size_t i = order[o];
+        bucket *b = cur->b_vector[hashes[i] % size];
+        if constexpr (LF) {
+          entries_t *e = b->entry.load(std::memory_order_relaxed);
+          if (e == nullptr) {
+            e = new entries_t();
+            b->entry.store(e, std::memory_order_relaxed);
+          }
+          e->add(hashes[i], std::move(items[i]));
+        } else {
+          b->entry.add(hashes[i], std::move(items[i]));
+        }
+      }
+    });
+    count = n;
+    items.clear();
   }
 
   /// Insert the provided key/value pair only if there is no mapping for the key
@@ -62,21 +888,20 @@ public:
   ///
   /// @returns true if the key/value was inserted, false if the key already
   ///          existed in the table
-  bool insert(K key, V val, std::function<void()> on_success) { 
-    //generating index from hashing
-    int index = std::hash<K>{}(key)%num_buckets;
-    //lock guard will release the lock once it goes out of scope
-    std::lock_guard<std::mutex> guard(b_vector[index]->lock);
-    for (int i = 0 ; i < int(b_vector[index]->entry.size()) ; i++) {
-      if (b_vector[index]->entry[i].first == key) {
+  template <typename OnSuccess>
+  bool insert(K key, V val, OnSuccess &&on_success) {
+    size_t h = Hash{}(key);
+    return with_bucket<false>(h, [&](bucket_view &b) {
+      if (b.read().find(h, key) >= 0) {
         return false;
       }
-    }
-    //insert new element
-    b_vector[index]->entry.push_back(std::make_pair(key, val));
-    //Code to run if the insertion succeeds
-    on_success();
-    return true;
+      //insert new element
+      b.write().add(h, std::make_pair(std::move(key), std::move(val)));
+      count.fetch_add(1);
+      //Code to run if the insertion succeeds
+      on_success();
+      return true;
+    });
   }
 
   /// Insert the provided key/value pair if there is no mapping for the key yet.
@@ -90,93 +915,98 @@ public:
   ///
   /// @returns true if the key/value was inserted, false if the key already
   ///          existed in the table and was thus updated instead
-  bool upsert(K key, V val, std::function<void()> on_ins,
-              std::function<void()> on_upd) {
-    //generating index from hashing
-    int index = std::hash<K>{}(key)%num_buckets;
-    //lock guard will release the lock once it goes out of scope
-    std::lock_guard<std::mutex> guard(b_vector[index]->lock);
-    for (int i = 0 ; i < int(b_vector[index]->entry.size()) ; i++) {
-      if (b_vector[index]->entry[i].first == key) {
-        b_vector[index]->entry[i].second = val;
+  template <typename OnIns, typename OnUpd>
+  bool upsert(K key, V val, OnIns &&on_ins, OnUpd &&on_upd) {
+    size_t h = Hash{}(key);
+    return with_bucket<false>(h, [&](bucket_view &b) {
+      ptrdiff_t i = b.read().find(h, key);
+      if (i >= 0) {
+        b.replace(i, std::move(val));
         //Code to run if the upsert succeeds as an update
         on_upd();
         return false;
       }
-    }
-    //insert new element
-    b_vector[index]->entry.push_back(std::make_pair(key, val));
-    //Code to run if the upsert succeeds as an insert
-    on_ins();
-    return true;
+      //insert new element
+      b.write().add(h, std::make_pair(std::move(key), std::move(val)));
+      count.fetch_add(1);
+      //Code to run if the upsert succeeds as an insert
+      on_ins();
+      return true;
+    });
   }
 
   /// Apply a function to the value associated with a given key.  The function
   /// is allowed to modify the value.
   ///
-  /// @param key The key whose value will be modified
-  /// @param f   The function to apply to the key's value
+  /// @param lookup The key whose value will be modified
+  /// @param f      The function to apply to the key's value
   ///
   /// @returns true if the key existed and the function was applied, false
   ///          otherwise
-  bool do_with(K key, std::function<void(V &)> f) { 
-    //generating index from hashing
-    int index = std::hash<K>{}(key)%num_buckets;
-    //lock guard will release the lock once it goes out of scope
-    std::lock_guard<std::mutex> guard(b_vector[index]->lock);
-    for (int i = 0 ; i < int(b_vector[index]->entry.size()) ; i++) {
-      if (b_vector[index]->entry[i].first == key) {
-        f(b_vector[index]->entry[i].second);
-        return true;
+  template <typename Q, typename F> bool do_with(const Q &lookup, F &&f) {
+    const lookup_t<Q> &key = lookup;
+    size_t h = Hash{}(key);
+    return with_bucket<false>(h, [&](bucket_view &b) {
+      ptrdiff_t i = b.read().find(h, key);
+      if (i < 0) {
+        return false;
       }
-    }
-    return false;   
+      f(b.write()[i].second);
+      return true;
+    });
   }
 
   /// Apply a function to the value associated with a given key.  The function
   /// is not allowed to modify the value.
   ///
-  /// @param key The key whose value will be modified
-  /// @param f   The function to apply to the key's value
+  /// @param lookup The key whose value will be read
+  /// @param f      The function to apply to the key's value
   ///
   /// @returns true if the key existed and the function was applied, false
   ///          otherwise
-  bool do_with_readonly(K key, std::function<void(const V &)> f) {
-    //same as do_with since V is alreayd declared as const
-    //generating index from hashing
-    int index = std::hash<K>{}(key)%num_buckets;
-    //lock guard will release the lock once it goes out of scope
-    std::lock_guard<std::mutex> guard(b_vector[index]->lock);
-    for (int i = 0 ; i < int(b_vector[index]->entry.size()) ; i++) {
-      if (b_vector[index]->entry[i].first == key) {
-        f(b_vector[index]->entry[i].second);
-        return true;
+  template <typename Q, typename F>
+  bool do_with_readonly(const Q &lookup, F &&f) {
+    const lookup_t<Q> &key = lookup;
+    size_t h = Hash{}(key);
+    auto find = [&](const entries_t &entries) {
+      ptrdiff_t i = entries.find(h, key);
+      if (i < 0) {
+        return false;
       }
+      f(entries[i].second);
+      return true;
+    };
+    if constexpr (LF) {
+      epoch_guard g;
+      return with_snapshot(h, find);
+    } else {
+      return with_bucket<true>(h,
+                               [&](bucket_view &b) { return find(b.read()); });
     }
-    return false; 
   }
 
   /// Remove the mapping from a key to its value
   ///
-  /// @param key        The key whose mapping should be removed
+  /// @param lookup     The key whose mapping should be removed
   /// @param on_success Code to run if the remove succeeds
   ///
   /// @returns true if the key was found and the value unmapped, false otherwise
-  bool remove(K key, std::function<void()> on_success) { 
-    //generating index from hashing
-    int index = std::hash<K>{}(key)%num_buckets;
-    //lock guard will release the lock once it goes out of scope
-    std::lock_guard<std::mutex> guard(b_vector[index]->lock);
-    for (auto i = b_vector[index]->entry.begin(); i != b_vector[index]->entry.end(); i++) {
-      if ((*i).first == key) {
-        b_vector[index]->entry.erase(i);
-        //Code to run if the remove succeeds
-        on_success();
-        return true;
+  template <typename Q, typename OnSuccess>
+  bool remove(const Q &lookup, OnSuccess &&on_success) {
+    const lookup_t<Q> &key = lookup;
+    size_t h = Hash{}(key);
+    return with_bucket<false>(h, [&](bucket_view &b) {
+      ptrdiff_t i = b.read().find(h, key);
+      //key wasn't found, false
+      if (i < 0) {
+        return false;
       }
-    }
-    //key wasn't found, false
-    return false;   
+      b.write().remove(i);
+      count.fetch_sub(1);
+      //Code to run if the remove succeeds
+      on_success();
+      return true;
+    });
   }
 
   /// Apply a function to every key/value pair in the ConcurrentHashTable.  Note
@@ -185,20 +1015,155 @@ public:
   /// @param f    The function to apply to each key/value pair
   /// @param then A function to run when this is done, but before unlocking...
   ///             useful for 2pl
-  void do_all_readonly(std::function<void(const K, const V &)> f,
-                       std::function<void()> then) {
-                         //2 phase locking 
-      for (int i=0; i<int(b_vector.size()); i++) {
-        b_vector[i]->lock.lock();
-        for (int j=0; j<int(b_vector[i]->entry.size()); j++) {
-          f(b_vector[i]->entry[j].first, b_vector[i]->entry[j].second);
+  template <typename F, typename Then>
+  void do_all_readonly(F &&f, Then &&then) {
+    //resize_lock keeps the directories from changing underneath us
+    std::shared_lock<std::shared_mutex> dir_guard(resize_lock);
+    //2 phase locking, old buckets before new ones
+    std::vector<bucket*> locked;
+    if (old != nullptr) {
+      locked.insert(locked.end(), old->b_vector.begin(), old->b_vector.end());
+    }
+    locked.insert(locked.end(), cur->b_vector.begin(), cur->b_vector.end());
+    for (int i=0; i<int(locked.size()); i++) {
+      Locking::lock_shared(locked[i]->lock);
+      bucket_view v(locked[i], 0);
+      for (auto &e : v.read()) {
+        f(e.first, e.second);
+      }
+    }
+    //after f, before unlocking
+    then();
+    //unlocking phase
+    for (int i=0; i<int(locked.size()); i++) {
+      Locking::unlock_shared(locked[i]->lock);
+    }
+  }
+
+  /// Apply a function to every key/value pair in a consistent snapshot of the
+  /// ConcurrentHashTable, without keeping writers out.  The snapshot is taken
+  /// at a moment when no write is in progress; writes that come after it keep
+  /// going, and are not seen by f.  Each bucket is locked only while it is
+  /// being visited.  Only one snapshot runs at a time.  The table keeps
+  /// resizing while it runs; the directories that it still needs are freed
+  /// once it is done.
+  ///
+  /// @param f      The function to apply to each key/value pair
+  /// @param at_cut Code to run at the moment the snapshot is taken... useful
+  ///               for knowing which later writes the snapshot doesn't have
+  template <typename F, typename AtCut>
+  void do_all_snapshot(F &&f, AtCut &&at_cut) {
+    std::lock_guard<std::mutex> snap_guard(snap_lock);
+    std::vector<bucket*> buckets;
+    uint64_t snap;
+    {
+      //with resize_lock held exclusively, no write is in progress
+      std::unique_lock<std::shared_mutex> dir_guard(resize_lock);
+      snap = active_snap = ++last_snap;
+      if (old != nullptr) {
+        buckets.insert(buckets.end(), old->b_vector.begin(),
+                       old->b_vector.end());
+      }
+      buckets.insert(buckets.end(), cur->b_vector.begin(), cur->b_vector.end());
+      at_cut();
+    }
+    for (bucket *b : buckets) {
+      if constexpr (LF) {
+        //keeps the bucket's current snapshot alive after it is unlocked
+        epoch_guard g;
+        entries_t *e;
+        bool was_saved;
+        {
+          bucket_guard<false> guard(b);
+          was_saved = b->snap_seen == snap;
+          e = was_saved ? b->preserved : b->entry.load();
+          b->preserved = nullptr;
+          b->snap_seen = snap;
+        }
+        if (e != nullptr) {
+          for (auto &p : *e) {
+            f(p.first, p.second);
+          }
+        }
+        //lock-free readers may have loaded a saved snapshot before it was
+        //replaced
+        if (was_saved) {
+          epoch_retire(e);
         }
+      } else {
+        //the entries saved by a write since the cut
+        entries_t *saved;
+        {
+          bucket_guard<false> guard(b);
+          if (b->snap_seen != snap) {
+            //not written since the cut, so visit it in place
+            b->snap_seen = snap;
+            for (auto &p : b->entry) {
+              f(p.first, p.second);
+            }
+            continue;
+          }
+          saved = b->preserved;
+          b->preserved = nullptr;
+        }
+        for (auto &p : *saved) {
+          f(p.first, p.second);
+        }
+        delete saved;
       }
-      //after f, before unlocking
-      then();
-      //unlocking phase 
-      for (int i=0; i<int(b_vector.size()); i++) {
-        b_vector[i]->lock.unlock();
+    }
+    {
+      std::unique_lock<std::shared_mutex> dir_guard(resize_lock);
+      active_snap = 0;
+      for (directory *d : snap_held) {
+        free_directory(d);
       }
+      snap_held.clear();
+    }
+  }
+
+  /// Run some code at a moment when no write is in progress, keeping writers
+  /// out until it returns.  Lock-free readers keep going.  This is useful
+  /// before fork(): the child's copy of the table has no half-done write, so it
+  /// can be visited with do_all_unlocked().
+  ///
+  /// @param then The code to run
+  template <typename Then> void do_quiesced(Then &&then) {
+    //with resize_lock held exclusively, no write (or migration) is in progress
+    std::unique_lock<std::shared_mutex> dir_guard(resize_lock);
+    then();
+  }
+
+  /// Apply a function to every key/value pair in the ConcurrentHashTable,
+  /// without taking any lock.  This is only safe when no other thread can
+  /// reach the table, and no write was cut off in the middle... for example,
+  /// in a child that was forked from within do_quiesced().  The child's copies
+  /// of the locks may be held by threads that it doesn't have, so they must
+  /// not be touched.
+  ///
+  /// @param f The function to apply to each key/value pair
+  template <typename F> void do_all_unlocked(F &&f) {
+    //a bucket of old that has been migrated is empty, so every pair is visited
+    //once
+    for (directory *d : {old, cur}) {
+      if (d == nullptr) {
+        continue;
+      }
+      for (bucket *b : d->b_vector) {
+        bucket_view v(b, 0);
+        for (auto &e : v.read()) {
+          f(e.first, e.second);
+        }
+      }
+    }
+  }
+
+  /// Report the number of key/value pairs in the table
+  size_t size() { return count; }
+
+  /// Report the number of buckets that new entries are hashed into
+  size_t bucket_count() {
+    std::shared_lock<std::shared_mutex> dir_guard(resize_lock);
+    return cur->num_buckets;
   }
 };
@@ -315,3 +315,7 @@ const std::string RES_OKUPD = "OKUPD";
 /// Response code to indicate that there was an error when searching for the
 /// given key
 const std::string RES_ERR_KEY = "ERR_KEY";
+
+/// Response code to indicate that the server couldn't make a change durable,
+/// because writing or syncing its log failed
+const std::string RES_ERR_SERVER = "ERR_SERVER";
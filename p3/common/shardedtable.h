@@ -0,0 +1,503 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "hashtable.h"
+
+/// ShardedTable is a Key/Value store that is split into shards, each of which
+/// is owned by one thread.  Only the owner ever touches its shard: a request
+/// is routed to the owning shard through a lock-free message queue, the owner
+/// runs it, and the caller waits for the result.  Since no two threads touch
+/// the same shard, the shard's bucket locks are never contended, and their
+/// cache lines never bounce between cores.
+///
+/// ShardedTable has the same interface as ConcurrentHashTable.  The code that
+/// an operation runs (on success, or on the value) runs on the owner thread,
+/// while the caller waits, so it can safely use the caller's variables.  It
+/// must not use the ShardedTable itself.
+template <typename K, typename V, typename Layout = chained_layout,
+          typename Hash = table_hash<K>>
+class ShardedTable {
+  /// The table that holds one shard.  Its locks are only there so that
+  /// do_all_snapshot can visit it from another thread.
+  typedef ConcurrentHashTable<K, V, exclusive_locking, Layout, Hash> table_t;
+
+  /// A request is a message to a shard's owner.  It lives on the stack of the
+  /// thread that makes the request, which waits until it is done.
+  struct request {
+    /// The next request in the queue
+    std::atomic<request *> next{nullptr};
+
+    /// The code to run on the owner thread, and its argument
+    bool (*run)(void *ctx, table_t &tbl) = nullptr;
+    void *ctx = nullptr;
+
+    /// The result of run
+    bool result = false;
+
+    /// Set by the owner once run has returned
+    std::atomic<bool> done{false};
+  };
+
+  /// mpsc_queue is an intrusive multi-producer, single-consumer queue (in the
+  /// style of Vyukov's).  Pushing is one atomic exchange, and popping needs no
+  /// atomic read-modify-write at all in the common case.
+  class mpsc_queue {
+    /// Producers add requests after this one
+    std::atomic<request *> head;
+
+    /// The consumer takes requests from here
+    request *tail;
+
+    /// A placeholder that keeps the queue from ever being truly empty
+    request stub;
+
+  public:
+    mpsc_queue() : head(&stub), tail(&stub) {}
+
+    /// Add a request to the queue.  Any thread may call this.
+    void push(request *r) {
+      r->next.store(nullptr, std::memory_order_relaxed);
+      request *prev = head.exchange(r, std::memory_order_acq_rel);
+      prev->next.store(r, std::memory_order_release);
+    }
+
+    /// Take the oldest request off the queue.  Only the owner may call this.
+    ///
+    /// @returns the request, or nullptr if there is none (or if a producer is
+    ///          in the middle of adding the only one)
+    request *pop() {
+      request *t = tail;
+      request *next = t->next.load(std::memory_order_acquire);
+      if (t == &stub) {
+        if (next == nullptr) {
+          return nullptr;
+        }
+        tail = next;
+        t = next;
+        next = next->next.load(std::memory_order_acquire);
+      }
+      if (next != nullptr) {
+        tail = next;
+        return t;
+      }
+      if (t != head.load(std::memory_order_acquire)) {
+        return nullptr;
+      }
+      push(&stub);
+      next = t->next.load(std::memory_order_acquire);
+      if (next != nullptr) {
+        tail = next;
+        return t;
+      }
+      return nullptr;
+    }
+
+    /// Is the queue empty?  Only the owner may call this.
+    bool empty() {
+      return tail == &stub && head.load(std::memory_order_seq_cst) == &stub;
+    }
+  };
+
+  /// A shard is a table, the queue of requests for it, and the thread that
+  /// owns it.  The owner spins briefly when its queue runs dry, and then
+  /// sleeps until a request arrives.
+  struct shard {
+    table_t tbl;
+    mpsc_queue queue;
+
+    /// Set while the owner is asleep (or about to be)
+    std::atomic<bool> sleeping{false};
+
+    /// Lets the owner sleep while its queue is empty
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+
+    /// Set when the owner should exit
+    bool stop = false;
+
+    std::thread owner;
+
+    shard(size_t buckets, double max_load) : tbl(buckets, max_load) {
+      owner = std::thread([this]() { serve(); });
+    }
+
+    ~shard() {
+      {
+        std::lock_guard<std::mutex> g(sleep_lock);
+        stop = true;
+      }
+      wake.notify_one();
+      owner.join();
+    }
+
+    /// Give a request to the owner
+    void post(request *r) {
+      queue.push(r);
+      if (sleeping.load(std::memory_order_seq_cst)) {
+        std::lock_guard<std::mutex> g(sleep_lock);
+        wake.notify_one();
+      }
+    }
+
+    /// The owner's main loop
+    void serve() {
+      while (true) {
+        request *r = queue.pop();
+        if (r != nullptr) {
+          r->result = r->run(r->ctx, tbl);
+          //the caller may free r as soon as it sees done
+          r->done.store(true, std::memory_order_release);
+          continue;
+        }
+        for (size_t i = 0; i < SPIN && queue.empty(); i++) {
+          std::this_thread::yield();
+        }
+        if (!queue.empty()) {
+          continue;
+        }
+        std::unique_lock<std::mutex> g(sleep_lock);
+        sleeping.store(true, std::memory_order_seq_cst);
+        while (queue.empty() && !stop) {
+          wake.wait(g);
+        }
+        sleeping.store(false, std::memory_order_relaxed);
+        if (stop && queue.empty()) {
+          return;
+        }
+      }
+    }
+  };
+
+  /// How many times a thread polls before it gives up and waits
+  static const size_t SPIN = 64;
+
+  /// The shards
+  std::vector<std::unique_ptr<shard>> shards;
+
+  /// Only one pause (do_all_readonly or do_all_snapshot) at a time
+  std::mutex scan_lock;
+
+  /// Set while every owner is paused
+  bool paused = false;
+
+  /// The number of owners that have stopped for the current pause
+  size_t arrived = 0;
+
+  /// Wakes the owners when a pause is over
+  std::mutex pause_lock;
+  std::condition_variable unpause;
+
+  /// Choose the shard for a hash.  The hash is mixed first, so that the keys
+  /// of a shard still spread over all of the shard's buckets.
+  size_t shard_index(size_t h) {
+    return ((h * 0x9E3779B97F4A7C15ull) >> 32) % shards.size();
+  }
+
+  /// The shard for a hash
+  shard &shard_of(size_t h) { return *shards[shard_index(h)]; }
+
+  /// Run f on the owner of a shard, and wait for the result
+  ///
+  /// @param s The shard
+  /// @param f The code to run on the shard's table
+  ///
+  /// @returns the result of f
+  template <typename F> bool on_owner(shard &s, F &f) {
+    request r;
+    r.run = [](void *ctx, table_t &tbl) {
+      return (*static_cast<F *>(ctx))(tbl);
+    };
+    r.ctx = &f;
+    s.post(&r);
+    for (size_t i = 0; !r.done.load(std::memory_order_acquire); i++) {
+      if (i >= SPIN) {
+        std::this_thread::yield();
+      }
+    }
+    return r.result;
+  }
+
+  /// Stop every owner between requests, so that no shard changes until
+  /// resume_all() is called.  This gives a single moment in time that is the
+  /// same for all shards.
+  ///
+  /// @param reqs One request per shard, which must live until resume_all()
+  ///             returns
+  void pause_all(std::vector<request> &reqs) {
+    {
+      std::lock_guard<std::mutex> g(pause_lock);
+      paused = true;
+      arrived = 0;
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+      reqs[i].run = [](void *ctx, table_t &) {
+        auto self = static_cast<ShardedTable *>(ctx);
+        std::unique_lock<std::mutex> g(self->pause_lock);
+        ++self->arrived;
+        while (self->paused) {
+          self->unpause.wait(g);
+        }
+        return true;
+      };
+      reqs[i].ctx = this;
+      shards[i]->post(&reqs[i]);
+    }
+    //wait for every owner to arrive
+    while (true) {
+      {
+        std::lock_guard<std::mutex> g(pause_lock);
+        if (arrived == shards.size()) {
+          return;
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  /// Let the owners go again after pause_all()
+  ///
+  /// @param reqs The requests that were given to pause_all()
+  void resume_all(std::vector<request> &reqs) {
+    {
+      std::lock_guard<std::mutex> g(pause_lock);
+      paused = false;
+    }
+    unpause.notify_all();
+    for (auto &r : reqs) {
+      while (!r.done.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+public:
+  /// Construct a sharded table
+  ///
+  /// @param _shards   The number of shards (and owner threads)
+  /// @param _buckets  The initial number of buckets in each shard
+  /// @param _max_load The average number of entries per bucket at which a
+  ///                  shard doubles its bucket count (0 for a fixed size)
+  ShardedTable(size_t _shards, size_t _buckets, double _max_load = 2) {
+    for (size_t i = 0; i < _shards; i++) {
+      shards.push_back(std::make_unique<shard>(_buckets, _max_load));
+    }
+  }
+
+  /// Clear every shard.  This must not run at the same time as other
+  /// operations.
+  void clear() {
+    for (auto &s : shards) {
+      s->tbl.clear();
+    }
+  }
+
+  /// Fill an empty table with a batch of key/value pairs.  The batch is split
+  /// by shard, and each owner builds its own shard, so the shards are built in
+  /// parallel.  The caller must make sure that the table is empty, that the
+  /// keys are distinct, and that no other thread uses the table until
+  /// bulk_load returns.
+  ///
+  /// @param items The key/value pairs, which are moved into the table
+  void bulk_load(std::vector<std::pair<K, V>> &&items, size_t = 1) {
+    std::vector<std::vector<std::pair<K, V>>> parts(shards.size());
+    for (auto &e : items) {
+      parts[shard_index(Hash{}(e.first))].push_back(std::move(e));
+    }
+    items.clear();
+    std::vector<request> reqs(shards.size());
+    for (size_t i = 0; i < shards.size(); i++) {
+      reqs[i].run = [](void *ctx, table_t &tbl) {
+        auto part = static_cast<std::vector<std::pair<K, V>> *>(ctx);
+        tbl.bulk_load(std::move(*part));
+        return true;
+      };
+      reqs[i].ctx = &parts[i];
+      shards[i]->post(&reqs[i]);
+    }
+    for (auto &r : reqs) {
+      while (!r.done.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  /// Insert the provided key/value pair only if there is no mapping for the key
+  /// yet.
+  ///
+  /// @param key        The key to insert
+  /// @param val        The value to insert
+  /// @param on_success Code to run if the insertion succeeds
+  ///
+  /// @returns true if the key/value was inserted, false if the key already
+  ///          existed in the table
+  template <typename OnSuccess>
+  bool insert(K key, V val, OnSuccess &&on_success) {
+    shard &s = shard_of(Hash{}(key));
+    auto f = [&](table_t &tbl) {
+      return tbl.insert(std::move(key), std::move(val), on_success);
+    };
+    return on_owner(s, f);
+  }
+
+  /// Insert the provided key/value pair if there is no mapping for the key yet.
+  /// If there is a key, then update the mapping by replacing the old value with
+  /// the provided value
+  ///
+  /// @param key    The key to upsert
+  /// @param val    The value to upsert
+  /// @param on_ins Code to run if the upsert succeeds as an insert
+  /// @param on_upd Code to run if the upsert succeeds as an update
+  ///
+  /// @returns true if the key/value was inserted, false if the key already
+  ///          existed in the table and was thus updated instead
+  template <typename OnIns, typename OnUpd>
+  bool upsert(K key, V val, OnIns &&on_ins, OnUpd &&on_upd) {
+    shard &s = shard_of(Hash{}(key));
+    auto f = [&](table_t &tbl) {
+      return tbl.upsert(std::move(key), std::move(val), on_ins, on_upd);
+    };
+    return on_owner(s, f);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value.
+  ///
+  /// @param lookup The key whose value will be modified
+  /// @param f      The function to apply to the key's value
+  ///
+  /// @returns true if the key existed and the function was applied, false
+  ///          otherwise
+  template <typename Q, typename F> bool do_with(const Q &lookup, F &&f) {
+    auto g = [&](table_t &tbl) { return tbl.do_with(lookup, f); };
+    return on_owner(shard_of(Hash{}(lookup)), g);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.
+  ///
+  /// @param lookup The key whose value will be read
+  /// @param f      The function to apply to the key's value
+  ///
+  /// @returns true if the key existed and the function was applied, false
+  ///          otherwise
+  template <typename Q, typename F>
+  bool do_with_readonly(const Q &lookup, F &&f) {
+    auto g = [&](table_t &tbl) { return tbl.do_with_readonly(lookup, f); };
+    return on_owner(shard_of(Hash{}(lookup)), g);
+  }
+
+  /// Remove the mapping from a key to its value
+  ///
+  /// @param lookup     The key whose mapping should be removed
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @returns true if the key was found and the value unmapped, false otherwise
+  template <typename Q, typename OnSuccess>
+  bool remove(const Q &lookup, OnSuccess &&on_success) {
+    auto f = [&](table_t &tbl) { return tbl.remove(lookup, on_success); };
+    return on_owner(shard_of(Hash{}(lookup)), f);
+  }
+
+  /// Apply a function to every key/value pair in the ShardedTable, with every
+  /// owner paused.  Note that the function is not allowed to modify keys or
+  /// values.
+  ///
+  /// @param f    The function to apply to each key/value pair
+  /// @param then A function to run when this is done, but before the owners
+  ///             resume
+  template <typename F, typename Then>
+  void do_all_readonly(F &&f, Then &&then) {
+    std::lock_guard<std::mutex> scan_guard(scan_lock);
+    std::vector<request> reqs(shards.size());
+    pause_all(reqs);
+    for (auto &s : shards) {
+      s->tbl.do_all_readonly(f, []() {});
+    }
+    then();
+    resume_all(reqs);
+  }
+
+  /// Apply a function to every key/value pair in a consistent snapshot of the
+  /// ShardedTable.  The owners are paused only while each shard's snapshot is
+  /// taken; the shards are then visited in parallel, but f is never run by two
+  /// threads at once.
+  ///
+  /// @param f      The function to apply to each key/value pair
+  /// @param at_cut Code to run at the moment the snapshot is taken
+  template <typename F, typename AtCut>
+  void do_all_snapshot(F &&f, AtCut &&at_cut) {
+    std::lock_guard<std::mutex> scan_guard(scan_lock);
+    std::vector<request> reqs(shards.size());
+    pause_all(reqs);
+    std::atomic<size_t> cuts(0);
+    std::mutex f_lock;
+    std::vector<std::thread> visitors;
+    for (auto &s : shards) {
+      visitors.push_back(std::thread([&, tbl = &s->tbl]() {
+        tbl->do_all_snapshot(
+            [&](const K &k, const V &v) {
+              std::lock_guard<std::mutex> g(f_lock);
+              f(k, v);
+            },
+            [&]() { ++cuts; });
+      }));
+    }
+    while (cuts != shards.size()) {
+      std::this_thread::yield();
+    }
+    at_cut();
+    resume_all(reqs);
+    for (auto &t : visitors) {
+      t.join();
+    }
+  }
+
+  /// Run some code with every owner paused between requests, so that no shard
+  /// has a write in progress.  This is useful before fork(): the child's copy
+  /// of every shard can be visited with do_all_unlocked().
+  ///
+  /// @param then The code to run
+  template <typename Then> void do_quiesced(Then &&then) {
+    std::lock_guard<std::mutex> scan_guard(scan_lock);
+    std::vector<request> reqs(shards.size());
+    pause_all(reqs);
+    then();
+    resume_all(reqs);
+  }
+
+  /// Apply a function to every key/value pair in every shard, without
+  /// involving the owners or taking any lock.  This is only safe in a child
+  /// that was forked from within do_quiesced(), where the owner threads don't
+  /// exist.
+  ///
+  /// @param f The function to apply to each key/value pair
+  template <typename F> void do_all_unlocked(F &&f) {
+    for (auto &s : shards) {
+      s->tbl.do_all_unlocked(f);
+    }
+  }
+
+  /// Report the number of key/value pairs in the table
+  size_t size() {
+    size_t n = 0;
+    for (auto &s : shards) {
+      n += s->tbl.size();
+    }
+    return n;
+  }
+
+  /// Report the number of buckets, over all shards
+  size_t bucket_count() {
+    size_t n = 0;
+    for (auto &s : shards) {
+      n += s->tbl.bucket_count();
+    }
+    return n;
+  }
+};
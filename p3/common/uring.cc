@@ -0,0 +1,140 @@
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/// Unmap the rings and close the io_uring
+Uring::~Uring() {
+  if (sqes != nullptr) {
+    munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+  }
+  if (cq_ptr != nullptr && cq_ptr != sq_ptr) {
+    munmap(cq_ptr, cq_len);
+  }
+  if (sq_ptr != nullptr) {
+    munmap(sq_ptr, sq_len);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+/// Create the io_uring
+///
+/// @param entries The number of submission queue entries
+///
+/// @returns false if io_uring is unavailable (or too old to be used)
+bool Uring::init(unsigned entries) {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0) {
+    return false;
+  }
+  features = p.features;
+  // We rely on the kernel to keep CQEs that don't fit in the completion
+  // queue, instead of dropping them
+  if (!(p.features & IORING_FEAT_NODROP)) {
+    return false;
+  }
+
+  // Map the rings.  Newer kernels put both of them in one mapping.
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+  }
+  void *ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ptr == MAP_FAILED) {
+    return false;
+  }
+  sq_ptr = ptr;
+  if (single) {
+    cq_ptr = sq_ptr;
+  } else {
+    ptr = mmap(nullptr, cq_len, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ptr == MAP_FAILED) {
+      return false;
+    }
+    cq_ptr = ptr;
+  }
+  sq_entries = p.sq_entries;
+  ptr = mmap(nullptr, sq_entries * sizeof(io_uring_sqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+             IORING_OFF_SQES);
+  if (ptr == MAP_FAILED) {
+    return false;
+  }
+  sqes = (io_uring_sqe *)ptr;
+
+  char *sq = (char *)sq_ptr, *cq = (char *)cq_ptr;
+  sq_head = (unsigned *)(sq + p.sq_off.head);
+  sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  sq_array = (unsigned *)(sq + p.sq_off.array);
+  cq_head = (unsigned *)(cq + p.cq_off.head);
+  cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+  local_tail = *sq_tail;
+  return true;
+}
+
+/// Get a zeroed SQE to fill in.  If the submission queue is full, the queued
+/// SQEs are submitted first.
+///
+/// @returns the SQE, or nullptr if the queue is still full
+io_uring_sqe *Uring::get_sqe() {
+  if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+    submit(0);
+    if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >=
+        sq_entries) {
+      return nullptr;
+    }
+  }
+  unsigned index = local_tail & *sq_mask;
+  io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  ++local_tail;
+  return sqe;
+}
+
+/// Hand every queued SQE to the kernel, and wait for CQEs
+///
+/// @param wait The number of CQEs to wait for (0 to not wait)
+///
+/// @returns the number of SQEs submitted, or -errno on error
+int Uring::submit(unsigned wait) {
+  // The kernel may read the SQEs as soon as it sees the new tail, so the tail
+  // is published with release semantics
+  __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+  unsigned pending = local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  if (pending == 0 && wait == 0) {
+    return 0;
+  }
+  ++enters;
+  int res = syscall(__NR_io_uring_enter, fd, pending, wait,
+                    wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+  return res < 0 ? -errno : res;
+}
+
+/// Get the next CQE, without waiting
+///
+/// @returns the CQE, or nullptr if there is none
+io_uring_cqe *Uring::peek() {
+  unsigned head = *cq_head;
+  if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    return nullptr;
+  }
+  return &cqes[head & *cq_mask];
+}
+
+/// Mark the CQE from peek() as consumed
+void Uring::seen() { __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE); }
@@ -40,7 +40,8 @@ int main(int argc, char **argv) {
 
   // If the data file exists, load the data into a Storage object.  Otherwise,
   // create an empty Storage object.
-  Storage storage(args.datafile, args.num_buckets);
+  Storage storage(args.datafile, args.num_buckets, args.shards,
+                  args.durability, args.compaction);
   if (!storage.load()) {
     return 0;
   }
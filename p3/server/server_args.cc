@@ -0,0 +1,134 @@
+#include <iostream>
+#include <libgen.h>
+#include <unistd.h>
+
+#include "server_args.h"
+
+using namespace std;
+
+/// Parse the command-line arguments, and use them to populate the provided args
+/// object.
+///
+/// @param argc The number of command-line arguments passed to the program
+/// @param argv The list of command-line arguments
+/// @param args The struct into which the parsed args should go
+void parse_args(int argc, char **argv, server_arg_t &args) {
+  long opt;
+  while ((opt = getopt(argc, argv, "p:f:k:ht:b:s:l:w:e:g:v:x:Uc:m:zi:u:d:r:o:a:")) != -1) {
+    switch (opt) {
+    case 'p':
+      args.port = atoi(optarg);
+      break;
+    case 'f':
+      args.datafile = string(optarg);
+      break;
+    case 'k':
+      args.keyfile = string(optarg);
+      break;
+    case 'h':
+      args.usage = true;
+      break;
+    case 't':
+      args.threads = atoi(optarg);
+      break;
+    case 'b':
+      args.num_buckets = atoi(optarg);
+      break;
+    case 's':
+      args.shards = atoi(optarg);
+      break;
+    case 'l':
+      if (!durability_t::parse(string(optarg), args.durability.level)) {
+        args.usage = true;
+        return;
+      }
+      break;
+    case 'w':
+      args.durability.window_us = atoi(optarg);
+      break;
+    case 'e':
+      args.durability.interval_ms = atoi(optarg);
+      break;
+    case 'g':
+      args.durability.segment_bytes = size_t(atoi(optarg)) << 20;
+      break;
+    case 'v':
+      args.durability.version = atoi(optarg);
+      if (args.durability.version < 1 || args.durability.version > 2) {
+        args.usage = true;
+        return;
+      }
+      break;
+    case 'x':
+      args.durability.compression = atoi(optarg);
+      if (args.durability.compression < 0 || args.durability.compression > 9) {
+        args.usage = true;
+        return;
+      }
+      break;
+    case 'U':
+      args.durability.uring = true;
+      break;
+    case 'c':
+      args.compaction.ratio = atof(optarg);
+      break;
+    case 'm':
+      args.compaction.min_bytes = size_t(atoi(optarg)) << 20;
+      break;
+    case 'z':
+      args.compaction.fork = true;
+      break;
+    case 'i':
+    case 'u':
+    case 'd':
+    case 'r':
+    case 'o':
+    case 'a':
+      break;
+    default:
+      args.usage = true;
+      return;
+    }
+  }
+}
+
+/// Display a help message to explain how the command-line parameters for this
+/// program work
+///
+/// @progname The name of the program
+void usage(char *progname) {
+  cout << basename(progname) << ": company user directory server\n"
+       << "  -p [int]    Port on which to listen for incoming connections\n"
+       << "  -f [string] File for storing all data\n"
+       << "  -k [string] Basename of file for storing the server's RSA keys\n"
+       << "  -t [int]    # of threads that server should use\n"
+       << "  -b [int]    # of buckets for the server's hash tables\n"
+       << "  -s [int]    # of kv_store shards, each owned by one thread\n"
+       << "              (0 = one table shared by all threads)\n"
+       << "  -l [string] Durability of the log: strict (sync each record),\n"
+       << "              batched (group commit), periodic (sync every -e ms,\n"
+       << "              in the background) or none (OS-buffered)\n"
+       << "  -w [int]    For batched: us to wait for a batch to fill up\n"
+       << "  -e [int]    For periodic: ms between syncs\n"
+       << "  -g [int]    Write the log as CRC-checked segment files of this\n"
+       << "              many MB, next to the data file (0 = in the file)\n"
+       << "  -v [int]    Record format version to write: 1 (8-byte codes), or\n"
+       << "              2 (1-byte codes, varint lengths); a file in the other\n"
+       << "              version is rewritten when it is loaded\n"
+       << "  -x [int]    zlib level (1-9) for compressing checkpoints and log\n"
+       << "              batches in blocks (0 = no compression)\n"
+       << "  -U          Write and sync the log with io_uring, if the kernel\n"
+       << "              has it\n"
+       << "  -c [float]  Compact the data file in the background once it is\n"
+       << "              this many times its last checkpoint (0 = never)\n"
+       << "  -m [int]    Don't compact in the background below this many MB\n"
+       << "  -z          Write checkpoints (SAV and compaction) from a forked\n"
+       << "              child, in the style of BGSAVE\n"
+       << "  -i [int]    Ignored\n"
+       << "  -u [int]    Ignored\n"
+       << "  -d [int]    Ignored\n"
+       << "  -r [int]    Ignored\n"
+       << "  -o [int]    Ignored\n"
+       << "  -a [string] Ignored\n"
+       << "  -h          Print help (this message)\n";
+}
@@ -2,6 +2,8 @@
 
 #include <string>
 
+#include "server_persist.h"
+
 /// arg_t is used to store the command-line arguments of the program
 struct server_arg_t {
   /// The port on which to listen
@@ -21,6 +23,16 @@ struct server_arg_t {
 
   /// Number of buckets for the server's hash tables
   size_t num_buckets = 1024;
+
+  /// Number of kv_store shards, each owned by its own thread (0 for a single
+  /// shared table)
+  size_t shards = 0;
+
+  /// When the incremental persistence log makes records durable
+  durability_t durability;
+
+  /// When the data file is compacted in the background
+  compaction_t compaction;
 };
 
 /// Parse the command-line arguments, and use them to populate the provided args
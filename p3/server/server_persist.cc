@@ -0,0 +1,909 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <libgen.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "server_persist.h"
+
+using namespace std;
+
+/// Find the level with a given name (strict, batched, periodic or none)
+///
+/// @param name  The name of the level
+/// @param level Set to the level, if the name is known
+///
+/// @returns true if the name is known
+bool durability_t::parse(const string &name, level_t &level) {
+  if (name == "strict")
+    level = STRICT;
+  else if (name == "batched")
+    level = BATCHED;
+  else if (name == "periodic")
+    level = PERIODIC;
+  else if (name == "none")
+    level = NONE;
+  else
+    return false;
+  return true;
+}
+
+/// Append a varint to a vec: 7 bits per byte, least significant first, with
+/// the high bit set on every byte but the last
+///
+/// @param v The vec into which we should append
+/// @param i The integer to append
+void varint_append(vec &v, uint64_t i) {
+  while (i >= 0x80) {
+    v.push_back((i & 0x7f) | 0x80);
+    i >>= 7;
+  }
+  v.push_back(i);
+}
+
+/// Read a varint
+///
+/// @param data  The bytes
+/// @param size  The number of bytes
+/// @param index The offset of the varint, which is advanced past it
+/// @param i     Set to the integer
+///
+/// @returns false if the varint is cut off or too long
+bool varint_read(const unsigned char *data, size_t size, size_t &index,
+                 uint64_t &i) {
+  i = 0;
+  for (unsigned shift = 0; shift < 64 && index < size; shift += 7) {
+    unsigned char b = data[index++];
+    i |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Append a range of records to a vec as a compressed block, or, if they don't
+/// get any smaller, as a batch frame
+///
+/// @param v     The vec into which we should append
+/// @param data  The records
+/// @param bytes The number of bytes
+/// @param level The zlib level (1 to 9)
+void block_append(vec &v, const unsigned char *data, size_t bytes, int level) {
+  //raw deflate, since the block has its own header
+  z_stream z = {};
+  vec out;
+  if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+    out.resize(deflateBound(&z, bytes));
+    z.next_in = (unsigned char *)data;
+    z.avail_in = bytes;
+    z.next_out = out.data();
+    z.avail_out = out.size();
+    if (deflate(&z, Z_FINISH) == Z_STREAM_END) {
+      out.resize(z.total_out);
+    } else {
+      out.clear();
+    }
+    deflateEnd(&z);
+  }
+  if (!out.empty() && out.size() < bytes) {
+    v.push_back(REC_ZBLOCK);
+    varint_append(v, out.size());
+    varint_append(v, bytes);
+    v.insert(v.end(), out.begin(), out.end());
+  } else {
+    v.push_back(REC_BATCH);
+    varint_append(v, bytes);
+    v.insert(v.end(), data, data + bytes);
+  }
+}
+
+/// Inflate the records of a compressed block
+///
+/// @param data  The block's deflate data
+/// @param bytes The number of bytes of deflate data
+/// @param raw   The number of bytes of records
+/// @param out   Set to the records
+///
+/// @returns false if the block doesn't inflate to exactly raw bytes
+bool block_inflate(const unsigned char *data, size_t bytes, size_t raw,
+                   vec &out) {
+  z_stream z = {};
+  if (inflateInit2(&z, -15) != Z_OK) {
+    return false;
+  }
+  out.resize(raw);
+  z.next_in = (unsigned char *)data;
+  z.avail_in = bytes;
+  z.next_out = out.data();
+  z.avail_out = raw;
+  bool ok = inflate(&z, Z_FINISH) == Z_STREAM_END && z.total_out == raw;
+  inflateEnd(&z);
+  return ok;
+}
+
+/// The magic constants at the start of a segment and at the end of its footer
+static const char WAL_SEGMENT[] = "WALSEG01";
+static const char WAL_FOOTER[] = "WALFOOT1";
+
+/// The bytes in front of each record of a segment: its length and checksum
+static const size_t WAL_HEADER = 8;
+
+/// The table for computing a CRC32C one byte at a time
+struct crc32c_table {
+  uint32_t t[256];
+
+  crc32c_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+      }
+      t[i] = c;
+    }
+  }
+};
+
+#if defined(__x86_64__)
+/// Continue a CRC32C with the SSE4.2 crc32 instruction, 8 bytes at a time
+///
+/// @param data  The bytes
+/// @param bytes The number of bytes
+/// @param crc   The CRC so far
+///
+/// @returns the new CRC
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(const unsigned char *data, size_t bytes, uint32_t crc) {
+  uint64_t c = crc;
+  for (; bytes >= 8; data += 8, bytes -= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    c = _mm_crc32_u64(c, word);
+  }
+  crc = c;
+  for (; bytes > 0; data++, bytes--) {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
+}
+#endif
+
+/// Compute the CRC32C (Castagnoli) checksum of a range of bytes, with the
+/// SSE4.2 crc32 instruction if the CPU has it
+///
+/// @param data  The bytes
+/// @param bytes The number of bytes
+///
+/// @returns the checksum
+uint32_t crc32c(const unsigned char *data, size_t bytes) {
+  uint32_t crc = ~0u;
+#if defined(__x86_64__)
+  static const bool sse42 = __builtin_cpu_supports("sse4.2");
+  if (sse42) {
+    return ~crc32c_sse42(data, bytes, crc);
+  }
+#endif
+  static const crc32c_table table;
+  for (size_t i = 0; i < bytes; i++) {
+    crc = table.t[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+/// Make a segment's file name
+///
+/// @param base The name of the data file that the log belongs to
+/// @param seq  The segment's sequence number
+///
+/// @returns the file name
+static string wal_segment_name(const string &base, uint64_t seq) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".wal.%016llu", (unsigned long long)seq);
+  return base + suffix;
+}
+
+/// Sync the directory that holds a file, so that a file that was just
+/// created, renamed or deleted stays that way after a crash
+///
+/// @param filename The name of the file
+void sync_dir(const string &filename) {
+  string copy = filename;
+  int dfd = ::open(dirname(&copy[0]), O_RDONLY | O_DIRECTORY);
+  if (dfd >= 0) {
+    fsync(dfd);
+    ::close(dfd);
+  }
+}
+
+/// Build the footer of a segment
+///
+/// @param offsets The offset of each record
+///
+/// @returns the footer
+static vec wal_footer(const vector<uint32_t> &offsets) {
+  vec footer(offsets.size() * 4 + 16);
+  uint32_t count = offsets.size();
+  memcpy(footer.data(), offsets.data(), offsets.size() * 4);
+  memcpy(footer.data() + offsets.size() * 4, &count, 4);
+  uint32_t crc = crc32c(footer.data(), offsets.size() * 4 + 4);
+  memcpy(footer.data() + offsets.size() * 4 + 4, &crc, 4);
+  memcpy(footer.data() + offsets.size() * 4 + 8, WAL_FOOTER, 8);
+  return footer;
+}
+
+/// Find the segments of a write-ahead log
+///
+/// @param base The name of the data file that the log belongs to
+///
+/// @returns the segments, in order
+vector<wal_segment_t> wal_list_segments(const string &base) {
+  vector<wal_segment_t> segments;
+  string dir_copy = base, base_copy = base;
+  string dir = dirname(&dir_copy[0]);
+  string prefix = string(basename(&base_copy[0])) + ".wal.";
+  DIR *d = opendir(dir.c_str());
+  if (d == nullptr) {
+    return segments;
+  }
+  while (dirent *e = readdir(d)) {
+    string name = e->d_name;
+    if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix))
+      continue;
+    string digits = name.substr(prefix.size());
+    if (digits.find_first_not_of("0123456789") != string::npos)
+      continue;
+    segments.push_back({stoull(digits), dir + "/" + name});
+  }
+  closedir(d);
+  sort(segments.begin(), segments.end(),
+       [](auto &a, auto &b) { return a.seq < b.seq; });
+  return segments;
+}
+
+/// Find the records of a write-ahead log segment.  A sealed segment's records
+/// are found through its footer index; an unsealed one is scanned from the
+/// start.  Either way, every record's checksum is checked, and the records
+/// stop at the first one that is torn or corrupt.
+///
+/// @param data   The segment's bytes
+/// @param bytes  The size of the segment
+/// @param intact Set to the number of bytes before the first torn or corrupt
+///               record (bytes, if there is none)
+/// @param sealed Set to true if the segment has a valid footer
+///
+/// @returns the offset and size of each intact record (not counting its length
+///          and checksum)
+vector<pair<size_t, size_t>> wal_read_segment(const unsigned char *data,
+                                              size_t bytes, size_t &intact,
+                                              bool &sealed) {
+  vector<pair<size_t, size_t>> records;
+  intact = 0;
+  sealed = false;
+  if (bytes < 8 || memcmp(data, WAL_SEGMENT, 8) != 0) {
+    return records;
+  }
+
+  //the record at an offset, if it is intact and ends by end
+  auto read_record = [&](size_t off, size_t end) {
+    if (off > end || end - off < WAL_HEADER) {
+      return false;
+    }
+    uint32_t len, crc;
+    memcpy(&len, data + off, 4);
+    memcpy(&crc, data + off + 4, 4);
+    if (end - off - WAL_HEADER < len ||
+        crc32c(data + off + WAL_HEADER, len) != crc) {
+      return false;
+    }
+    records.push_back({off + WAL_HEADER, len});
+    return true;
+  };
+
+  //a sealed segment's footer says where its records are
+  uint32_t count = 0, crc = 0;
+  if (bytes >= 24 && memcmp(data + bytes - 8, WAL_FOOTER, 8) == 0) {
+    memcpy(&count, data + bytes - 16, 4);
+    memcpy(&crc, data + bytes - 12, 4);
+    size_t index_bytes = size_t(count) * 4;
+    if (bytes - 24 >= index_bytes &&
+        crc32c(data + bytes - 16 - index_bytes, index_bytes + 4) == crc) {
+      size_t end = bytes - 16 - index_bytes;
+      for (size_t i = 0; i < count; i++) {
+        uint32_t off;
+        memcpy(&off, data + end + i * 4, 4);
+        if (!read_record(off, end)) {
+          intact = off;
+          return records;
+        }
+      }
+      intact = bytes;
+      sealed = true;
+      return records;
+    }
+  }
+
+  //otherwise, scan until the records run out
+  size_t off = 8;
+  while (read_record(off, bytes)) {
+    off = records.back().first + records.back().second;
+  }
+  intact = off;
+  return records;
+}
+
+/// Seal an unsealed segment by writing its footer index, after cutting off
+/// whatever follows its intact records
+///
+/// @param filename The segment's file name
+/// @param data     The segment's bytes
+/// @param intact   The number of bytes of intact records
+/// @param records  The intact records, from wal_read_segment()
+///
+/// @returns true on success
+bool wal_seal_segment(const string &filename, const unsigned char *data,
+                      size_t intact, const vector<pair<size_t, size_t>> &records) {
+  vector<uint32_t> offsets;
+  for (auto &r : records) {
+    offsets.push_back(r.first - WAL_HEADER);
+  }
+  int fd = ::open(filename.c_str(), O_WRONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = true;
+  //a segment whose header is torn gets a new one
+  if (intact < 8) {
+    ok = pwrite(fd, WAL_SEGMENT, 8, 0) == 8;
+    intact = 8;
+  }
+  vec footer = wal_footer(offsets);
+  ok = ok && ftruncate(fd, intact) == 0 &&
+       pwrite(fd, footer.data(), footer.size(), intact) == ssize_t(footer.size()) &&
+       fdatasync(fd) == 0;
+  ::close(fd);
+  return ok;
+}
+
+/// Construct a LogWriter with no file, and start its flusher
+///
+/// @param _durability When records are made durable
+LogWriter::LogWriter(durability_t _durability) : durability(_durability) {
+  if (durability.uring) {
+    ring.reset(new Uring());
+    //writes at the end of the file need IORING_FEAT_RW_CUR_POS
+    if (!ring->init(8) || !(ring->features & IORING_FEAT_RW_CUR_POS)) {
+      cerr << "io_uring is unavailable, so the log uses write() and "
+              "fdatasync()\n";
+      ring.reset();
+    }
+  }
+  flusher = thread([this]() { flush_loop(); });
+}
+
+/// Make everything that was appended durable, stop the flusher, and close the
+/// file
+LogWriter::~LogWriter() {
+  {
+    lock_guard<mutex> g(queue_lock);
+    stop = true;
+  }
+  work.notify_one();
+  flusher.join();
+  if (!base.empty()) {
+    seal_segment();
+  } else if (fd >= 0) {
+    if (durability.level == durability_t::NONE) {
+      sync_file();
+    }
+    ::close(fd);
+  }
+}
+
+/// Write a range of bytes to the file.  The caller must hold io_lock.
+///
+/// @param data  The bytes
+/// @param bytes The number of bytes
+///
+/// @returns true on success
+bool LogWriter::write_all(const unsigned char *data, size_t bytes) {
+  size_t off = 0;
+  while (off < bytes) {
+    ++io_calls;
+    ssize_t n = ::write(fd, data + off, bytes - off);
+    if (n <= 0) {
+      cerr << "error on write()\n";
+      return false;
+    }
+    off += n;
+  }
+  return true;
+}
+
+/// Write an array of buffers to the file, and sync it if asked to.  With
+/// io_uring, the write and the sync are linked SQEs, so both are done with a
+/// single io_uring_enter(), and the sync only runs once the write has
+/// succeeded.  The caller must hold io_lock.
+///
+/// @param iov   The buffers
+/// @param count The number of buffers
+/// @param sync  True if the file should be synced after the write
+///
+/// @returns true if everything was written (and synced, if asked to)
+bool LogWriter::write_iov(const struct iovec *iov, int count, bool sync) {
+  size_t bytes = 0;
+  for (int i = 0; i < count; ++i) {
+    bytes += iov[i].iov_len;
+  }
+  ssize_t n = -1;
+  //-ECANCELED until the ring reports how the sync went
+  int synced = -ECANCELED;
+  if (ring) {
+    io_uring_sqe *sqe = ring->get_sqe();
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)iov;
+    sqe->len = count;
+    sqe->off = uint64_t(-1);
+    sqe->user_data = 0;
+    if (sync) {
+      sqe->flags = IOSQE_IO_LINK;
+      sqe = ring->get_sqe();
+      sqe->opcode = IORING_OP_FSYNC;
+      sqe->fd = fd;
+      sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+      sqe->user_data = 1;
+    }
+    unsigned want = sync ? 2 : 1;
+    int res = ring->submit(want);
+    if (res < 0 && res != -EINTR) {
+      //the SQEs were not taken, so give up on the ring
+      cerr << "error on io_uring_enter()\n";
+      io_calls += ring->enters;
+      ring.reset();
+    }
+    for (unsigned got = 0; ring && got < want;) {
+      io_uring_cqe *cqe = ring->peek();
+      if (cqe == nullptr) {
+        ring->submit(want - got);
+        continue;
+      }
+      if (cqe->user_data == 0) {
+        n = cqe->res;
+      } else {
+        synced = cqe->res;
+      }
+      ring->seen();
+      ++got;
+    }
+  }
+  if (!ring) {
+    ++io_calls;
+    n = writev(fd, iov, count);
+  }
+  if (n < 0) {
+    cerr << "error on writev()\n";
+    return false;
+  }
+  //finish a short write, and then sync, since a short write cancels the
+  //linked sync
+  if (size_t(n) < bytes) {
+    for (int i = 0; i < count; ++i) {
+      size_t len = iov[i].iov_len;
+      if (size_t(n) < len) {
+        if (!write_all((const unsigned char *)iov[i].iov_base + n, len - n)) {
+          return false;
+        }
+        n = 0;
+      } else {
+        n -= len;
+      }
+    }
+    synced = -ECANCELED;
+  }
+  if (!sync) {
+    return true;
+  }
+  //a sync that failed isn't retried: after a failed fdatasync(), the kernel
+  //may have dropped the dirty pages, so a second one can succeed without them
+  if (synced == -ECANCELED) {
+    synced = sync_file() ? 0 : -errno;
+  }
+  if (synced < 0) {
+    cerr << "error on fdatasync()\n";
+    return false;
+  }
+  return true;
+}
+
+/// Sync the file.  The caller must hold io_lock.
+///
+/// @returns true on success
+bool LogWriter::sync_file() {
+  ++io_calls;
+  return fdatasync(fd) == 0;
+}
+
+/// Write a range of records to the file, and sync it if asked to.  In a data
+/// file of version 2 records, they go in a batch frame, which is written with
+/// them in one writev(); if the log is compressed, they go in a compressed
+/// block instead.  The caller must hold io_lock.
+///
+/// @param data  The records
+/// @param bytes The number of bytes
+/// @param sync  True if the file should be synced after the write
+///
+/// @returns true if the records were written (and synced, if asked to)
+bool LogWriter::write_records(const unsigned char *data, size_t bytes,
+                              bool sync) {
+  if (!base.empty() ||
+      (durability.version < 2 && durability.compression == 0)) {
+    struct iovec iov = {(void *)data, bytes};
+    return write_iov(&iov, 1, sync);
+  }
+  if (durability.compression > 0) {
+    vec block;
+    block_append(block, data, bytes, durability.compression);
+    struct iovec iov = {block.data(), block.size()};
+    return write_iov(&iov, 1, sync);
+  }
+  vec frame = {REC_BATCH};
+  varint_append(frame, bytes);
+  struct iovec iov[2] = {{frame.data(), frame.size()},
+                         {(void *)data, bytes}};
+  return write_iov(iov, 2, sync);
+}
+
+/// Mark every record up to lsn as durable (or as failed), and wake the threads
+/// waiting for them
+///
+/// @param lsn    The LSN of the last record that is now durable
+/// @param synced True if the file was synced to make it so
+/// @param ok     False if the records couldn't be written or synced
+void LogWriter::advance(uint64_t lsn, bool synced, bool ok) {
+  {
+    lock_guard<mutex> q(queue_lock);
+    //records are done in order, so the first failed one is the first one
+    //that wasn't durable yet
+    if (!ok && failed_from == 0) {
+      failed_from = durable + 1;
+    }
+    if (lsn > durable) {
+      durable = lsn;
+    }
+    if (synced) {
+      ++sync_count;
+    }
+  }
+  done.notify_all();
+}
+
+/// The flusher's main loop: take the whole queue, write it, sync it, and wake
+/// the threads that are waiting for it
+void LogWriter::flush_loop() {
+  vec batch;
+  vector<size_t> sizes;
+  while (true) {
+    {
+      unique_lock<mutex> q(queue_lock);
+      if (durability.level == durability_t::PERIODIC) {
+        work.wait_for(q, chrono::milliseconds(durability.interval_ms), [&]() {
+          return stop || (draining && !pending.empty());
+        });
+      } else {
+        work.wait(q, [&]() { return !pending.empty() || stop; });
+      }
+      if (pending.empty()) {
+        if (stop) {
+          return;
+        }
+        continue;
+      }
+      //give more records a chance to join the batch
+      if (durability.level == durability_t::BATCHED &&
+          durability.window_us > 0 && !stop && !draining) {
+        work.wait_for(q, chrono::microseconds(durability.window_us),
+                      [&]() { return stop || draining; });
+      }
+    }
+    //the batch is only taken once io_lock is held, so that reopen() can't
+    //drop it while it is being written
+    lock_guard<mutex> io(io_lock);
+    uint64_t upto;
+    {
+      lock_guard<mutex> q(queue_lock);
+      batch.swap(pending);
+      sizes.swap(pending_sizes);
+      upto = appended;
+    }
+    write_batch(batch, sizes, upto);
+    batch.clear();
+    sizes.clear();
+  }
+}
+
+/// Write a batch of records, and make them durable (or, under NONE, just write
+/// them).  Under STRICT, each record gets its own write and sync.  In a
+/// segmented log, a new segment is started once the current one is full.  If
+/// a write or sync fails, the records are marked as failed instead of durable.
+/// The caller must hold io_lock.
+///
+/// @param batch The records
+/// @param sizes The size of each record
+/// @param upto  The LSN of the last record
+void LogWriter::write_batch(const vec &batch, const vector<size_t> &sizes,
+                            uint64_t upto) {
+  bool strict = durability.level == durability_t::STRICT;
+  bool sync = durability.level != durability_t::NONE;
+  uint64_t lsn = upto - sizes.size();
+  //the records from off to off + run haven't been written yet, and ok is
+  //false once anything in the batch has failed
+  size_t off = 0, run = 0;
+  bool ok = true;
+  auto write_run = [&](bool sync_run) {
+    if (run > 0) {
+      ok = ok && fd >= 0 && write_records(batch.data() + off, run, sync_run);
+    }
+    off += run;
+    run = 0;
+  };
+  for (size_t s : sizes) {
+    if (!base.empty()) {
+      if (seg_size >= durability.segment_bytes && !seg_offsets.empty()) {
+        write_run(false);
+        ok = seal_segment() && ok;
+        ok = open_segment(seq + 1) && ok;
+      }
+      seg_offsets.push_back(seg_size);
+      seg_size += s;
+    }
+    run += s;
+    if (strict) {
+      write_run(true);
+      advance(++lsn, true, ok);
+    }
+  }
+  if (!strict) {
+    write_run(sync);
+    advance(upto, sync, ok);
+  }
+}
+
+/// Create a segment, and make it the current segment.  The caller must hold
+/// io_lock.
+///
+/// @param next The segment's sequence number
+///
+/// @returns true if the segment was created
+bool LogWriter::open_segment(uint64_t next) {
+  string name = wal_segment_name(base, next);
+  fd = ::open(name.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+  seq = next;
+  seg_size = 8;
+  seg_offsets.clear();
+  if (fd < 0) {
+    cerr << "error on open()\n";
+    return false;
+  }
+  bool ok = write_all((const unsigned char *)WAL_SEGMENT, 8);
+  sync_dir(name);
+  return ok;
+}
+
+/// Write the current segment's footer, sync it and close it.  The caller must
+/// hold io_lock.
+///
+/// @returns true if the footer was written and synced
+bool LogWriter::seal_segment() {
+  if (fd < 0) {
+    return false;
+  }
+  vec footer = wal_footer(seg_offsets);
+  bool ok = write_all(footer.data(), footer.size());
+  if (!sync_file()) {
+    cerr << "error on fdatasync()\n";
+    ok = false;
+  }
+  ::close(fd);
+  fd = -1;
+  return ok;
+}
+
+/// Start a segmented log, by creating its first segment
+///
+/// @param filename The name of the data file that the log belongs to
+/// @param first    The sequence number of the first segment
+///
+/// @returns true if the segment was created
+bool LogWriter::open_segments(const string &filename, uint64_t first) {
+  lock_guard<mutex> io(io_lock);
+  if (!base.empty()) {
+    seal_segment();
+  } else if (fd >= 0) {
+    ::close(fd);
+  }
+  base = filename;
+  return open_segment(first);
+}
+
+/// Write everything that is queued to the current segment, seal it, and start
+/// the next one.  The caller must make sure that no record is appended until
+/// this returns.
+///
+/// @returns the sequence number of the new segment
+uint64_t LogWriter::rotate() {
+  lock_guard<mutex> io(io_lock);
+  vec batch;
+  vector<size_t> sizes;
+  uint64_t upto;
+  {
+    lock_guard<mutex> q(queue_lock);
+    batch.swap(pending);
+    sizes.swap(pending_sizes);
+    upto = appended;
+  }
+  write_batch(batch, sizes, upto);
+  //an empty segment has nothing from before the rotation
+  if (!seg_offsets.empty()) {
+    seal_segment();
+    open_segment(seq + 1);
+  }
+  return seq;
+}
+
+/// Delete the segments that come before a given one
+///
+/// @param first The sequence number of the first segment to keep
+void LogWriter::remove_segments_before(uint64_t first) {
+  string name;
+  {
+    lock_guard<mutex> io(io_lock);
+    name = base;
+  }
+  //whatever made the segments unneeded (a renamed checkpoint) must be durable
+  //before they go
+  sync_dir(name);
+  for (auto &segment : wal_list_segments(name)) {
+    if (segment.seq < first) {
+      unlink(segment.filename.c_str());
+    }
+  }
+  sync_dir(name);
+}
+
+/// Start appending to a file, creating it if it doesn't exist
+///
+/// @param filename The name of the file
+///
+/// @returns true if the file was opened
+bool LogWriter::open(const string &filename) {
+  lock_guard<mutex> io(io_lock);
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  fd = ::open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd < 0) {
+    cerr << "error on open()\n";
+    return false;
+  }
+  return true;
+}
+
+/// Switch to a new file, which already holds every record that has been
+/// appended so far.  Whatever is still queued is dropped, and counts as
+/// durable.
+///
+/// @param filename The name of the new file
+///
+/// @returns true if the file was opened
+bool LogWriter::reopen(const string &filename) {
+  bool ok;
+  {
+    lock_guard<mutex> io(io_lock);
+    lock_guard<mutex> q(queue_lock);
+    pending.clear();
+    pending_sizes.clear();
+    durable = appended;
+    failed_from = 0;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    fd = ::open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    ok = fd >= 0;
+  }
+  done.notify_all();
+  if (!ok) {
+    cerr << "error on open()\n";
+  }
+  return ok;
+}
+
+/// Add a record to the queue
+///
+/// @param data  The record
+/// @param bytes The length of the record
+///
+/// @returns the record's LSN
+uint64_t LogWriter::append(const vec &data, size_t bytes) {
+  //in a segmented log, the record gets its length and checksum first
+  bool framed = durability.segment_bytes > 0;
+  unsigned char header[WAL_HEADER];
+  if (framed) {
+    uint32_t len = bytes, crc = crc32c(data.data(), bytes);
+    memcpy(header, &len, 4);
+    memcpy(header + 4, &crc, 4);
+  }
+  uint64_t lsn;
+  {
+    lock_guard<mutex> q(queue_lock);
+    if (framed) {
+      pending.insert(pending.end(), header, header + WAL_HEADER);
+    }
+    pending.insert(pending.end(), data.begin(), data.begin() + bytes);
+    pending_sizes.push_back(bytes + (framed ? WAL_HEADER : 0));
+    lsn = ++appended;
+  }
+  //under PERIODIC, the flusher keeps to its schedule
+  if (durability.level != durability_t::PERIODIC) {
+    work.notify_one();
+  }
+  return lsn;
+}
+
+/// Wait until a record is durable.  Under PERIODIC and NONE, this returns right
+/// away.
+///
+/// @param lsn The LSN that append() returned for the record
+///
+/// @returns false if the record (or one before it) couldn't be written or
+///          synced, so it may not be durable
+bool LogWriter::wait(uint64_t lsn) {
+  if (durability.level == durability_t::PERIODIC ||
+      durability.level == durability_t::NONE) {
+    return true;
+  }
+  unique_lock<mutex> q(queue_lock);
+  done.wait(q, [&]() { return durable >= lsn; });
+  return failed_from == 0 || lsn < failed_from;
+}
+
+/// Make everything that was appended durable, and close the file
+void LogWriter::close() {
+  {
+    unique_lock<mutex> q(queue_lock);
+    draining = true;
+    work.notify_one();
+    done.wait(q, [&]() { return durable >= appended; });
+    draining = false;
+  }
+  lock_guard<mutex> io(io_lock);
+  if (!base.empty()) {
+    seal_segment();
+  } else if (fd >= 0) {
+    if (durability.level == durability_t::NONE) {
+      sync_file();
+    }
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+/// Report the number of times the file has been synced
+uint64_t LogWriter::syncs() {
+  lock_guard<mutex> q(queue_lock);
+  return sync_count;
+}
+
+/// Report the number of system calls made to write and sync the file
+uint64_t LogWriter::syscalls() {
+  lock_guard<mutex> io(io_lock);
+  return io_calls + (ring ? ring->enters : 0);
+}
@@ -0,0 +1,419 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/uio.h>
+#include <thread>
+#include <vector>
+
+#include "../common/uring.h"
+#include "../common/vec.h"
+
+/// durability_t says when the records of the incremental persistence log are
+/// made durable, and when a writer may go on as though they were.  It also says
+/// how the log is laid out on disk.
+struct durability_t {
+  /// The durability levels, from safest to fastest
+  enum level_t {
+    /// Each record is written and synced on its own, and a writer waits for
+    /// its record's sync
+    STRICT,
+
+    /// Group commit: the records that arrive together are written and synced
+    /// together, and a writer waits for its record's sync
+    BATCHED,
+
+    /// Records are written and synced in the background, every interval_ms
+    /// milliseconds, and writers don't wait.  A crash loses up to one
+    /// interval of writes.
+    PERIODIC,
+
+    /// Records are written as they arrive, but only synced when the log is
+    /// closed, and writers don't wait.  A crash of the machine (not just the
+    /// server) can lose any number of writes.
+    NONE
+  };
+
+  /// The durability level
+  level_t level = BATCHED;
+
+  /// Under BATCHED, how long the flusher waits after the first record of a
+  /// batch arrives, so that more can join it (0 to not wait)
+  unsigned window_us = 0;
+
+  /// Under PERIODIC, the time between syncs
+  unsigned interval_ms = 1000;
+
+  /// 0 to keep the log in the data file, after its checkpoint.  Otherwise,
+  /// the log is a write-ahead log of segment files (see LogWriter), each of
+  /// about this many bytes, and the data file only holds checkpoints.
+  size_t segment_bytes = 0;
+
+  /// The version of the record format that is written: 1 (8-byte codes and
+  /// 4-byte lengths) or 2 (1-byte codes and varint lengths; see record_code_t)
+  unsigned version = 1;
+
+  /// The zlib level (1 to 9) at which checkpoints and the log's group commits
+  /// are compressed, a block at a time (0 to not compress them)
+  int compression = 0;
+
+  /// Write and sync the log with io_uring, if the kernel has it: a batch's
+  /// write and its fdatasync() are linked SQEs, which reach the kernel in one
+  /// system call
+  bool uring = false;
+
+  /// Find the level with a given name (strict, batched, periodic or none)
+  ///
+  /// @param name  The name of the level
+  /// @param level Set to the level, if the name is known
+  ///
+  /// @returns true if the name is known
+  static bool parse(const std::string &name, level_t &level);
+};
+
+/// compaction_t says how checkpoints are written, and when the data file is
+/// compacted in the background.  Right after a compaction (or a load), the
+/// file's checkpoint holds exactly the live data, and everything after it is
+/// log.  Once the file has grown to ratio times the size of that checkpoint,
+/// and to at least min_bytes, a new checkpoint is written while writers keep
+/// going, and it replaces the file.
+struct compaction_t {
+  /// How large the file may grow, relative to its checkpoint (0 to never
+  /// compact in the background)
+  double ratio = 2;
+
+  /// The file is never compacted in the background while it is smaller than
+  /// this
+  size_t min_bytes = 64 << 20;
+
+  /// Write checkpoints from a forked child, which visits a copy-on-write image
+  /// of the tables, instead of from snapshot iterators in this process.  Both
+  /// let writers keep going; the child costs a fork() instead of the copies
+  /// that writers make of the buckets they change during the checkpoint.
+  bool fork = false;
+};
+
+/// The 1-byte codes of version 2 of the record format, which stand in for the
+/// 8-byte AUTHAUTH, KVKVKVKV, AUTHDIFF, KVUPDATE and KVDELETE of version 1, and
+/// are followed by varint lengths instead of 4-byte ones.  A version 1 code
+/// starts with 'A' or 'K', so a parser can tell the versions apart record by
+/// record.
+///
+/// In a data file, the log's version 2 (or compressed) records are written in
+/// batch frames: REC_BATCH, a varint length, and then that many bytes of
+/// records that were group-committed together.  A frame that runs past the end
+/// of the file was torn by a crash.
+///
+/// A compressed block is REC_ZBLOCK, a varint length, the varint length of its
+/// records once they are inflated, and then that many bytes of raw deflate
+/// data.  Like a batch frame, it can hold records of either version.
+enum record_code_t : unsigned char {
+  REC_AUTHAUTH = 1,
+  REC_KVKVKVKV,
+  REC_AUTHDIFF,
+  REC_KVUPDATE,
+  REC_KVDELETE,
+  REC_BATCH,
+  REC_ZBLOCK
+};
+
+/// Append a varint to a vec: 7 bits per byte, least significant first, with
+/// the high bit set on every byte but the last
+///
+/// @param v The vec into which we should append
+/// @param i The integer to append
+void varint_append(vec &v, uint64_t i);
+
+/// Read a varint
+///
+/// @param data  The bytes
+/// @param size  The number of bytes
+/// @param index The offset of the varint, which is advanced past it
+/// @param i     Set to the integer
+///
+/// @returns false if the varint is cut off or too long
+bool varint_read(const unsigned char *data, size_t size, size_t &index,
+                 uint64_t &i);
+
+/// Append a range of records to a vec as a compressed block, or, if they don't
+/// get any smaller, as a batch frame
+///
+/// @param v     The vec into which we should append
+/// @param data  The records
+/// @param bytes The number of bytes
+/// @param level The zlib level (1 to 9)
+void block_append(vec &v, const unsigned char *data, size_t bytes, int level);
+
+/// Inflate the records of a compressed block
+///
+/// @param data  The block's deflate data
+/// @param bytes The number of bytes of deflate data
+/// @param raw   The number of bytes of records
+/// @param out   Set to the records
+///
+/// @returns false if the block doesn't inflate to exactly raw bytes
+bool block_inflate(const unsigned char *data, size_t bytes, size_t raw,
+                   vec &out);
+
+/// Compute the CRC32C (Castagnoli) checksum of a range of bytes, with the
+/// SSE4.2 crc32 instruction if the CPU has it
+///
+/// @param data  The bytes
+/// @param bytes The number of bytes
+///
+/// @returns the checksum
+uint32_t crc32c(const unsigned char *data, size_t bytes);
+
+/// A segment of the write-ahead log, found on disk
+struct wal_segment_t {
+  /// The segment's sequence number
+  uint64_t seq;
+
+  /// The segment's file name
+  std::string filename;
+};
+
+/// Find the segments of a write-ahead log
+///
+/// @param base The name of the data file that the log belongs to
+///
+/// @returns the segments, in order
+std::vector<wal_segment_t> wal_list_segments(const std::string &base);
+
+/// Find the records of a write-ahead log segment.  A sealed segment's records
+/// are found through its footer index; an unsealed one is scanned from the
+/// start.  Either way, every record's checksum is checked, and the records
+/// stop at the first one that is torn or corrupt.
+///
+/// @param data   The segment's bytes
+/// @param bytes  The size of the segment
+/// @param intact Set to the number of bytes before the first torn or corrupt
+///               record (bytes, if there is none)
+/// @param sealed Set to true if the segment has a valid footer
+///
+/// @returns the offset and size of each intact record (not counting its length
+///          and checksum)
+std::vector<std::pair<size_t, size_t>>
+wal_read_segment(const unsigned char *data, size_t bytes, size_t &intact,
+                 bool &sealed);
+
+/// Seal an unsealed segment by writing its footer index, after cutting off
+/// whatever follows its intact records
+///
+/// @param filename The segment's file name
+/// @param data     The segment's bytes
+/// @param intact   The number of bytes of intact records
+/// @param records  The intact records, from wal_read_segment()
+///
+/// @returns true on success
+bool wal_seal_segment(const std::string &filename, const unsigned char *data,
+                      size_t intact,
+                      const std::vector<std::pair<size_t, size_t>> &records);
+
+/// Sync the directory that holds a file, so that a file that was just
+/// created, renamed or deleted stays that way after a crash
+///
+/// @param filename The name of the file
+void sync_dir(const std::string &filename);
+
+/// LogWriter appends records to the incremental persistence log.  A thread
+/// that appends a record only copies it into a queue; a dedicated flusher
+/// thread takes everything that is queued, writes it with one write(), and
+/// (depending on the durability level) makes it durable with one fdatasync()
+/// before waking every thread whose record was in that batch.  While one batch
+/// is being synced, the next one builds up, so under load a single sync covers
+/// many records.
+///
+/// Each record gets a log sequence number (LSN) when it is appended.  Records
+/// reach the file in LSN order, and a record is durable once every record with
+/// a smaller LSN is.
+///
+/// The log is either appended to one file (the data file), or, when
+/// durability.segment_bytes is set, written as a series of segment files named
+/// <data file>.wal.<sequence number>.  A segment is:
+///
+///  - An 8-byte magic constant WALSEG01
+///  - Each record, as a 4-byte length, a 4-byte CRC32C of the record, and the
+///    record itself
+///  - Once the segment is full (or the log is closed), a footer: the 4-byte
+///    offset of each record, the 4-byte record count, a 4-byte CRC32C of the
+///    offsets and count, and an 8-byte magic constant WALFOOT1
+///
+/// A segment that has no footer was being written when the server stopped, so
+/// it may end with a torn record.
+class LogWriter {
+  /// When records are made durable
+  const durability_t durability;
+
+  /// The file, or -1 if none is open
+  int fd = -1;
+
+  /// Records that have been appended but not yet taken by the flusher
+  vec pending;
+
+  /// The size of each record in pending
+  std::vector<size_t> pending_sizes;
+
+  /// The LSN of the most recently appended record
+  uint64_t appended = 0;
+
+  /// Every record with an LSN up to this one is durable (or, under NONE,
+  /// written), unless it failed
+  uint64_t durable = 0;
+
+  /// The LSN of the first record that couldn't be written or synced, or 0.
+  /// Once a write has failed, the file may end with a torn record, so every
+  /// record after it counts as failed too, until reopen() starts a new file.
+  uint64_t failed_from = 0;
+
+  /// The number of times the flusher has synced the file
+  uint64_t sync_count = 0;
+
+  /// Set while close() waits for the queue to drain, so that the flusher
+  /// doesn't wait for its window or interval
+  bool draining = false;
+
+  /// Set when the flusher should drain the queue and exit
+  bool stop = false;
+
+  /// Protects everything above except durability and fd
+  std::mutex queue_lock;
+
+  /// Wakes the flusher when there is work to do
+  std::condition_variable work;
+
+  /// Wakes appenders when durable advances
+  std::condition_variable done;
+
+  /// Held while the file is written, synced, opened or closed, so that the
+  /// file can't be replaced in the middle of a batch.  Always acquired before
+  /// queue_lock.
+  std::mutex io_lock;
+
+  /// For a segmented log: the name of the data file, the current segment's
+  /// sequence number and size, and the offsets of its records.  Protected by
+  /// io_lock.
+  std::string base;
+  uint64_t seq = 0;
+  size_t seg_size = 0;
+  std::vector<uint32_t> seg_offsets;
+
+  /// The io_uring that the file is written and synced with, or null to use
+  /// write() and fdatasync().  Protected by io_lock.
+  std::unique_ptr<Uring> ring;
+
+  /// The number of system calls made to write and sync the file, not counting
+  /// the ring's.  Protected by io_lock.
+  uint64_t io_calls = 0;
+
+  /// The flusher thread.  It is the last member, and is started at the end of
+  /// the constructor, so that everything it uses is already set up.
+  std::thread flusher;
+
+  /// The flusher's main loop
+  void flush_loop();
+
+  /// Write a range of bytes to the file
+  bool write_all(const unsigned char *data, size_t bytes);
+
+  /// Write an array of buffers to the file, and sync it if asked to
+  bool write_iov(const struct iovec *iov, int count, bool sync);
+
+  /// Sync the file
+  bool sync_file();
+
+  /// Write a range of records to the file, in a batch frame or compressed
+  /// block if the file is a data file of version 2 or compressed records, and
+  /// sync it if asked to
+  bool write_records(const unsigned char *data, size_t bytes, bool sync);
+
+  /// Mark every record up to lsn as durable (or as failed), and wake the
+  /// threads waiting for them
+  void advance(uint64_t lsn, bool synced, bool ok);
+
+  /// Write a batch of records, and make them durable
+  void write_batch(const vec &batch, const std::vector<size_t> &sizes,
+                   uint64_t upto);
+
+  /// Create a segment, and make it the current segment
+  bool open_segment(uint64_t next);
+
+  /// Write the current segment's footer, sync it and close it
+  bool seal_segment();
+
+public:
+  /// Construct a LogWriter with no file, and start its flusher
+  ///
+  /// @param _durability When records are made durable
+  LogWriter(durability_t _durability = durability_t());
+
+  /// Make everything that was appended durable, stop the flusher, and close
+  /// the file
+  ~LogWriter();
+
+  /// Start appending to a file, creating it if it doesn't exist
+  ///
+  /// @param filename The name of the file
+  ///
+  /// @returns true if the file was opened
+  bool open(const std::string &filename);
+
+  /// Switch to a new file, which already holds every record that has been
+  /// appended so far (for example, because it is a fresh snapshot).  Whatever
+  /// is still queued is dropped, and counts as durable.  The caller must make
+  /// sure that no record is appended until this returns.
+  ///
+  /// @param filename The name of the new file
+  ///
+  /// @returns true if the file was opened
+  bool reopen(const std::string &filename);
+
+  /// Start a segmented log, by creating its first segment
+  ///
+  /// @param filename The name of the data file that the log belongs to
+  /// @param first    The sequence number of the first segment
+  ///
+  /// @returns true if the segment was created
+  bool open_segments(const std::string &filename, uint64_t first);
+
+  /// Write everything that is queued to the current segment, seal it, and
+  /// start the next one.  The caller must make sure that no record is
+  /// appended until this returns.
+  ///
+  /// @returns the sequence number of the new segment
+  uint64_t rotate();
+
+  /// Delete the segments that come before a given one
+  ///
+  /// @param first The sequence number of the first segment to keep
+  void remove_segments_before(uint64_t first);
+
+  /// Add a record to the queue
+  ///
+  /// @param data  The record
+  /// @param bytes The length of the record
+  ///
+  /// @returns the record's LSN
+  uint64_t append(const vec &data, size_t bytes);
+
+  /// Wait until a record is durable.  Under PERIODIC and NONE, this returns
+  /// right away.
+  ///
+  /// @param lsn The LSN that append() returned for the record
+  ///
+  /// @returns false if the record (or one before it) couldn't be written or
+  ///          synced, so it may not be durable
+  bool wait(uint64_t lsn);
+
+  /// Make everything that was appended durable, and close the file
+  void close();
+
+  /// Report the number of times the file has been synced
+  uint64_t syncs();
+
+  /// Report the number of system calls made to write and sync the file
+  uint64_t syscalls();
+};
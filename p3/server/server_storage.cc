@@ -1,12 +1,27 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <openssl/md5.h>
 #include <unordered_map>
 #include <utility>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "../common/contextmanager.h"
 #include "../common/err.h"
 #include "../common/hashtable.h"
+#include "../common/shardedtable.h"
 #include "../common/protocol.h"
 #include "../common/vec.h"
 #include "../common/file.h"
@@ -51,17 +66,86 @@ struct Storage::Internal {
   /// store
   inline static const string KVDELETE = "KVDELETE";
 
-  /// The map of authentication information, indexed by username
-  ConcurrentHashTable<string, AuthTableEntry> auth_table;
+  /// The 8-byte codes, in the order of their version 2 codes (REC_AUTHAUTH on)
+  inline static const string *const CODES[] = {&AUTHENTRY, &KVENTRY, &AUTHDIFF,
+                                               &KVUPDATE, &KVDELETE};
 
-  /// The map of key/value pairs
-  ConcurrentHashTable<string, vec> kv_store;
+  /// The map of authentication information, indexed by username.  Nearly
+  /// every request reads it (existence and password checks), and it is rarely
+  /// written, so lookups are lock-free.
+  ConcurrentHashTable<string, AuthTableEntry, epoch_reads> auth_table;
+
+  /// The map of key/value pairs.  Our traffic is mostly KVG, so lookups are
+  /// lock-free.
+  ConcurrentHashTable<string, vec, epoch_reads> kv_store;
+
+  /// In sharded mode, the map of key/value pairs is split into shards, each
+  /// owned by its own thread, and kv_store is not used
+  unique_ptr<ShardedTable<string, vec>> kv_shards;
 
   /// filename is the name of the file from which the Storage object was loaded,
   /// and to which we persist the Storage object every time it changes
   string filename = "";
 
-  FILE *file;
+  /// The incremental persistence log
+  LogWriter log;
+
+  /// Is the log a write-ahead log of segment files?  If so, the data file
+  /// only holds checkpoints, and the rewrite buffer isn't used: the log
+  /// starts a new segment when a checkpoint is taken, and the segments
+  /// before it are deleted once the checkpoint is in place.
+  const bool segmented;
+
+  /// The version of the record format that is written
+  const unsigned version;
+
+  /// The zlib level of checkpoint blocks (0 for none)
+  const int compression;
+
+  /// Orders appends to the log, and protects the rewrite buffer
+  mutex log_lock;
+
+  /// Only one persist() runs at a time
+  mutex persist_lock;
+
+  /// While persist() is writing a new file, the log records that its
+  /// snapshots don't have are also saved here, and appended to the new file
+  /// before it replaces the old one
+  vec rewrite;
+
+  /// Are auth table records being saved to rewrite?  This is set at the moment
+  /// persist() takes its snapshot of the auth table.
+  bool rewrite_auth = false;
+
+  /// Are kv store records being saved to rewrite?  This is set at the moment
+  /// persist() takes its snapshot of the kv store.
+  bool rewrite_kv = false;
+
+  /// When the file is compacted in the background
+  const compaction_t compaction;
+
+  /// The size of the file, counting the records that the log has queued.
+  /// Protected by log_lock.
+  size_t file_bytes = 0;
+
+  /// The size of the file's checkpoint: its leading AUTHAUTH and KVKVKVKV
+  /// records, which were the live data when the file was last persisted.
+  /// Protected by log_lock.
+  size_t checkpoint_bytes = 0;
+
+  /// Set when the file has grown enough to be compacted, and cleared once the
+  /// compaction is done.  Protected by log_lock.
+  bool compacting = false;
+
+  /// Set when the compactor should exit.  Protected by log_lock.
+  bool stop_compactor = false;
+
+  /// Wakes the compactor
+  condition_variable compact_wake;
+
+  /// The thread that compacts the file in the background (not running if
+  /// background compaction is off)
+  thread compactor;
 
   /// Construct the Storage::Internal object by setting the filename and bucket
   /// count
@@ -69,8 +153,401 @@ struct Storage::Internal {
   /// @param fname       The name of the file that should be used to load/store
   ///                    the data
   /// @param num_buckets The number of buckets for the hash
-  Internal(string fname, size_t num_buckets)
-      : auth_table(num_buckets), kv_store(num_buckets), filename(fname) {}
+  /// @param shards      The number of kv_store shards (0 for no sharding)
+  /// @param durability  When the log makes records durable
+  /// @param compaction  When the file is compacted in the background
+  Internal(string fname, size_t num_buckets, size_t shards,
+           durability_t durability, compaction_t compaction)
+      : auth_table(num_buckets), kv_store(shards == 0 ? num_buckets : 1),
+        filename(fname), log(durability),
+        segmented(durability.segment_bytes > 0), version(durability.version),
+        compression(durability.compression), compaction(compaction) {
+    if (shards > 0) {
+      kv_shards = make_unique<ShardedTable<string, vec>>(
+          shards, max(num_buckets / shards, size_t(1)));
+    }
+  }
+
+  /// Run f on the map of key/value pairs: the shards in sharded mode, and
+  /// kv_store otherwise.  Both have the same interface.
+  ///
+  /// @param f The code to run on the map
+  ///
+  /// @returns the result of f
+  template <typename F> auto with_kv(F f) {
+    if (kv_shards) {
+      return f(*kv_shards);
+    }
+    return f(kv_store);
+  }
+
+  /// Append a record's code to a vec, in the version of the record format that
+  /// is written
+  ///
+  /// @param data The vec into which we should append
+  /// @param code The record's 8-byte code
+  void append_code(vec &data, const string &code) {
+    if (version < 2) {
+      vec_append(data, code);
+      return;
+    }
+    for (unsigned char i = 0; i < size(CODES); i++) {
+      if (*CODES[i] == code) {
+        data.push_back(REC_AUTHAUTH + i);
+      }
+    }
+  }
+
+  /// Append the length of a field to a vec, in the version of the record
+  /// format that is written
+  ///
+  /// @param data The vec into which we should append
+  /// @param len  The length
+  void append_len(vec &data, size_t len) {
+    if (version < 2) {
+      vec_append(data, len);
+    } else {
+      varint_append(data, len);
+    }
+  }
+
+  /// Append a record to the log.  This is called by writers while they hold
+  /// their bucket's lock, so the log has each key's records in the same order
+  /// as the table has its writes.  It doesn't wait for the record to be
+  /// durable: the writer does that with wait_log() once the bucket is
+  /// unlocked, so that the bucket's other keys don't wait for the disk.  How
+  /// long that takes depends on the log's durability level.
+  ///
+  /// If the record makes the file large enough, the compactor is woken.
+  ///
+  /// @param data  The record
+  /// @param bytes The length of the record
+  /// @param kv    True for a kv store record, false for an auth table record
+  ///
+  /// @returns the record's LSN
+  uint64_t append_log(const vec &data, size_t bytes, bool kv) {
+    lock_guard<mutex> g(log_lock);
+    if (!segmented && (kv ? rewrite_kv : rewrite_auth)) {
+      rewrite.insert(rewrite.end(), data.begin(), data.begin() + bytes);
+    }
+    file_bytes += bytes;
+    if (!compacting && compaction.ratio > 0 &&
+        file_bytes >= compaction.min_bytes &&
+        file_bytes >= compaction.ratio * checkpoint_bytes) {
+      compacting = true;
+      compact_wake.notify_one();
+    }
+    return log.append(data, bytes);
+  }
+
+  /// A record of the log tail, parsed in place in the file's bytes.  For auth
+  /// table records, key is the username and val is the content.
+  struct log_record {
+    /// The record's 8-byte code
+    string_view type;
+
+    /// The key (or username)
+    string_view key;
+
+    /// The value (or content), if the record has one
+    const unsigned char *val = nullptr;
+    size_t len_val = 0;
+
+    /// The hashed password, for an AUTHAUTH record
+    const unsigned char *pass_hash = nullptr;
+    size_t len_pass_hash = 0;
+  };
+
+  /// Apply a record of the log tail to the tables
+  ///
+  /// @param r        The record
+  /// @param tolerant True if the tail may start before the checkpoint ends, so
+  ///                 that deleting a missing key is not an error
+  ///
+  /// @returns false if the record can't be applied
+  bool apply(const log_record &r, bool tolerant) {
+    auto empty_func = [](){};
+    if (r.type == AUTHENTRY) {
+      AuthTableEntry new_user;
+      new_user.username = string(r.key);
+      new_user.pass_hash.assign((const char *)r.pass_hash, r.len_pass_hash);
+      new_user.content.assign(r.val, r.val + r.len_val);
+      auth_table.insert(string(r.key), move(new_user), empty_func);
+    } else if (r.type == KVENTRY) {
+      with_kv([&](auto &kv) {
+        return kv.insert(string(r.key), vec(r.val, r.val + r.len_val),
+                         empty_func);
+      });
+    } else if (r.type == AUTHDIFF) {
+      //redo changing the content
+      auth_table.do_with(r.key, [&](AuthTableEntry &entry) {
+        entry.content.assign(r.val, r.val + r.len_val);
+      });
+    } else if (r.type == KVUPDATE) {
+      //redo the operation of changing the key's value
+      with_kv([&](auto &kv) {
+        return kv.upsert(string(r.key), vec(r.val, r.val + r.len_val),
+                         empty_func, empty_func);
+      });
+    } else if (r.type == KVDELETE) {
+      //redo delete
+      if (!with_kv([&](auto &kv) { return kv.remove(r.key, empty_func); }) &&
+          !tolerant) {
+        cerr << "Key can't be found \n";
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Replay the log tail.  Only the order of each key's records matters, so
+  /// the records are split into partitions by the hash of their key, and each
+  /// partition is replayed in file order by its own thread.
+  ///
+  /// @param tail     The records, in file order
+  /// @param threads  The number of threads to use
+  /// @param tolerant True if the tail may start before the checkpoint ends
+  ///
+  /// @returns false if any record can't be applied
+  bool replay(const vector<log_record> &tail, size_t threads,
+              bool tolerant = false) {
+    //a small tail isn't worth starting threads for
+    if (threads == 1 || tail.size() < 1024) {
+      for (auto &r : tail) {
+        if (!apply(r, tolerant)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    vector<vector<size_t>> parts(threads);
+    for (size_t i = 0; i < tail.size(); i++) {
+      parts[hash<string_view>()(tail[i].key) % threads].push_back(i);
+    }
+    atomic<bool> ok(true);
+    vector<thread> workers;
+    for (auto &part : parts) {
+      workers.emplace_back([&]() {
+        for (size_t i : part) {
+          if (!ok || !apply(tail[i], tolerant)) {
+            ok = false;
+            return;
+          }
+        }
+      });
+    }
+    for (auto &w : workers) {
+      w.join();
+    }
+    return ok;
+  }
+
+  /// Write a checkpoint of both tables to a file: an AUTHAUTH record for each
+  /// user, then a KVKVKVKV record for each key/value pair.  The records are
+  /// written out a chunk at a time, so that the checkpoint is never all in
+  /// memory.
+  ///
+  /// @param fname The name of the file to create or truncate
+  /// @param visit Code that runs its first argument on every user, and its
+  ///              second on every key/value pair
+  ///
+  /// @returns true if the file was written in full
+  template <typename Visit>
+  bool write_checkpoint(const string &fname, Visit visit) {
+    FILE *f = fopen(fname.c_str(), "wb");
+    if (f == nullptr) {
+      cerr << "error on open()\n";
+      return false;
+    }
+    vec data = vec_from_string("");
+
+    //write out what has been serialized so far, once there is enough of it
+    //(compressed, if so configured)
+    vec block;
+    auto write_chunk = [&](size_t min_size) {
+      if (data.size() >= min_size) {
+        if (compression > 0 && !data.empty()) {
+          block.clear();
+          block_append(block, data.data(), data.size(), compression);
+          data.swap(block);
+        }
+        fwrite((char*)data.data(), sizeof(char), data.size(), f);
+        data.clear();
+      }
+    };
+
+    //lambda to append authauth
+    auto append_authauth = [&](const string &, const AuthTableEntry &entry){
+      append_code(data, AUTHENTRY);
+      append_len(data, entry.username.length());
+      vec_append(data, entry.username);
+      append_len(data, entry.pass_hash.length());
+      vec_append(data, entry.pass_hash);
+      append_len(data, entry.content.size());
+      if(entry.content.size() != 0){
+        vec_append(data, entry.content);
+      }
+      write_chunk(1 << 20);
+    };
+
+    //lambda to append kvkvkvkv
+    auto append_kvkvkvkv = [&](const string &key, const vec &val){
+      append_code(data, KVENTRY);
+      append_len(data, key.length());
+      vec_append(data, key);
+      append_len(data, val.size());
+      vec_append(data, val);
+      write_chunk(1 << 20);
+    };
+
+    visit(append_authauth, append_kvkvkvkv);
+    write_chunk(0);
+    bool ok = !ferror(f);
+    if (fclose(f) != 0 || !ok) {
+      cerr << "error on write()\n";
+      return false;
+    }
+    return true;
+  }
+
+  /// Write a checkpoint from a child process, in the style of Redis's BGSAVE.
+  /// Writers are kept out only for the fork() itself: the child sees a
+  /// copy-on-write image of the tables as of that moment, and from then on the
+  /// log's new records also go to the rewrite buffer.  The calling thread
+  /// waits for the child, but no other thread does.
+  ///
+  /// @param fname The name of the file to create or truncate
+  ///
+  /// @returns true if the child wrote the file in full
+  bool fork_checkpoint(const string &fname) {
+    pid_t pid = -1;
+    auth_table.do_quiesced([&]() {
+      with_kv([&](auto &kv) {
+        kv.do_quiesced([&]() {
+          lock_guard<mutex> g(log_lock);
+          pid = fork();
+          if (pid == 0) {
+            //the child only has this thread, and its copies of the locks that
+            //the parent holds stay locked, so it must never return from here
+            bool ok = write_checkpoint(fname, [&](auto &auth_f, auto &kv_f) {
+              auth_table.do_all_unlocked(auth_f);
+              kv.do_all_unlocked(kv_f);
+            });
+            _exit(ok ? 0 : 1);
+          }
+          if (pid > 0) {
+            rewrite_auth = true;
+            rewrite_kv = true;
+          }
+        });
+      });
+    });
+    if (pid < 0) {
+      cerr << "error on fork()\n";
+      return false;
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      cerr << "error in checkpoint child\n";
+      return false;
+    }
+    return true;
+  }
+
+  /// Stop the compactor, waiting for the compaction it is running (if any) to
+  /// finish.  It is safe to call this more than once.
+  void stop_compaction() {
+    {
+      lock_guard<mutex> g(log_lock);
+      stop_compactor = true;
+    }
+    compact_wake.notify_one();
+    if (compactor.joinable()) {
+      compactor.join();
+    }
+  }
+
+  /// Wait until a record from append_log() is durable.  This must not be
+  /// called while holding a bucket lock.
+  ///
+  /// @param lsn The record's LSN, or 0 if no record was appended
+  ///
+  /// @returns false if the record couldn't be made durable, in which case the
+  ///          client must not be told that the request succeeded
+  bool wait_log(uint64_t lsn) {
+    return lsn == 0 || log.wait(lsn);
+  }
+
+  /// Create a new key/value mapping for a user who has been authenticated.
+  /// The value is copied (or moved) into the map only here, so a request that
+  /// fails authentication never pays for the copy.
+  ///
+  /// @param key The key whose mapping is being created
+  /// @param val The value, copied if it is an lvalue and moved otherwise
+  ///
+  /// @returns A vec with the result message
+  template <typename Val> vec kv_insert(const string &key, Val &&val) {
+    //the log record is made before val goes into the table
+    vec data = vec_from_string("");
+    data.reserve(16 + key.length() + val.size());
+    append_code(data, KVENTRY);
+    append_len(data, key.length());
+    vec_append(data, key);
+    append_len(data, val.size());
+    vec_append(data, val);
+    size_t bytes = data.size();
+    uint64_t lsn = 0;
+    auto append_KVENTRY = [&]() { lsn = append_log(data, bytes, true); };
+
+    //check if key exists
+    bool inserted = with_kv([&](auto &kv) {
+      return kv.insert(key, std::forward<Val>(val), append_KVENTRY);
+    });
+    if (!wait_log(lsn)) {
+      return vec_from_string(RES_ERR_SERVER);
+    }
+    if (!inserted) {
+      return vec_from_string(RES_ERR_KEY);
+    }
+    return vec_from_string(RES_OK);
+  }
+
+  /// Insert or update a key/value mapping for a user who has been
+  /// authenticated.  As with kv_insert, the value is only copied (or moved)
+  /// here.
+  ///
+  /// @param key The key whose mapping is being upserted
+  /// @param val The value, copied if it is an lvalue and moved otherwise
+  ///
+  /// @returns A vec with the result message
+  template <typename Val> vec kv_upsert(const string &key, Val &&val) {
+    //the log record is made before val goes into the table
+    vec data = vec_from_string("");
+    data.reserve(16 + key.length() + val.size());
+    append_code(data, KVUPDATE);
+    append_len(data, key.length());
+    vec_append(data, key);
+    append_len(data, val.size());
+    vec_append(data, val);
+    size_t bytes = data.size();
+    uint64_t lsn = 0;
+    auto append_KVUPDATE = [&]() { lsn = append_log(data, bytes, true); };
+
+    //if key exists, return ok-upsert
+    //else, return ok-insert
+    bool inserted = with_kv([&](auto &kv) {
+      return kv.upsert(key, std::forward<Val>(val), append_KVUPDATE,
+                       append_KVUPDATE);
+    });
+    if (!wait_log(lsn)) {
+      return vec_from_string(RES_ERR_SERVER);
+    }
+    if (!inserted) {
+      return vec_from_string(RES_OKUPD);
+    }
+    return vec_from_string(RES_OKINS);
+  }
 };
 
 /// Construct an empty object and specify the file from which it should be
@@ -80,281 +557,500 @@ struct Storage::Internal {
 /// @param fname       The name of the file that should be used to load/store
 ///                    the data
 /// @param num_buckets The number of buckets for the hash
-Storage::Storage(const string &fname, size_t num_buckets)
-    : fields(new Internal(fname, num_buckets)) {}
+/// @param shards      The number of kv_store shards, each owned by its own
+///                    thread (0 for a single shared table)
+/// @param durability  When the incremental persistence log makes records
+///                    durable
+/// @param compaction  When the file is compacted in the background
+Storage::Storage(const string &fname, size_t num_buckets, size_t shards,
+                 durability_t durability, compaction_t compaction)
+    : fields(new Internal(fname, num_buckets, shards, durability, compaction)) {
+  if (compaction.ratio <= 0) {
+    return;
+  }
+  //the compactor sleeps until append_log() finds that the file has grown
+  //enough, and then persists, which writes a new checkpoint while writers keep
+  //going
+  fields->compactor = thread([this]() {
+    unique_lock<mutex> g(fields->log_lock);
+    while (true) {
+      fields->compact_wake.wait(
+          g, [&]() { return fields->compacting || fields->stop_compactor; });
+      if (fields->stop_compactor) {
+        return;
+      }
+      g.unlock();
+      persist();
+      g.lock();
+      fields->compacting = false;
+    }
+  });
+}
 
-/// Destructor for the storage object.
+/// Destructor for the storage object.  The compactor must stop before the
+/// fields it uses are destroyed.
 ///
 /// NB: The compiler doesn't know that it can create the default destructor in
 ///     the .h file, because PIMPL prevents it from knowing the size of
-///     Storage::Internal.  Now that we have reified Storage::Internal, the
-///     compiler can make a destructor for us.
-Storage::~Storage() = default;
+///     Storage::Internal.
+Storage::~Storage() { fields->stop_compaction(); }
 
 /// Populate the Storage object by loading this.filename.  Note that load()
 /// begins by clearing the maps, so that when the call is complete, exactly and
 /// only the contents of the file are in the Storage object.
 ///
+/// The file is mapped into memory rather than read, and its records are parsed
+/// in place, so each username, key and value is copied exactly once: from the
+/// file into its place in the tables.  Pages that have been parsed are dropped
+/// from the mapping as we go, so the file never all counts against our memory.
+/// The checkpoint is bulk loaded, and the log tail after it is replayed by
+/// several threads (see Internal::replay).
+///
 /// @returns false if any error is encountered in the file, and true otherwise.
 ///          Note that a non-existent file is not an error.
 bool Storage::load() {
   fields->auth_table.clear();
-  fields->kv_store.clear();
+  fields->with_kv([](auto &kv) { kv.clear(); });
+  auto start_time = chrono::steady_clock::now();
+  vector<wal_segment_t> segments;
+  if (fields->segmented) {
+    segments = wal_list_segments(fields->filename);
+  }
+
+  //once everything is loaded, the log starts appending
+  auto open_log = [&]() {
+    if (fields->segmented) {
+      fields->log.open_segments(fields->filename,
+                                segments.empty() ? 1 : segments.back().seq + 1);
+    } else {
+      fields->log.open(fields->filename);
+    }
+  };
 
   //error file not found
-  if (!file_exists(fields->filename)) {
+  if (!file_exists(fields->filename) && segments.empty()) {
     cerr << "File not found: " << fields->filename << "\n";
-    fields->file = fopen(fields->filename.c_str(), "ab");
+    open_log();
+    lock_guard<mutex> g(fields->log_lock);
+    fields->file_bytes = 0;
+    fields->checkpoint_bytes = 0;
     return true;
   }
-  
-  //load data and store in auth_table
-  //error empty file
-  int index = 0;
-  vec data = load_entire_file(fields->filename);
-  fields->file = fopen(fields->filename.c_str(), "ab");
-  if (data.size() == 0) {
-    cerr << "Error file is empty\n";
-    return false;
-  }
-  //empty functions for lambdas
-  std::function<void()> empty_func = [](){};
-  //loop for storing data
-  while (index < (int)data.size()) {
 
-    //check authauth or kvkvkvkv
-    if (index + 8 > int(data.size())) {
-      cerr << "AUTHAUTH or KVKVKVKV or AUTHDIFF or KVUPDATE or KVDELETE can't be found \n";
+  //every file that is loaded stays mapped until its records are replayed
+  vector<pair<void *, size_t>> maps;
+  ContextManager unmap([&]() {
+    for (auto &m : maps) {
+      munmap(m.first, m.second);
+    }
+  });
+  //map a file (an empty one maps to nullptr)
+  auto map_file = [&](const string &name, const unsigned char *&buf,
+                      size_t &len) {
+    buf = nullptr;
+    len = 0;
+    int fd = open(name.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      cerr << "error on open()\n";
+      if (fd >= 0) {
+        close(fd);
+      }
       return false;
     }
-    string auth_or_kv(data.begin() + index, data.begin() + index + 8);
-    index += 8;
-
-    if(auth_or_kv == "AUTHAUTH"){
+    len = st.st_size;
+    if (len == 0) {
+      close(fd);
+      return true;
+    }
+    void *map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      cerr << "error on mmap()\n";
+      return false;
+    }
+    maps.push_back({map, len});
+    madvise(map, len, MADV_SEQUENTIAL);
+    buf = (const unsigned char *)map;
+    return true;
+  };
 
-      //len(user)
-      if (index + 4 > int(data.size())) {
-        cerr << "Length of the username can't be found \n";
-        return false;
-      }
-      int len_user = *(int *)(data.data() + index);
-      index += 4;
+  //map the file
+  //error empty file
+  const unsigned char *file_data = nullptr;
+  size_t file_size = 0;
+  if (file_exists(fields->filename) &&
+      !map_file(fields->filename, file_data, file_size)) {
+    return false;
+  }
+  if (file_size == 0 && !fields->segmented) {
+    cerr << "Error file is empty\n";
+    return false;
+  }
 
-      //username
-      if (index + len_user > int(data.size())) {
-        cerr << "Username can't be found \n";
+  //the buffer being parsed
+  const unsigned char *data = nullptr;
+  size_t size = 0;
+  size_t index = 0;
+  size_t records = 0;
+
+  //the parsed part of the file, up to here, can be dropped from the mapping
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t DROP_BYTES = 64 << 20;
+  size_t dropped = 0;
+
+  //read a 4-byte length, and then that many bytes, straight from the file.
+  //what names the field in the error messages
+  //(or, in a version 2 record, a varint length)
+  bool v2 = false;
+  auto read_field = [&](const char *len_what, const char *what,
+                        const unsigned char *&field, size_t &len) {
+    uint64_t len_field;
+    if (v2) {
+      if (!varint_read(data, size, index, len_field)) {
+        cerr << len_what << " can't be found \n";
         return false;
       }
-      string username(data.begin() + index, data.begin() + index + len_user);
-      index += len_user;
-
-      //len(pass_hash)
-      if (index + 4 > int(data.size())) {
-        cerr << "Length of pass_hash can't be found \n";
+    } else {
+      if (size - index < 4) {
+        cerr << len_what << " can't be found \n";
         return false;
       }
-      int len_pass_hash = *(int *)(data.data() + index);
-      index += 4;
-
-      //pass_hash
-      if (index + len_pass_hash > int(data.size())) {
-        cerr << "Pass_hash can't be found \n";
-        return false;
-      }
-      string pass_hash(data.begin() + index, data.begin() + index + len_pass_hash);
-      index += len_pass_hash;
-
-      //len(content)
-      if (index + 4 > int(data.size())) {
-        cerr << "Length of content can't be found \n";
-        return false;
-      }
-      int len_content = *(int *)(data.data() + index);
+      int len_v1;
+      memcpy(&len_v1, data + index, 4);
       index += 4;
+      len_field = len_v1 < 0 ? UINT64_MAX : len_v1;
+    }
+    if (size - index < len_field) {
+      cerr << what << " can't be found \n";
+      return false;
+    }
+    field = data + index;
+    len = len_field;
+    index += len;
+    return true;
+  };
 
-      //content
-      if (index + len_content > int(data.size())) {
-        cerr << "Content can't be found \n";
-        return false;
-      }
-      vec content_vec = vec_from_string("");
-      if(len_content != 0){
-        vec_append(content_vec, vec(data.begin() + index, data.begin() + index + len_content));
+  //every record before the first AUTHDIFF, KVUPDATE or KVDELETE (usually all
+  //of a persisted file) adds a new key, so instead of inserting them one at a
+  //time, we collect them and bulk load the tables
+  vector<pair<string, Internal::AuthTableEntry>> auth_batch;
+  vector<pair<string, vec>> kv_batch;
+  bool batching = true;
+  //where the current record starts; when batching ends, this is also where
+  //the checkpoint ends
+  size_t record_start = 0;
+  auto flush_batches = [&]() {
+    if (!batching) {
+      return;
+    }
+    {
+      lock_guard<mutex> g(fields->log_lock);
+      fields->file_bytes = file_size;
+      fields->checkpoint_bytes = record_start;
+    }
+    size_t threads = max(thread::hardware_concurrency(), 1u);
+    fields->auth_table.bulk_load(move(auth_batch), threads);
+    fields->with_kv([&](auto &kv) { kv.bulk_load(move(kv_batch), threads); });
+    batching = false;
+  };
+  //the records after that (the log tail) are parsed here, and replayed once
+  //the whole file has been parsed
+  vector<Internal::log_record> tail;
+  //how many records of each version have been parsed, and where the data
+  //file's torn log batch (if any) starts
+  size_t v1_records = 0, v2_records = 0;
+  size_t torn = SIZE_MAX;
+
+  //the records of compressed blocks are parsed from inflated copies, which
+  //are kept until the tail is replayed; depth is the number of blocks that
+  //are being parsed
+  vector<vec> blocks;
+  size_t depth = 0;
+
+  //parse the records of a buffer: the data file, a record of a log segment, or
+  //a compressed block
+  function<bool(const unsigned char *, size_t)> parse =
+      [&](const unsigned char *buf, size_t len) {
+    data = buf;
+    size = len;
+    index = 0;
+    while (index < size) {
+      if (depth == 0) {
+        record_start = index;
       }
-      index += len_content;
-
-      //adding user and user's content to auth_table
-      Internal::AuthTableEntry new_user;
-      new_user.username = username;
-      new_user.pass_hash = pass_hash;
-      new_user.content = content_vec;
-      fields->auth_table.insert(username, new_user, empty_func); //empty lambda
-    } 
-
-    else if(auth_or_kv == "KVKVKVKV") {
-
-      //len(key)
-      if (index + 4 > int(data.size())) {
-        cerr << "Length of the key can't be found \n";
-        return false;
+      //the checkpoint's bytes are copied as soon as they are parsed, but the
+      //tail's are needed until it is replayed
+      if (batching && depth == 0 && index - dropped >= DROP_BYTES) {
+        size_t upto = index / page * page;
+        madvise((char *)data + dropped, upto - dropped, MADV_DONTNEED);
+        dropped = upto;
       }
-      int len_key = *(int *)(data.data() + index);
-      index += 4;
 
-      //key
-      if (index + len_key > int(data.size())) {
-        cerr << "Key can't be found \n";
-        return false;
+      //a batch frame's records are parsed like any others, once the frame
+      //is known to be whole
+      if (data[index] == REC_BATCH) {
+        uint64_t len_batch;
+        ++index;
+        if (!varint_read(data, size, index, len_batch) ||
+            size - index < len_batch) {
+          cout << "Cutting off " << size - record_start
+               << " bytes of torn log batch: " << fields->filename << "\n";
+          torn = record_start;
+          break;
+        }
+        continue;
       }
-      string key(data.begin() + index, data.begin() + index + len_key);
-      index += len_key;
 
-      //len(val)
-      if (index + 4 > int(data.size())) {
-        cerr << "Length of the val can't be found \n";
-        return false;
+      if (data[index] == REC_ZBLOCK) {
+        uint64_t len_block, len_raw;
+        ++index;
+        if (!varint_read(data, size, index, len_block) ||
+            !varint_read(data, size, index, len_raw) ||
+            size - index < len_block) {
+          cout << "Cutting off " << size - record_start
+               << " bytes of torn log batch: " << fields->filename << "\n";
+          torn = record_start;
+          break;
+        }
+        blocks.emplace_back();
+        if (!block_inflate(data + index, len_block, len_raw, blocks.back())) {
+          cerr << "Compressed block can't be inflated \n";
+          return false;
+        }
+        index += len_block;
+        auto outer = make_tuple(data, size, index);
+        ++depth;
+        bool ok = parse(blocks.back().data(), len_raw);
+        --depth;
+        tie(data, size, index) = outer;
+        if (!ok) {
+          return false;
+        }
+        //a block of the checkpoint has been copied into the batches already
+        if (batching) {
+          blocks.pop_back();
+        }
+        continue;
       }
-      int len_val = *(int *)(data.data() + index);
-      index += 4;
 
-      //val
-      if (index + len_val > int(data.size())) {
-        cerr << "Val can't be found \n";
-        return false;
+      //check authauth or kvkvkvkv (or their 1-byte version 2 codes)
+      string_view auth_or_kv;
+      v2 = data[index] < 'A';
+      if (v2) {
+        unsigned char code = data[index] - REC_AUTHAUTH;
+        if (code >= std::size(Internal::CODES)) {
+          cerr << "Cannot define authauth or kvkvkvkv or AUTHDIFF or KVUPDATE or KVDELETE\n";
+          return false;
+        }
+        auth_or_kv = *Internal::CODES[code];
+        index += 1;
+        ++v2_records;
+      } else {
+        if (size - index < 8) {
+          cerr << "AUTHAUTH or KVKVKVKV or AUTHDIFF or KVUPDATE or KVDELETE can't be found \n";
+          return false;
+        }
+        auth_or_kv = string_view((const char *)data + index, 8);
+        index += 8;
+        ++v1_records;
       }
-      vec val(data.begin() + index, data.begin() + index + len_val);
-      index += len_val;
-
-      //empty lambda 
-      fields->kv_store.insert(key, val, empty_func);
-    } 
-
-    // AUTHDIFF: when a user's content changes in the Auth table
-    // Magic 8-byte constant AUTHDIFF
-    else if (auth_or_kv == "AUTHDIFF") {
-
-      // 4-byte binary write of the length of the username
-      if (index + 4 > int(data.size())) {
-        cerr << "Length of the username can't be found \n";
-        return false;
+      ++records;
+
+      if(auth_or_kv == "AUTHAUTH"){
+
+        //len(user), username, len(pass_hash), pass_hash, len(content), content
+        const unsigned char *user, *pass_hash, *content;
+        size_t len_user, len_pass_hash, len_content;
+        if (!read_field("Length of the username", "Username", user, len_user) ||
+            !read_field("Length of pass_hash", "Pass_hash", pass_hash,
+                        len_pass_hash) ||
+            !read_field("Length of content", "Content", content, len_content)) {
+          return false;
+        }
+
+        //adding user and user's content to auth_table
+        if (batching) {
+          Internal::AuthTableEntry new_user;
+          new_user.username.assign((const char *)user, len_user);
+          new_user.pass_hash.assign((const char *)pass_hash, len_pass_hash);
+          new_user.content.assign(content, content + len_content);
+          string username = new_user.username;
+          auth_batch.emplace_back(move(username), move(new_user));
+        } else {
+          tail.push_back({auth_or_kv, string_view((const char *)user, len_user),
+                          content, len_content, pass_hash, len_pass_hash});
+        }
+      } 
+
+      else if(auth_or_kv == "KVKVKVKV") {
+
+        //len(key), key, len(val), val
+        const unsigned char *key, *val;
+        size_t len_key, len_val;
+        if (!read_field("Length of the key", "Key", key, len_key) ||
+            !read_field("Length of the val", "Val", val, len_val)) {
+          return false;
+        }
+
+        if (batching) {
+          kv_batch.emplace_back(string((const char *)key, len_key),
+                                vec(val, val + len_val));
+        } else {
+          tail.push_back({auth_or_kv, string_view((const char *)key, len_key),
+                          val, len_val});
+        }
+      } 
+
+      // AUTHDIFF: when a user's content changes in the Auth table
+      // Magic 8-byte constant AUTHDIFF
+      else if (auth_or_kv == "AUTHDIFF") {
+        flush_batches();
+
+        // 4-byte binary write of the length of the username
+        // Binary write of the bytes of the username
+        // Binary write of num_bytes of the content
+        // If num_bytes > 0, a binary write of the bytes field
+        const unsigned char *user, *content;
+        size_t len_user, len_content;
+        if (!read_field("Length of the username", "Username", user, len_user) ||
+            !read_field("Length of content", "Content", content, len_content)) {
+          return false;
+        }
+        tail.push_back({auth_or_kv, string_view((const char *)user, len_user),
+                        content, len_content});
       }
-      int len_user = *(int *)(data.data() + index);
-      index += 4;
 
-      // Binary write of the bytes of the username
-      if (index + len_user > int(data.size())) {
-        cerr << "Username can't be found \n";
-        return false;
+      // KVUPDATE: when a key's value is changed via upsert
+      // Magic 8-byte constant KVUPDATE
+      else if(auth_or_kv == "KVUPDATE") {
+        flush_batches();
+
+        // 4-byte binary write of the length of the key
+        // Binary write of the bytes of the key
+        // Binary write of the length of value
+        // Binary write of the bytes of value
+        const unsigned char *key, *val;
+        size_t len_key, len_val;
+        if (!read_field("Length of the key", "Key", key, len_key) ||
+            !read_field("Length of the val", "Val", val, len_val)) {
+          return false;
+        }
+        tail.push_back({auth_or_kv, string_view((const char *)key, len_key),
+                        val, len_val});
       }
-      string username(data.begin() + index, data.begin() + index + len_user);
-      index += len_user;
 
-      // Binary write of num_bytes of the content
-      // If num_bytes > 0, a binary write of the bytes field
-      if (index + 4 > int(data.size())) {
-        cerr << "Length of content can't be found \n";
-        return false;
+      // KVDELETE: when a key is removed from the key/value store
+      // Magic 8-byte constant KVDELETE
+      else if (auth_or_kv == "KVDELETE") {
+        flush_batches();
+        // 4-byte binary write of the length of the key
+        // Binary write of the bytes of the key
+        const unsigned char *key;
+        size_t len_key;
+        if (!read_field("Length of the key", "Key", key, len_key)) {
+          return false;
+        }
+        tail.push_back({auth_or_kv, string_view((const char *)key, len_key)});
       }
-      int len_content = *(int *)(data.data() + index);
-      index += 4;
 
-      //content
-      if (index + len_content > int(data.size())) {
-        cerr << "Content can't be found \n";
+      else {
+        cerr << "Cannot define authauth or kvkvkvkv or AUTHDIFF or KVUPDATE or KVDELETE\n";
         return false;
       }
-      vec content_vec = vec_from_string("");
-      if(len_content != 0){
-        vec_append(content_vec, vec(data.begin() + index, data.begin() + index + len_content));
-      }
-      index += len_content;
 
-      //redo changing the content
-      auto content_change = [&](Storage::Internal::AuthTableEntry &entry){
-        entry.content = content_vec;
-      };
-      fields->auth_table.do_with(username, content_change);
+    } //end of while loop
+    if (depth == 0) {
+      record_start = index;
     }
+    return true;
+  };
 
-    // KVUPDATE: when a key's value is changed via upsert
-    // Magic 8-byte constant KVUPDATE
-    else if(auth_or_kv == "KVUPDATE") {
-
-      // 4-byte binary write of the length of the key
-      if (index + 4 > int(data.size())) {
-        cerr << "Length of the key can't be found \n";
-        return false;
-      }
-      int len_key = *(int *)(data.data() + index);
-      index += 4;
-
-      // Binary write of the bytes of the key
-      if (index + len_key > int(data.size())) {
-        cerr << "Key can't be found \n";
-        return false;
-      }
-      string key(data.begin() + index, data.begin() + index + len_key);
-      index += len_key;
-
-      // Binary write of the length of value
-      if (index + 4 > int(data.size())) {
-        cerr << "Length of the val can't be found \n";
-        return false;
-      }
-      int len_val = *(int *)(data.data() + index);
-      index += 4;
-
-      // Binary write of the bytes of value
-      if (index + len_val > int(data.size())) {
-        cerr << "Val can't be found \n";
-        return false;
-      }
-      vec val(data.begin() + index, data.begin() + index + len_val);
-      index += len_val;
-
-      //redo the operation of changing the key's value
-      if (fields->kv_store.upsert(key, val, empty_func, empty_func)) {
-        cout << "Insert Successful \n";
-      } else {
-        cout << "Update Successful \n";
-      }
+  //the data file comes first
+  if (file_size > 0 && !parse(file_data, file_size)) {
+    return false;
+  }
+  flush_batches();
+
+  //then the log segments, whose records all belong to the tail.  Only the
+  //last segment may have a torn or corrupt tail, which is cut off; the
+  //segments that were being written when the server stopped get their footers
+  size_t log_bytes = 0;
+  vector<size_t> unsealed;
+  vector<const unsigned char *> seg_data(segments.size());
+  vector<size_t> seg_intact(segments.size());
+  vector<vector<pair<size_t, size_t>>> seg_records(segments.size());
+  for (size_t i = 0; i < segments.size(); i++) {
+    size_t len;
+    bool sealed;
+    if (!map_file(segments[i].filename, seg_data[i], len)) {
+      return false;
     }
-
-    // KVDELETE: when a key is removed from the key/value store
-    // Magic 8-byte constant KVDELETE
-    else if (auth_or_kv == "KVDELETE") {
-      // 4-byte binary write of the length of the key
-      if (index + 4 > int(data.size())) {
-        cerr << "Length of the key can't be found \n";
-        return false;
-      }
-      int len_key = *(int *)(data.data() + index);
-      index += 4;
-
-      // Binary write of the bytes of the key
-      if (index + len_key > int(data.size())) {
-        cerr << "Key can't be found \n";
+    seg_records[i] =
+        wal_read_segment(seg_data[i], len, seg_intact[i], sealed);
+    if (seg_intact[i] < len) {
+      if (i + 1 < segments.size()) {
+        cerr << "Corrupt log segment: " << segments[i].filename << "\n";
         return false;
       }
-      string key(data.begin() + index, data.begin() + index + len_key);
-      index += len_key;
-
-      //redo delete
-      if (!(fields->kv_store.remove(key, empty_func))) {
-        cerr << "Key can't be found \n";
+      cout << "Cutting off " << len - seg_intact[i]
+           << " bytes of torn log tail: " << segments[i].filename << "\n";
+    }
+    if (!sealed) {
+      unsealed.push_back(i);
+    }
+    for (auto &r : seg_records[i]) {
+      if (!parse(seg_data[i] + r.first, r.second)) {
         return false;
       }
     }
+    log_bytes += seg_intact[i];
+  }
 
-    else {
-      cerr << "Cannot define authauth or kvkvkvkv or AUTHDIFF or KVUPDATE or KVDELETE\n";
+  //a segmented log's tail may repeat writes that its checkpoint already has
+  if (!fields->replay(tail, max(thread::hardware_concurrency(), 1u),
+                      fields->segmented)) {
+    return false;
+  }
+  for (size_t i : unsealed) {
+    if (!wal_seal_segment(segments[i].filename, seg_data[i], seg_intact[i],
+                          seg_records[i])) {
+      cerr << "error sealing log segment: " << segments[i].filename << "\n";
+    }
+  }
+  if (torn != SIZE_MAX) {
+    if (truncate(fields->filename.c_str(), torn) != 0) {
+      cerr << "error on truncate()\n";
       return false;
     }
-
-  } //end of while loop
+    file_size = torn;
+  }
+  {
+    lock_guard<mutex> g(fields->log_lock);
+    fields->file_bytes = file_size + log_bytes;
+  }
+  open_log();
 
   //successfully load data
   cerr << "Loaded: " << fields->filename << endl;
+
+  //startup metrics
+  double secs = chrono::duration<double>(chrono::steady_clock::now() -
+                                         start_time).count();
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  cout << "Loaded " << records << " records (" << file_size + log_bytes
+       << " bytes) in "
+       << secs << " s: " << size_t(records / max(secs, 1e-9))
+       << " records/sec, peak RSS " << usage.ru_maxrss / 1024 << " MB\n";
+
+  //a file with records of the other version is rewritten, once, in the
+  //version that is written from now on
+  if (fields->version < 2 ? v2_records > 0 : v1_records > 0) {
+    persist();
+    cout << "Rewrote " << fields->filename << " in version "
+         << fields->version << " of the record format\n";
+  }
   return true;
 
 }
@@ -379,7 +1075,8 @@ string hashPassword(string pass) {
 /// @param user_name The user name to register
 /// @param pass      The password to associate with that user name
 ///
-/// @returns False if the username already exists, true otherwise
+/// @returns False if the username already exists (or its record couldn't be
+///          made durable), true otherwise
 bool Storage::add_user(const string &user_name, const string &pass) { //diff comparison
   Internal::AuthTableEntry new_user;
   new_user.username = user_name;
@@ -391,26 +1088,21 @@ bool Storage::add_user(const string &user_name, const string &pass) { //diff com
   vec data = vec_from_string("");
 
   //lamda for adding a user to the file 
+  uint64_t lsn = 0;
   auto append_AUTHAUTH = [&](){
-    vec_append(data, fields->AUTHENTRY);
-    vec_append(data, user_name.length());
+    fields->append_code(data, fields->AUTHENTRY);
+    fields->append_len(data, user_name.length());
     vec_append(data, user_name);
-    vec_append(data, new_user.pass_hash.length());
+    fields->append_len(data, new_user.pass_hash.length());
     vec_append(data, new_user.pass_hash);
-    vec_append(data, new_user.content.size());
+    fields->append_len(data, new_user.content.size());
     vec_append(data, new_user.content);
-    bytes += 20 + user_name.length() + new_user.pass_hash.length() + new_user.content.size();
-    fwrite((char*)data.data(), sizeof(char), bytes, fields->file);
-    if(ferror(fields->file)){
-      cerr << "error on write()\n";
-    } 
-    //has to flush before sync
-    fflush(fields->file);
-    fsync(fileno(fields->file)); 
+    bytes = data.size();
+    lsn = fields->append_log(data, bytes, false);
   };
 
   bool result = fields->auth_table.insert(user_name, new_user, append_AUTHAUTH);
-  return result;
+  return fields->wait_log(lsn) && result;
 }
 
 /// Set the data bytes for a user, but do so if and only if the password
@@ -426,7 +1118,7 @@ bool Storage::add_user(const string &user_name, const string &pass) { //diff com
 vec Storage::set_user_data(const string &user_name, const string &pass,
                            const vec &content) {
   //check if user exists
-  if (!fields->auth_table.do_with_readonly(user_name, [](Storage::Internal::AuthTableEntry entry){})) {
+  if (!fields->auth_table.do_with_readonly(user_name, [](const Internal::AuthTableEntry &){})) {
     return vec_from_string(RES_ERR_LOGIN);
   }
 
@@ -440,19 +1132,15 @@ vec Storage::set_user_data(const string &user_name, const string &pass,
   vec data = vec_from_string("");
 
   //lamda to set user content
+  uint64_t lsn = 0;
   auto append_AUTHDIFF = [&](){
-    vec_append(data, fields->AUTHDIFF);
-    vec_append(data, user_name.length());
+    fields->append_code(data, fields->AUTHDIFF);
+    fields->append_len(data, user_name.length());
     vec_append(data, user_name);
-    vec_append(data, content.size());
+    fields->append_len(data, content.size());
     vec_append(data, content);
-    bytes += 16 + user_name.length() + content.size();
-    fwrite((char*)data.data(), sizeof(char), bytes, fields->file);
-    if(ferror(fields->file)){
-      cerr << "error on write()\n";
-    } 
-    fflush(fields->file);
-    fsync(fileno(fields->file)); 
+    bytes = data.size();
+    lsn = fields->append_log(data, bytes, false);
   };
 
   Internal::AuthTableEntry entry;
@@ -460,6 +1148,9 @@ vec Storage::set_user_data(const string &user_name, const string &pass,
   entry.pass_hash = hashPassword(pass);
   entry.content = content;
   fields->auth_table.upsert(user_name, entry, append_AUTHDIFF, append_AUTHDIFF);
+  if (!fields->wait_log(lsn)) {
+    return vec_from_string(RES_ERR_SERVER);
+  }
   return vec_from_string(RES_OK);
 }
 
@@ -476,7 +1167,7 @@ vec Storage::set_user_data(const string &user_name, const string &pass,
 pair<bool, vec> Storage::get_user_data(const string &user_name,
                                        const string &pass, const string &who) {
   //check if user exists
-  if (!fields->auth_table.do_with_readonly(user_name, [](Storage::Internal::AuthTableEntry entry){})) {
+  if (!fields->auth_table.do_with_readonly(user_name, [](const Internal::AuthTableEntry &){})) {
     return {true, vec_from_string(RES_ERR_LOGIN)};
   }
 
@@ -488,7 +1179,7 @@ pair<bool, vec> Storage::get_user_data(const string &user_name,
   //generate lambda to append val of key
   vec ok = vec_from_string(RES_OK);
   int size;
-  auto append_content = [&ok, &size](Storage::Internal::AuthTableEntry entry){
+  auto append_content = [&ok, &size](const Internal::AuthTableEntry &entry){
     size = entry.content.size();
     vec_append(ok, entry.content.size());
     vec_append(ok, entry.content);
@@ -515,7 +1206,7 @@ pair<bool, vec> Storage::get_user_data(const string &user_name,
 pair<bool, vec> Storage::get_all_users(const string &user_name,
                                        const string &pass) {
   //check if user exists
-  if (!fields->auth_table.do_with_readonly(user_name, [](Storage::Internal::AuthTableEntry entry){})) {
+  if (!fields->auth_table.do_with_readonly(user_name, [](const Internal::AuthTableEntry &){})) {
     return {true, vec_from_string(RES_ERR_LOGIN)};
   }
 
@@ -526,13 +1217,14 @@ pair<bool, vec> Storage::get_all_users(const string &user_name,
 
   //generate lambda to append all keys
   vec alluser = vec_from_string("");
-  auto append_username = [&alluser](string username,Storage::Internal::AuthTableEntry entry){
+  auto append_username = [&alluser](const string &username,
+                                    const Internal::AuthTableEntry &){
     vec_append(alluser, username);
     vec_append(alluser, "\r");
   };
 
-  //use helper function to avoid data racing
-  fields->auth_table.do_all_readonly(append_username, [](){});
+  //use a snapshot, so that writers don't have to wait for us
+  fields->auth_table.do_all_snapshot(append_username, [](){});
   vec ok = vec_from_string(RES_OK);
   vec_append(ok, alluser.size());
   vec_append(ok, alluser);
@@ -547,7 +1239,7 @@ pair<bool, vec> Storage::get_all_users(const string &user_name,
 /// @returns True if the user and password are valid, false otherwise
 bool Storage::auth(const string &user_name, const string &pass) {
   string pass_hash; 
-  auto get_pass = [&pass_hash](Storage::Internal::AuthTableEntry entry){
+  auto get_pass = [&pass_hash](const Internal::AuthTableEntry &entry){
     pass_hash = entry.pass_hash;
   };
   fields->auth_table.do_with_readonly(user_name, get_pass);
@@ -559,61 +1251,98 @@ bool Storage::auth(const string &user_name, const string &pass) {
 /// must be written to a temporary file (this.filename.tmp).  Then the
 /// temporary file can be renamed to replace the older version of the Storage
 /// object.
+///
+/// The tables are visited through snapshots (or, if so configured, by a
+/// forked child), so writers keep going while the file is written.  Their log
+/// records are saved from the moment each snapshot is taken, and appended to
+/// the temporary file just before the rename; only that last step holds
+/// writers up.
+///
+/// With a segmented log, the log starts a new segment before the snapshots
+/// are taken, so the new file is only a checkpoint: once it is in place, the
+/// segments before the new one are deleted.
 void Storage::persist() {
-  size_t bytes = 0;
+  lock_guard<mutex> persist_guard(fields->persist_lock);
   string tmp_filename = fields->filename + ".tmp";
-  vec data = vec_from_string("");
 
-  //lambda to append authauth
-  auto append_authauth = [&](string username, Storage::Internal::AuthTableEntry entry){
-    vec_append(data, fields->AUTHENTRY);
-    vec_append(data, entry.username.length());
-    vec_append(data, entry.username);
-    vec_append(data, entry.pass_hash.length());
-    vec_append(data, entry.pass_hash);
-    vec_append(data, entry.content.size());
-    if(entry.content.size() != 0){
-      vec_append(data, entry.content);
-    }
-    bytes += 20 + entry.username.length() + entry.pass_hash.length() + entry.content.size();
-  };
+  //the records in the segments from keep on are replayed after the new file
+  uint64_t keep = 0;
+  size_t rotated_bytes = 0;
+  if (fields->segmented) {
+    lock_guard<mutex> g(fields->log_lock);
+    keep = fields->log.rotate();
+    rotated_bytes = fields->file_bytes;
+  }
 
-  //lambda to append kvkvkvkv
-  auto append_kvkvkvkv = [&](string key, vec val){
-    vec_append(data, fields->KVENTRY);
-    vec_append(data, key.length());
-    vec_append(data, key);
-    vec_append(data, val.size());
-    vec_append(data, val);
-    bytes += 16 + key.length() + val.size();
-  };
+  //write snapshots of auth and kv.  From the moment each snapshot is taken,
+  //the table's new records go to the rewrite buffer too
+  bool ok;
+  if (fields->compaction.fork) {
+    ok = fields->fork_checkpoint(tmp_filename);
+  } else {
+    ok = fields->write_checkpoint(tmp_filename, [&](auto &auth_f, auto &kv_f) {
+      fields->auth_table.do_all_snapshot(auth_f, [&](){
+        lock_guard<mutex> g(fields->log_lock);
+        fields->rewrite_auth = true;
+      });
+      fields->with_kv([&](auto &kv) {
+        kv.do_all_snapshot(kv_f, [&](){
+          lock_guard<mutex> g(fields->log_lock);
+          fields->rewrite_kv = true;
+        });
+      });
+    });
+  }
 
-  //lambda to write and rename 
-  auto write_and_rename = [&](){
-    if(!write_file(tmp_filename, (char*)data.data(), bytes)){
+  //add the records that came after the snapshots, then atomically replace the
+  //old file.  From here on, the log appends to the new file.
+  lock_guard<mutex> g(fields->log_lock);
+  FILE *tmp = ok ? fopen(tmp_filename.c_str(), "ab") : nullptr;
+  if (tmp != nullptr) {
+    fseek(tmp, 0, SEEK_END);
+    size_t bytes = ftell(tmp);
+    if (fields->compression > 0 && !fields->rewrite.empty()) {
+      vec block;
+      block_append(block, fields->rewrite.data(), fields->rewrite.size(),
+                   fields->compression);
+      fields->rewrite.swap(block);
+    }
+    fwrite((char*)fields->rewrite.data(), sizeof(char), fields->rewrite.size(), tmp);
+    fflush(tmp);
+    ok = !ferror(tmp) && fsync(fileno(tmp)) == 0;
+    fclose(tmp);
+    if (!ok) {
       cerr << "error on write()\n";
-    } 
-    if(file_exists(fields->filename)){
-      remove(fields->filename.c_str());
+    } else if (rename(tmp_filename.c_str(), fields->filename.c_str()) != 0) {
+      cerr << "error on rename()\n";
+    } else if (fields->segmented) {
+      //only the segments from keep on are still needed
+      fields->log.remove_segments_before(keep);
+      fields->file_bytes = bytes + fields->file_bytes - rotated_bytes;
+      fields->checkpoint_bytes = bytes;
+    } else {
+      //the rename must be durable before the log's records go to the new
+      //file, or a crash could bring back the old file without them
+      sync_dir(fields->filename);
+      //the new file has every record that the log has queued
+      fields->log.reopen(fields->filename);
+      fields->file_bytes = bytes + fields->rewrite.size();
+      fields->checkpoint_bytes = bytes;
     }
-    fclose(fields->file);
-    rename(tmp_filename.c_str(), fields->filename.c_str()); 
-    fields->file = fopen(fields->filename.c_str(), "ab");
-  };
-
-  //append auth and kv to the vec_data
-  fields->auth_table.do_all_readonly(append_authauth, [&](){
-    fields->kv_store.do_all_readonly(append_kvkvkvkv, write_and_rename);
-    });
+  }
+  fields->rewrite.clear();
+  fields->rewrite_auth = false;
+  fields->rewrite_kv = false;
 }
 
 /// Shut down the storage when the server stops.
 ///
 /// NB: this is only called when all threads have stopped accessing the
-///     Storage object.  As a result, there's nothing left to do, so it's a
-///     no-op.
+///     Storage object.  As a result, all that is left is to stop the
+///     compactor, and let the log finish its last batch and close it.
 void Storage::shutdown() {
-  fclose(fields->file);
+  fields->stop_compaction();
+  fields->log.close();
 }
 
 /// Create a new key/value mapping in the table
@@ -626,9 +1355,8 @@ void Storage::shutdown() {
 /// @returns A vec with the result message
 vec Storage::kv_insert(const string &user_name, const string &pass,
                        const string &key, const vec &val) {
-
   //check if user exists
-  if (!fields->auth_table.do_with_readonly(user_name, [](Storage::Internal::AuthTableEntry entry){})) {
+  if (!fields->auth_table.do_with_readonly(user_name, [](const Internal::AuthTableEntry &){})) {
     return vec_from_string(RES_ERR_LOGIN);
   }
 
@@ -637,30 +1365,33 @@ vec Storage::kv_insert(const string &user_name, const string &pass,
     return vec_from_string(RES_ERR_LOGIN);
   }
 
-  //initializing to add to the file
-  size_t bytes = 0;
-  vec data = vec_from_string("");
-  //lamda to append adduser
-  auto append_KVENTRY = [&](){
-    vec_append(data, fields->KVENTRY);
-    vec_append(data, key.length());
-    vec_append(data, key);
-    vec_append(data, val.size());
-    vec_append(data, val);
-    bytes += 16 + key.length() + val.size();
-    fwrite((char*)data.data(), sizeof(char), bytes, fields->file);
-    if(ferror(fields->file)){
-      cerr << "error on write()\n";
-    } 
-    fflush(fields->file);
-    fsync(fileno(fields->file));
-  };
+  //val is only copied once the user is known to be allowed to store it
+  return fields->kv_insert(key, val);
+}
 
-  //check if key exists
-  if(!fields->kv_store.insert(key, val, append_KVENTRY)){
-    return vec_from_string(RES_ERR_KEY);
+/// Create a new key/value mapping in the table, moving the value into the map
+/// instead of copying it
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose mapping is being created
+/// @param val       The value to move into the map
+///
+/// @returns A vec with the result message
+vec Storage::kv_insert(const string &user_name, const string &pass,
+                       const string &key, vec &&val) {
+
+  //check if user exists
+  if (!fields->auth_table.do_with_readonly(user_name, [](const Internal::AuthTableEntry &){})) {
+    return vec_from_string(RES_ERR_LOGIN);
   }
-  return vec_from_string(RES_OK);
+
+  //check if the password matches
+  if (!auth(user_name, pass)) {
+    return vec_from_string(RES_ERR_LOGIN);
+  }
+
+  return fields->kv_insert(key, std::move(val));
 };
 
 /// Get a copy of the value to which a key is mapped
@@ -676,7 +1407,7 @@ pair<bool, vec> Storage::kv_get(const string &user_name, const string &pass,
                                 const string &key) {
 
   //check if user exists
-  if (!fields->auth_table.do_with_readonly(user_name, [](Storage::Internal::AuthTableEntry entry){})) {
+  if (!fields->auth_table.do_with_readonly(user_name, [](const Internal::AuthTableEntry &){})) {
     return {false, vec_from_string(RES_ERR_LOGIN)};
   }
 
@@ -687,14 +1418,16 @@ pair<bool, vec> Storage::kv_get(const string &user_name, const string &pass,
 
   //generate lambda to append val of key
   vec ok = vec_from_string(RES_OK);
-  auto append_val = [&ok](vec val){
+  auto append_val = [&ok](const vec &val){
     vec_append(ok, val.size());
     vec_append(ok, val);
   };
 
   //if key does not exists, returns error 
   //else, returns ok
-  if (!fields->kv_store.do_with_readonly(key, append_val)) {
+  if (!fields->with_kv([&](auto &kv) {
+        return kv.do_with_readonly(key, append_val);
+      })) {
     return {true, vec_from_string(RES_ERR_KEY)};
   }
   return {true, ok};
@@ -711,7 +1444,7 @@ vec Storage::kv_delete(const string &user_name, const string &pass,
                        const string &key) {
 
   //check if user exists
-  if (!fields->auth_table.do_with_readonly(user_name, [](Storage::Internal::AuthTableEntry entry){})) {
+  if (!fields->auth_table.do_with_readonly(user_name, [](const Internal::AuthTableEntry &){})) {
     return vec_from_string(RES_ERR_LOGIN);
   }
 
@@ -724,22 +1457,24 @@ vec Storage::kv_delete(const string &user_name, const string &pass,
   size_t bytes = 0;
   vec data = vec_from_string("");
   //lamda to append adduser
+  uint64_t lsn = 0;
   auto append_KVDELETE = [&](){
-    vec_append(data, fields->KVDELETE);
-    vec_append(data, key.length());
+    fields->append_code(data, fields->KVDELETE);
+    fields->append_len(data, key.length());
     vec_append(data, key);
-    bytes += 12 + key.length();
-    fwrite((char*)data.data(), sizeof(char), bytes, fields->file);
-    if(ferror(fields->file)){
-      cerr << "error on write()\n";
-    } 
-    fflush(fields->file);
-    fsync(fileno(fields->file));
+    bytes = data.size();
+    lsn = fields->append_log(data, bytes, true);
   };
 
   //error when key does not exist
   //ok on successfully delete 
-  if(!fields->kv_store.remove(key, append_KVDELETE)){
+  bool removed = fields->with_kv([&](auto &kv) {
+    return kv.remove(key, append_KVDELETE);
+  });
+  if (!fields->wait_log(lsn)) {
+    return vec_from_string(RES_ERR_SERVER);
+  }
+  if(!removed){
     return vec_from_string(RES_ERR_KEY);
   }
   return vec_from_string(RES_OK);
@@ -756,9 +1491,8 @@ vec Storage::kv_delete(const string &user_name, const string &pass,
 ///          messages, depending on whether we get an insert or an update.
 vec Storage::kv_upsert(const string &user_name, const string &pass,
                        const string &key, const vec &val) {
-  
   //check if user exists
-  if (!fields->auth_table.do_with_readonly(user_name, [](Storage::Internal::AuthTableEntry entry){})) {
+  if (!fields->auth_table.do_with_readonly(user_name, [](const Internal::AuthTableEntry &){})) {
     return vec_from_string(RES_ERR_LOGIN);
   }
 
@@ -767,31 +1501,34 @@ vec Storage::kv_upsert(const string &user_name, const string &pass,
     return vec_from_string(RES_ERR_LOGIN);
   }
 
-  //initializing to add to the file
-  size_t bytes = 0;
-  vec data = vec_from_string("");
-  //lamda to append adduser
-  auto append_KVUPDATE = [&](){
-    vec_append(data, fields->KVUPDATE);
-    vec_append(data, key.length());
-    vec_append(data, key);
-    vec_append(data, val.size());
-    vec_append(data, val);
-    bytes += 16 + key.length() + val.size();
-    fwrite((char*)data.data(), sizeof(char), bytes, fields->file);
-    if(ferror(fields->file)){
-      cerr << "error on write()\n";
-    } 
-    fflush(fields->file);
-    fsync(fileno(fields->file));
-  };
+  //val is only copied once the user is known to be allowed to store it
+  return fields->kv_upsert(key, val);
+}
 
-  //if key exists, return ok-upsert
-  //else, return ok-insert
-  if(!fields->kv_store.upsert(key, val, append_KVUPDATE, append_KVUPDATE)){
-    return vec_from_string(RES_OKUPD);
+/// Insert or update, so that the given key is mapped to the give value, moving
+/// the value into the map instead of copying it
+///
+/// @param user_name The name of the user who made the request
+/// @param pass      The password for the user, used to authenticate
+/// @param key       The key whose mapping is being upserted
+/// @param val       The value to move into the map
+///
+/// @returns A vec with the result message.  Note that there are two "OK"
+///          messages, depending on whether we get an insert or an update.
+vec Storage::kv_upsert(const string &user_name, const string &pass,
+                       const string &key, vec &&val) {
+  
+  //check if user exists
+  if (!fields->auth_table.do_with_readonly(user_name, [](const Internal::AuthTableEntry &){})) {
+    return vec_from_string(RES_ERR_LOGIN);
   }
-  return vec_from_string(RES_OKINS);
+
+  //check if the password matches
+  if (!auth(user_name, pass)) {
+    return vec_from_string(RES_ERR_LOGIN);
+  }
+
+  return fields->kv_upsert(key, std::move(val));
 };
 
 /// Return all of the keys in the kv_store, as a "\n"-delimited string
@@ -804,7 +1541,7 @@ vec Storage::kv_upsert(const string &user_name, const string &pass,
 pair<bool, vec> Storage::kv_all(const string &user_name, const string &pass) {
 
   //check if user exists
-  if (!fields->auth_table.do_with_readonly(user_name, [](Storage::Internal::AuthTableEntry entry){})) {
+  if (!fields->auth_table.do_with_readonly(user_name, [](const Internal::AuthTableEntry &){})) {
     return {false, vec_from_string(RES_ERR_LOGIN)};
   }
 
@@ -815,13 +1552,14 @@ pair<bool, vec> Storage::kv_all(const string &user_name, const string &pass) {
 
   //generate lambda to append all keys
   vec alluser = vec_from_string("");
-  auto append_username = [&alluser](string key, vec val){
+  auto append_username = [&alluser](const string &key, const vec &){
     vec_append(alluser, key);
     vec_append(alluser, "\r");
   };
 
-  //use helper function to avoid data racing
-  fields->kv_store.do_all_readonly(append_username, [](){});
+  //use a snapshot, so that writers don't have to wait for us
+  fields->with_kv(
+      [&](auto &kv) { kv.do_all_snapshot(append_username, [](){}); });
   vec ok = vec_from_string(RES_OK);
   vec_append(ok, alluser.size());
   vec_append(ok, alluser);
@@ -6,6 +6,8 @@
 
 #include "../common/vec.h"
 
+#include "server_persist.h"
+
 /// Storage is the main data type managed by the server.  It currently provides
 /// access to two concurrent maps.  The first is an authentication table.  The
 /// authentication table holds user names and hashed passwords, as well as a
@@ -65,6 +67,23 @@
 /// Note that there are other operations that need to incrementally persist
 /// by adding to the file, but they do not need DIFF messages... they can use
 /// AUTHAUTH and KVKVKVKV.
+///
+/// With durability.version 2, every record is written more compactly: its
+/// 8-byte code becomes a 1-byte record_code_t, and its 4-byte lengths become
+/// varints.  The log's records also go in batch frames, one per group commit,
+/// so that a batch torn by a crash can be cut off at load time.  Records of
+/// both versions can be loaded; a file that has records of the version that
+/// isn't written is rewritten once it is loaded.
+///
+/// With durability.compression, the checkpoint is written as compressed
+/// blocks of about 1 MB of records each, and so is each of the log's group
+/// commits (see record_code_t).
+///
+/// If durability.segment_bytes is set, the DIFF entries (and the AUTHAUTH and
+/// KVKVKVKV entries of new users and keys) go to a write-ahead log of segment
+/// files instead (see LogWriter), and the file only holds a checkpoint.  A
+/// torn record at the end of the log is cut off at load time, and the segments
+/// from before a checkpoint are deleted once it is written.
 class Storage {
   /// Internal is the class that stores all the members of a Storage object.  To
   /// avoid pulling too much into the .h file, we are using the PIMPL pattern
@@ -78,9 +97,20 @@ public:
   /// Construct an empty object and specify the file from which it should be
   /// loaded.  To avoid exceptions and errors in the constructor, the act of
   /// loading data is separate from construction.
-  Storage(const std::string &fname, size_t num_buckets);
+  ///
+  /// @param fname       The name of the file that should be used to load/store
+  ///                    the data
+  /// @param num_buckets The number of buckets for the hash
+  /// @param shards      The number of kv_store shards, each owned by its own
+  ///                    thread (0 for a single shared table)
+  /// @param durability  When the incremental persistence log makes records
+  ///                    durable
+  /// @param compaction  When the file is compacted in the background
+  Storage(const std::string &fname, size_t num_buckets, size_t shards = 0,
+          durability_t durability = durability_t(),
+          compaction_t compaction = compaction_t());
 
-  /// Destructor for the storage object.
+  /// Destructor for the storage object.  This stops background compaction.
   ~Storage();
 
   /// Populate the Storage object by loading this.filename.  Note that load()
@@ -98,7 +128,8 @@ public:
   /// @param user_name The user name to register
   /// @param pass      The password to associate with that user name
   ///
-  /// @returns False if the username already exists, true otherwise
+  /// @returns False if the username already exists (or its record couldn't be
+  ///          made durable), true otherwise
   bool add_user(const std::string &user_name, const std::string &pass);
 
   /// Set the data bytes for a user, but do so if and only if the password
@@ -151,6 +182,9 @@ public:
   /// must be written to a temporary file (this.filename.tmp).  Then the
   /// temporary file can be renamed to replace the older version of the Storage
   /// object.
+  ///
+  /// This is also how the file is compacted in the background, once the log
+  /// has made it large enough.
   void persist();
 
   /// Shut down the storage when the server stops.  This method needs to close
@@ -171,6 +205,18 @@ public:
   vec kv_insert(const std::string &user_name, const std::string &pass,
                 const std::string &key, const vec &val);
 
+  /// Create a new key/value mapping in the table, moving the value into the
+  /// map instead of copying it
+  ///
+  /// @param user_name The name of the user who made the request
+  /// @param pass      The password for the user, used to authenticate
+  /// @param key       The key whose mapping is being created
+  /// @param val       The value to move into the map
+  ///
+  /// @returns A vec with the result message
+  vec kv_insert(const std::string &user_name, const std::string &pass,
+                const std::string &key, vec &&val);
+
   /// Get a copy of the value to which a key is mapped
   ///
   /// @param user_name The name of the user who made the request
@@ -205,6 +251,19 @@ public:
   vec kv_upsert(const std::string &user_name, const std::string &pass,
                 const std::string &key, const vec &val);
 
+  /// Insert or update, so that the given key is mapped to the give value,
+  /// moving the value into the map instead of copying it
+  ///
+  /// @param user_name The name of the user who made the request
+  /// @param pass      The password for the user, used to authenticate
+  /// @param key       The key whose mapping is being upserted
+  /// @param val       The value to move into the map
+  ///
+  /// @returns A vec with the result message.  Note that there are two "OK"
+  ///          messages, depending on whether we get an insert or an update.
+  vec kv_upsert(const std::string &user_name, const std::string &pass,
+                const std::string &key, vec &&val);
+
   /// Return all of the keys in the kv_store, as a "\n"-delimited string
   ///
   /// @param user_name The name of the user who made the request
@@ -10,6 +10,7 @@ import subprocess
 import os
 import time
 import filecmp
+import glob
 import sys
 
 indentation = 75
@@ -289,6 +290,23 @@ def verify_filesize(filename, expect):
     else:
         print("["+red("ERR: " + str(s))+"]")
 
+def truncate_file(filename, size):
+    """Cut a file down to its first 'size' bytes"""
+    os.truncate(filename, size)
+
+def find_files(prefix):
+    """Get the names of the files whose names start with prefix, sorted"""
+    return sorted(glob.glob(prefix + "*"))
+
+def verify_filecount(prefix, expect):
+    """Compare the number of files whose names start with prefix to an expected value"""
+    n = len(find_files(prefix))
+    print(("Checking number of " + prefix + "* files (expect " + str(expect) + ")").ljust(indentation), end="")
+    if (n == expect):
+        print("["+green("OK")+"]")
+    else:
+        print("["+red("ERR: " + str(n))+"]")
+
 def build_file(filename, size):
     """Create a file named 'filename' that consists of 'size' bytes"""
     f = open(filename, "w")
@@ -161,4 +161,187 @@ cse303.line()
 cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
 cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
 cse303.line()
-cse303.clean_common_files(server, client)
\ No newline at end of file
+cse303.clean_common_files(server, client)
+# A segmented log (-g) should survive a write that was torn by a crash, by
+# cutting it off at load time, and should drop the segments that a SAV makes
+# unneeded.  Two large values fill the first 1 MB segment, so that the
+# upsert of k3 goes to the last one.
+bigfile = "bigfile"
+cse303.build_file(bigfile, 700000)
+walprefix = server.dirfile + ".wal."
+server.pid = cse303.do_cmd("Starting server with 1 MB log segments.", "File not found: " + server.dirfile, server.launchcmd() + ["-g", "1"])
+cse303.waitfor(2)
+cse303.do_cmd("Registering new user alice.", "OK", client.reg(alice))
+cse303.do_cmd("Setting key k1.", "OK", client.kvI(alice, k1, bigfile))
+cse303.do_cmd("Setting key k2.", "OK", client.kvI(alice, k2, bigfile))
+cse303.do_cmd("Setting key k3.", "OK", client.kvI(alice, k3, k3file1))
+cse303.do_cmd("Upserting key k3.", "OKUPD", client.kvU(alice, k3, bigfile))
+cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
+cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
+cse303.verify_filecount(walprefix, 2)
+segments = cse303.find_files(walprefix)
+cse303.truncate_file(segments[-1], cse303.get_len(segments[-1]) // 2)
+server.pid = cse303.do_cmd("Restarting server after tearing the last segment.", "Loaded: " + server.dirfile, server.launchcmd() + ["-g", "1"])
+cse303.waitfor(2)
+cse303.do_cmd("Checking key k1.", "OK", client.kvG(alice, k1))
+cse303.check_file_result(bigfile, k1)
+cse303.do_cmd("Checking key k2.", "OK", client.kvG(alice, k2))
+cse303.check_file_result(bigfile, k2)
+cse303.do_cmd("Checking that k3 lost its torn upsert.", "OK", client.kvG(alice, k3))
+cse303.check_file_result(k3file1, k3)
+cse303.do_cmd("Instructing server to persist data.", "OK", client.persist(alice))
+cse303.verify_filecount(walprefix, 1)
+cse303.line()
+cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
+cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
+server.pid = cse303.do_cmd("Restarting server to check persistence.", "Loaded: " + server.dirfile, server.launchcmd() + ["-g", "1"])
+cse303.waitfor(2)
+cse303.do_cmd("Checking key k2.", "OK", client.kvG(alice, k2))
+cse303.check_file_result(bigfile, k2)
+cse303.do_cmd("Checking key k3.", "OK", client.kvG(alice, k3))
+cse303.check_file_result(k3file1, k3)
+cse303.line()
+
+# Clean up
+cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
+cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
+cse303.line()
+for f in cse303.find_files(walprefix):
+    cse303.delfile(f)
+cse303.delfile(bigfile)
+cse303.clean_common_files(server, client)
+
+def varint_len(n):
+    """Get the number of bytes in the varint encoding of n"""
+    bytes = 1
+    while n >= 128:
+        n >>= 7
+        bytes += 1
+    return bytes
+
+def v2_size(name, content_file, auth):
+    """Get the size of a version 2 AUTHAUTH (if auth) or KVKVKVKV record"""
+    size = 1 + varint_len(len(name)) + len(name)
+    if auth:
+        size += varint_len(16) + 16
+    content = cse303.get_len(content_file)
+    return size + varint_len(content) + content
+
+def check_persistence(flags):
+    """Run the REG/SET/KVI/KVU/KVD sequence from the start of this script on a
+    new data file, with extra flags for the server.  Since the file's size
+    depends on the flags, the data is checked after each restart instead."""
+    launch = server.launchcmd() + flags
+    def restart():
+        cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
+        cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
+        server.pid = cse303.do_cmd("Restarting server to check persistence.", "Loaded: " + server.dirfile, launch)
+        cse303.waitfor(2)
+    server.pid = cse303.do_cmd("Starting server with " + " ".join(flags) + ".", "File not found: " + server.dirfile, launch)
+    cse303.waitfor(2)
+    cse303.do_cmd("Registering new user alice.", "OK", client.reg(alice))
+    restart()
+    cse303.do_cmd("Registering new user alice.", "ERR_USER_EXISTS", client.reg(alice))
+    cse303.do_cmd("Checking alice's content.", "ERR_NO_DATA", client.getC(alice, alice.name))
+    cse303.do_cmd("Setting alice's content.", "OK", client.setC(alice, afile1))
+    restart()
+    cse303.do_cmd("Checking alice's content.", "OK", client.getC(alice, alice.name))
+    cse303.check_file_result(afile1, alice.name)
+    cse303.do_cmd("Setting key k1.", "OK", client.kvI(alice, k1, k1file1))
+    restart()
+    cse303.do_cmd("Checking key k1.", "OK", client.kvG(alice, k1))
+    cse303.check_file_result(k1file1, k1)
+    cse303.do_cmd("Upserting key k1.", "OKUPD", client.kvU(alice, k1, k1file2))
+    restart()
+    cse303.do_cmd("Checking key k1.", "OK", client.kvG(alice, k1))
+    cse303.check_file_result(k1file2, k1)
+    cse303.do_cmd("Deleting key k1.", "OK", client.kvD(alice, k1))
+    restart()
+    cse303.do_cmd("Checking key k1.", "ERR_KEY", client.kvG(alice, k1))
+    cse303.do_cmd("Upserting key k2.", "OKINS", client.kvU(alice, k2, k2file1))
+    cse303.do_cmd("Upserting key k2.", "OKUPD", client.kvU(alice, k2, k2file2))
+    restart()
+    cse303.do_cmd("Checking key k2.", "OK", client.kvG(alice, k2))
+    cse303.check_file_result(k2file2, k2)
+    cse303.do_cmd("Instructing server to persist data.", "OK", client.persist(alice))
+    restart()
+    cse303.do_cmd("Checking alice's content.", "OK", client.getC(alice, alice.name))
+    cse303.check_file_result(afile1, alice.name)
+    cse303.do_cmd("Checking key k1.", "ERR_KEY", client.kvG(alice, k1))
+    cse303.do_cmd("Checking key k2.", "OK", client.kvG(alice, k2))
+    cse303.check_file_result(k2file2, k2)
+    cse303.line()
+    cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
+    cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
+    cse303.line()
+
+# The same sequence should work with the version 2 record format (-v 2), and
+# its checkpoint should hold 1-byte codes and varint lengths
+check_persistence(["-v", "2"])
+cse303.verify_filesize(server.dirfile, v2_size(alice.name, afile1, True) + v2_size(k2, k2file2, False))
+cse303.delfile(server.dirfile)
+cse303.line()
+
+# A version 1 file should be rewritten in version 2 when -v 2 loads it, and
+# should then reload with the same contents
+server.pid = cse303.do_cmd("Starting server.", "File not found: " + server.dirfile, server.launchcmd())
+cse303.waitfor(2)
+cse303.do_cmd("Registering new user alice.", "OK", client.reg(alice))
+cse303.do_cmd("Setting alice's content.", "OK", client.setC(alice, afile2))
+cse303.do_cmd("Setting key k1.", "OK", client.kvI(alice, k1, k1file1))
+cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
+cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
+cse303.verify_filesize(server.dirfile, 8 + 4 + len(alice.name) + 4 + 16 + 4 + 8 + 4 + len(alice.name) + 4 + cse303.get_len(afile2) + 8 + 4 + len(k1) + 4 + cse303.get_len(k1file1))
+server.pid = cse303.do_cmd("Restarting server with -v 2.", "Loaded: " + server.dirfile, server.launchcmd() + ["-v", "2"])
+cse303.waitfor(2)
+cse303.verify_filesize(server.dirfile, v2_size(alice.name, afile2, True) + v2_size(k1, k1file1, False))
+cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
+cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
+server.pid = cse303.do_cmd("Restarting server to check persistence.", "Loaded: " + server.dirfile, server.launchcmd() + ["-v", "2"])
+cse303.waitfor(2)
+cse303.do_cmd("Checking alice's content.", "OK", client.getC(alice, alice.name))
+cse303.check_file_result(afile2, alice.name)
+cse303.do_cmd("Checking key k1.", "OK", client.kvG(alice, k1))
+cse303.check_file_result(k1file1, k1)
+cse303.do_cmd("Upserting key k3.", "OKINS", client.kvU(alice, k3, k3file1))
+cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
+cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
+cse303.truncate_file(server.dirfile, cse303.get_len(server.dirfile) - 1)
+server.pid = cse303.do_cmd("Restarting server after tearing the last batch.", "Loaded: " + server.dirfile, server.launchcmd() + ["-v", "2"])
+cse303.waitfor(2)
+cse303.do_cmd("Checking key k1.", "OK", client.kvG(alice, k1))
+cse303.check_file_result(k1file1, k1)
+cse303.do_cmd("Checking that k3's torn insert is gone.", "ERR_KEY", client.kvG(alice, k3))
+cse303.line()
+
+# Clean up
+cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
+cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
+cse303.line()
+cse303.delfile(server.dirfile)
+
+# The same sequence should work with compression (-x 1).  A compressed log
+# batch that was torn by a crash should be cut off at load time, without
+# losing the batches before it.
+check_persistence(["-x", "1"])
+server.pid = cse303.do_cmd("Restarting server with -x 1.", "Loaded: " + server.dirfile, server.launchcmd() + ["-x", "1"])
+cse303.waitfor(2)
+cse303.do_cmd("Upserting key k2.", "OKUPD", client.kvU(alice, k2, k2file1))
+cse303.do_cmd("Upserting key k3.", "OKINS", client.kvU(alice, k3, k3file1))
+cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
+cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
+cse303.truncate_file(server.dirfile, cse303.get_len(server.dirfile) - 1)
+server.pid = cse303.do_cmd("Restarting server after tearing the last batch.", "Loaded: " + server.dirfile, server.launchcmd() + ["-x", "1"])
+cse303.waitfor(2)
+cse303.do_cmd("Checking key k2.", "OK", client.kvG(alice, k2))
+cse303.check_file_result(k2file1, k2)
+cse303.do_cmd("Checking that k3's torn insert is gone.", "ERR_KEY", client.kvG(alice, k3))
+cse303.do_cmd("Checking alice's content.", "OK", client.getC(alice, alice.name))
+cse303.check_file_result(afile1, alice.name)
+cse303.line()
+
+# Clean up
+cse303.do_cmd("Stopping server.", "OK", client.bye(alice))
+cse303.await_server("Waiting for server to shut down.", "Server terminated", server.pid)
+cse303.line()
+cse303.clean_common_files(server, client)